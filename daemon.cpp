@@ -0,0 +1,521 @@
+
+#include <cstdio>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#include "defs.hpp"
+#include "transport.hpp"
+
+// Render service. Clients connect to a Unix socket and send one job per
+// line; each gets a reply line when its image is saved. Built scenes are
+// kept serialized in an LRU cache, so a job for a cached scene only
+// patches the resolution and camera into the buffer and sends it. A
+// cached scene is built again when its .scene file or any of its mesh
+// files changed on disk; material and texture files aren't checked.
+//
+// A job is a ';'-separated list of fields:
+//   scene <path>; out <path>[; res <w> <h>][; <camera prop>]...
+// with camera props as in a .scene file (eye, axis_angle, uvw,
+// focal_len, proj_size), overriding the scene's. Replies are
+// "ok <ms>" or "error <message>". "shutdown" stops the service once
+// queued jobs are done.
+
+#ifndef _WIN32
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct render_job
+{
+    fs::path scene, out;
+    std::pair<uint, uint> res = { 0, 0 };
+    std::vector<std::string> camera_props;
+    std::promise<std::string> reply;
+};
+
+static std::string trim(std::string_view s)
+{
+    while (!s.empty() && is_ws(s.front())) { s.remove_prefix(1); }
+    while (!s.empty() && (is_ws(s.back()) || s.back() == '\r')) { s.remove_suffix(1); }
+    return std::string(s);
+}
+
+// Returns an empty string if line is a valid job, else what is wrong.
+static std::string parse_job(std::string_view line, render_job& job)
+{
+    camera check = {};
+    while (!line.empty())
+    {
+        size_t end = line.find(';');
+        std::string field = trim(line.substr(0, end));
+        line.remove_prefix(end == line.npos ? line.size() : end + 1);
+        if (field.empty()) { continue; }
+
+        if (field.starts_with("scene ")) {
+            job.scene = trim(std::string_view(field).substr(6));
+        }
+        else if (field.starts_with("out ")) {
+            job.out = trim(std::string_view(field).substr(4));
+        }
+        else if (field.starts_with("res "))
+        {
+            uint w = 0, h = 0;
+            if (std::sscanf(field.c_str() + 4, "%u %u", &w, &h) != 2 || w == 0 || h == 0) {
+                return "invalid resolution";
+            }
+            job.res = { w, h };
+        }
+        else
+        {
+            const char* err = nullptr;
+            int prop = parse_camera_prop(field, check, err);
+            if (prop < 0) { return err; }
+            else if (prop == 0) { return "unrecognized field '" + field + "'"; }
+            job.camera_props.push_back(field);
+        }
+    }
+    if (job.scene.extension() != ".scene") {
+        return "missing .scene file";
+    } else if (job.out.empty()) {
+        return "missing output file";
+    }
+    return {};
+}
+
+// A built scene, serialized. Read-only once built: jobs patch the
+// header and camera section of their device's copy.
+struct cached_scene
+{
+    std::vector<uint> buf;
+    camera C;
+    std::pair<uint, uint> R;
+    // the .scene file and its mesh files, with their times when built
+    std::vector<std::pair<fs::path, fs::file_time_type>> files;
+
+    bool changed_on_disk() const
+    {
+        std::error_code ec;
+        return ranges::any_of(files, [&](const auto& f) {
+            return fs::last_write_time(f.first, ec) != f.second;
+        });
+    }
+};
+
+class scene_cache
+{
+public:
+    scene_cache(size_t max_bytes, const scene_opts& opts) :
+        m_max(max_bytes), m_opts(opts)
+    {}
+
+    // nullptr if the scene failed to build.
+    std::shared_ptr<cached_scene> get(const render_job& job, bool& hit)
+    {
+        std::error_code ec;
+        const auto mtime = fs::last_write_time(job.scene, ec);
+        std::string key = fs::absolute(job.scene, ec).lexically_normal().string();
+        if (m_opts.view_dependent())
+        {
+            // the build itself depends on the view, so it is part of the key
+            key += "\n" + std::to_string(job.res.first) + "x" + std::to_string(job.res.second);
+            for (const auto& p : job.camera_props) { key += "\n" + p; }
+        }
+
+        std::unique_lock lk(m_mtx);
+        for (auto it = m_map.find(key); it != m_map.end(); it = m_map.find(key))
+        {
+            m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+            auto fut = it->second.scene;
+            lk.unlock();
+
+            auto sc = fut.get();
+            if (!sc) { return nullptr; }
+            else if (!sc->changed_on_disk())
+            {
+                hit = true;
+                std::lock_guard lk2(m_mtx);
+                m_hits++;
+                return sc;
+            }
+
+            // changed on disk since: build again, unless someone is already
+            lk.lock();
+            it = m_map.find(key);
+            if (it != m_map.end() && is_ready(it->second.scene) && it->second.scene.get() == sc) {
+                drop(it);
+            }
+        }
+        hit = false;
+        m_misses++;
+
+        // others asking for the same scene wait for this build
+        std::promise<std::shared_ptr<cached_scene>> built;
+        m_lru.push_front(key);
+        m_map[key] = { built.get_future().share(), m_lru.begin(), 0 };
+        lk.unlock();
+
+        auto sc = build(job, mtime);
+        built.set_value(sc);
+
+        lk.lock();
+        auto it = m_map.find(key);
+        if (!sc)
+        {
+            if (it != m_map.end()) { drop(it); }
+            return nullptr;
+        }
+        if (it != m_map.end())
+        {
+            it->second.bytes = sc->buf.size() * sizeof(uint);
+            m_bytes += it->second.bytes;
+        }
+        evict(key);
+        return sc;
+    }
+
+    void print_stats()
+    {
+        std::lock_guard lk(m_mtx);
+        std::printf("Scene cache: %zu hit(s), %zu miss(es), %zu scene(s) in %.1f MB\n",
+            m_hits, m_misses, m_map.size(), m_bytes / 1e6);
+    }
+
+private:
+    struct slot
+    {
+        std::shared_future<std::shared_ptr<cached_scene>> scene;
+        std::list<std::string>::iterator lru;
+        size_t bytes; // 0 while building
+    };
+
+    template <typename F>
+    static bool is_ready(const F& f) {
+        return f.wait_for(chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    void drop(std::unordered_map<std::string, slot>::iterator it)
+    {
+        m_bytes -= it->second.bytes;
+        m_lru.erase(it->second.lru);
+        m_map.erase(it);
+    }
+
+    // Least recently used first, except keep and scenes being built.
+    // Jobs holding an evicted scene keep it alive until they are done.
+    void evict(const std::string& keep)
+    {
+        auto l = m_lru.end();
+        while (m_bytes > m_max && l != m_lru.begin())
+        {
+            --l;
+            auto it = m_map.find(*l);
+            if (*l == keep || it->second.bytes == 0) { continue; }
+            l = std::next(l);
+            drop(it);
+        }
+    }
+
+    std::shared_ptr<cached_scene> build(const render_job& job, fs::file_time_type mtime)
+    {
+        scene_opts opts = m_opts;
+        if (opts.view_dependent()) {
+            opts.camera_props = job.camera_props;
+            opts.res = job.res;
+        }
+        Scene scene(job.scene, opts);
+        if (!scene) { return nullptr; }
+
+        auto sc = std::make_shared<cached_scene>();
+        sc->buf.resize(scene.nserial());
+        scene.serialize(sc->buf.data());
+        sc->C = scene.C;
+        sc->R = scene.R;
+        sc->files.emplace_back(job.scene, mtime);
+        for (const auto& p : scene.mesh_paths())
+        {
+            std::error_code ec;
+            sc->files.emplace_back(p, fs::last_write_time(p, ec));
+        }
+        return sc;
+    }
+
+    std::mutex m_mtx;
+    std::list<std::string> m_lru; // most recent first
+    std::unordered_map<std::string, slot> m_map;
+    size_t m_bytes = 0, m_max;
+    size_t m_hits = 0, m_misses = 0;
+    scene_opts m_opts;
+};
+
+// Sets the resolution and camera of a serialized scene.
+static void patch_view(std::vector<uint>& buf, serial_format fmt,
+    std::pair<uint, uint> res, const camera& C)
+{
+    buf[1] = res.first;
+    buf[2] = res.second;
+    // header: magic, resX, resY, numL, numBV, camera (meshlet: numML, camera)
+    uint camoff = buf[fmt == serial_format::Meshlet ? 6 : 5];
+    C.serialize(buf.data() + camoff);
+}
+
+struct render_service
+{
+    render_service(size_t cache_bytes, const scene_opts& opts) :
+        cache(cache_bytes, opts), fmt(opts.ser_fmt), verbose(opts.verbose)
+    {}
+
+    scene_cache cache;
+    serial_format fmt;
+    bool verbose;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::unique_ptr<render_job>> queue;
+    bool stopping = false;
+    uint njobs = 0, nfailed = 0;
+
+    // A device's copy of the last scene it was sent, patched per job, so
+    // devices don't wait on each other to send the same scene.
+    struct device_scene
+    {
+        std::shared_ptr<cached_scene> sc;
+        std::vector<uint> buf;
+    };
+
+    // Renders one job on a device, returns the reply.
+    std::string render(transport& dev, device_scene& ds, render_job& job)
+    {
+        auto tbeg = chrono::steady_clock::now();
+        bool hit = false;
+        auto sc = cache.get(job, hit);
+        if (!sc) {
+            return "error could not build " + job.scene.string();
+        }
+
+        camera C = sc->C;
+        for (const auto& p : job.camera_props)
+        {
+            const char* err;
+            parse_camera_prop(p, C, err); // checked when queued
+        }
+        const auto res = job.res.first != 0 ? job.res : sc->R;
+
+        struct frame_end {
+            transport& t;
+            ~frame_end() { t.end_frame(); }
+        } fe{ dev };
+
+        if (ds.sc != sc)
+        {
+            ds.buf = sc->buf;
+            ds.sc = sc;
+        }
+        patch_view(ds.buf, fmt, res, C);
+        const char* method = "";
+        if (dev.send_scene(ds.buf, -1, method) != 0) {
+            return "error failed to send scene to " + dev.name();
+        }
+
+        std::span<const char> img;
+        if (dev.recv_image(img) != 0) {
+            return "error no image from " + dev.name();
+        } else if (img.size() != size_t(res.first) * res.second * 3) {
+            return "error image from " + dev.name() + " has the wrong size";
+        }
+        if (save_image(job.out, img.data(), res.first, res.second) != 0) {
+            return "error could not save " + job.out.string();
+        }
+
+        double ms = chrono::duration<double, std::milli>(chrono::steady_clock::now() - tbeg).count();
+        std::printf("%s -> %s on %s (%s) in %.1f ms\n", job.scene.string().c_str(),
+            job.out.string().c_str(), dev.name().c_str(), hit ? "cached" : "built", ms);
+        char reply[32];
+        std::snprintf(reply, sizeof(reply), "ok %.1f", ms);
+        return reply;
+    }
+
+    void device_worker(transport& dev)
+    {
+        device_scene ds;
+        for (;;)
+        {
+            std::unique_ptr<render_job> job;
+            {
+                std::unique_lock lk(mtx);
+                cv.wait(lk, [&] { return stopping || !queue.empty(); });
+                if (queue.empty()) { return; }
+                job = std::move(queue.front());
+                queue.pop_front();
+            }
+            std::string reply = render(dev, ds, *job);
+            {
+                std::lock_guard lk(mtx);
+                njobs++;
+                if (!reply.starts_with("ok")) { nfailed++; }
+            }
+            job->reply.set_value(std::move(reply));
+        }
+    }
+
+    // Returns false once the service should stop.
+    bool handle_line(int fd, std::string_view line)
+    {
+        std::string l = trim(line);
+        std::string reply;
+        bool stop = false;
+        if (l.empty()) { return true; }
+        else if (l == "shutdown")
+        {
+            reply = "ok";
+            stop = true;
+        }
+        else
+        {
+            auto job = std::make_unique<render_job>();
+            std::string err = parse_job(l, *job);
+            if (!err.empty()) {
+                reply = "error " + err;
+            }
+            else
+            {
+                auto fut = job->reply.get_future();
+                {
+                    std::lock_guard lk(mtx);
+                    if (!stopping) { queue.push_back(std::move(job)); }
+                }
+                cv.notify_one();
+                reply = job ? "error shutting down" : fut.get();
+            }
+        }
+        reply += '\n';
+        for (size_t sent = 0; sent < reply.size(); )
+        {
+            ssize_t r = ::send(fd, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+            if (r <= 0) { break; }
+            sent += size_t(r);
+        }
+        return !stop;
+    }
+
+    // Returns true if the client asked for a shutdown.
+    bool serve_client(int fd)
+    {
+        std::string pending;
+        char buf[4096];
+        for (;;)
+        {
+            ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) { return false; }
+            pending.append(buf, size_t(n));
+
+            size_t nl;
+            while ((nl = pending.find('\n')) != pending.npos)
+            {
+                std::string line = pending.substr(0, nl);
+                pending.erase(0, nl + 1);
+                if (!handle_line(fd, line)) { return true; }
+            }
+        }
+    }
+};
+
+int run_daemon(const fs::path& socket_path, std::vector<std::unique_ptr<transport>>& devices,
+    size_t cache_bytes, const scene_opts& opts)
+{
+    const std::string path = socket_path.string();
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        return mERROR("socket path too long: %s", path.c_str());
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    int lsock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lsock < 0) {
+        return mERROR("could not create socket (%s)", std::strerror(errno));
+    }
+    // a socket file nobody listens on is left over from a crash
+    if (::connect(lsock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
+        ::close(lsock);
+        return mERROR("%s is in use by another service", path.c_str());
+    }
+    ::close(lsock);
+    ::unlink(path.c_str());
+
+    lsock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lsock < 0 ||
+        ::bind(lsock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        ::listen(lsock, 64) != 0) {
+        int e = errno;
+        if (lsock >= 0) { ::close(lsock); }
+        return mERROR("could not listen on %s (%s)", path.c_str(), std::strerror(e));
+    }
+
+    render_service svc(cache_bytes, opts);
+    std::printf("Serving render jobs on %s with %zu device(s)\n", path.c_str(), devices.size());
+
+    std::vector<std::jthread> workers;
+    for (auto& dev : devices) {
+        workers.emplace_back([&svc, &dev] { svc.device_worker(*dev); });
+    }
+
+    // clients come and go for as long as the service runs, so their
+    // threads are detached and counted instead of joined
+    std::mutex cmtx;
+    std::condition_variable cdone;
+    std::vector<int> clients;
+    for (;;)
+    {
+        int csock = ::accept(lsock, nullptr, nullptr);
+        if (csock < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) { continue; }
+            break; // shut down
+        }
+        std::lock_guard lk(cmtx);
+        clients.push_back(csock);
+        std::thread([&, csock]
+        {
+            if (svc.serve_client(csock)) {
+                ::shutdown(lsock, SHUT_RDWR); // wakes accept()
+            }
+            std::lock_guard lk(cmtx);
+            std::erase(clients, csock);
+            ::close(csock);
+            cdone.notify_all();
+        }).detach();
+    }
+
+    // let queued jobs finish, then hang up on idle clients
+    {
+        std::lock_guard lk(svc.mtx);
+        svc.stopping = true;
+    }
+    svc.cv.notify_all();
+    workers.clear();
+    {
+        std::unique_lock lk(cmtx);
+        for (int c : clients) { ::shutdown(c, SHUT_RDWR); }
+        cdone.wait(lk, [&] { return clients.empty(); });
+    }
+    ::close(lsock);
+    ::unlink(path.c_str());
+
+    std::printf("Rendered %u job(s), %u failed\n", svc.njobs, svc.nfailed);
+    svc.cache.print_stats();
+    return 0;
+}
+
+#else
+
+int run_daemon(const fs::path&, std::vector<std::unique_ptr<transport>>&, size_t, const scene_opts&)
+{
+    return mERROR("the render service needs Unix sockets");
+}
+
+#endif
@@ -8,6 +8,10 @@
 #include <limits>
 #include <vector>
 #include <array>
+#include <span>
+#include <map>
+#include <mutex>
+#include <future>
 
 #include "utils.hpp"
 
@@ -157,6 +161,122 @@ inline std::ostream& operator<<(std::ostream& os, const vec3& vec) {
     return os;
 }
 
+// Octahedral unit vector encoding, 2x16-bit snorm (x in the low half).
+uint oct_encode(const vec3& n);
+vec3 oct_decode(uint enc);
+
+// Affine transform (3x4 matrix, row-major).
+struct xform
+{
+    float m[3][4];
+
+    static constexpr xform identity() noexcept
+    {
+        return { {
+            { 1, 0, 0, 0 },
+            { 0, 1, 0, 0 },
+            { 0, 0, 1, 0 } } };
+    }
+
+    bool is_identity() const noexcept
+    {
+        auto I = identity();
+        return std::memcmp(m, I.m, sizeof(m)) == 0;
+    }
+
+    // transform point
+    vec3 apply(const vec3& p) const noexcept
+    {
+        return {
+            m[0][0] * p[0] + m[0][1] * p[1] + m[0][2] * p[2] + m[0][3],
+            m[1][0] * p[0] + m[1][1] * p[1] + m[1][2] * p[2] + m[1][3],
+            m[2][0] * p[0] + m[2][1] * p[1] + m[2][2] * p[2] + m[2][3] };
+    }
+
+    // transform direction (ignores translation)
+    vec3 apply_dir(const vec3& d) const noexcept
+    {
+        return {
+            m[0][0] * d[0] + m[0][1] * d[1] + m[0][2] * d[2],
+            m[1][0] * d[0] + m[1][1] * d[1] + m[1][2] * d[2],
+            m[2][0] * d[0] + m[2][1] * d[1] + m[2][2] * d[2] };
+    }
+
+    xform operator*(const xform& rhs) const noexcept
+    {
+        xform r;
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                r.m[i][j] = m[i][0] * rhs.m[0][j] +
+                    m[i][1] * rhs.m[1][j] + m[i][2] * rhs.m[2][j];
+            }
+            r.m[i][3] += m[i][3];
+        }
+        return r;
+    }
+
+    // determinant of linear part
+    float det() const noexcept
+    {
+        return
+            m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+            m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+            m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    }
+
+    // Returns false if the transform is singular.
+    bool inverse(xform& inv) const noexcept
+    {
+        float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+        float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+        float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+        float det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+        if (det == 0) { return false; }
+
+        float id = 1 / det;
+        inv.m[0][0] = c00 * id;
+        inv.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * id;
+        inv.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * id;
+        inv.m[1][0] = c01 * id;
+        inv.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * id;
+        inv.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * id;
+        inv.m[2][0] = c02 * id;
+        inv.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * id;
+        inv.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * id;
+
+        vec3 t = inv.apply_dir({ m[0][3], m[1][3], m[2][3] });
+        inv.m[0][3] = -t[0];
+        inv.m[1][3] = -t[1];
+        inv.m[2][3] = -t[2];
+        return true;
+    }
+
+    static constexpr uint nserial = 12;
+
+    void serialize(uint* p) const
+    {
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                *p++ = to_fixedpt(m[i][j]);
+            }
+        }
+    }
+
+    // Transform for normals (inverse transpose, no translation).
+    // Results must be renormalized.
+    xform normal_xform() const noexcept
+    {
+        xform inv, r = identity();
+        if (!inverse(inv)) { return r; }
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j) {
+                r.m[i][j] = inv.m[j][i];
+            }
+        }
+        return r;
+    }
+};
+
 // Material
 struct mat
 {
@@ -236,6 +356,20 @@ struct camera
     }
 };
 
+enum camera_prop
+{
+    camera_eye = 1,
+    camera_uvw = 2, // axis_angle or uvw
+    camera_focal_len = 4,
+    camera_proj_size = 8,
+    camera_all_props = 15
+};
+
+// Parses a camera property as written in a .scene file (e.g.
+// "eye 0 1 5") into C. Returns the camera_prop it set, 0 if the line
+// is not a camera property, or -1 with err set if it is invalid.
+int parse_camera_prop(std::string_view line, camera& C, const char*& err);
+
 // Axis-aligned bounding box
 struct bbox
 {
@@ -249,6 +383,13 @@ struct bbox
 
     vec3 center() const { return 0.5 * (cmin + cmax); }
 
+    // Surface area (0 if empty).
+    float area() const
+    {
+        vec3 d = (cmax - cmin).cwiseMax({ 0, 0, 0 });
+        return 2 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+    }
+
     static constexpr uint nserial = 2 * vec3::nserial;
 
     void serialize(uint* p) const
@@ -284,6 +425,176 @@ struct tri
     static constexpr uint nserial = textures_enabled() ? 10 : 7;
 };
 
+// Moller-Trumbore setup for one triangle, already in the 16.16 words
+// the FPGA gets: first vertex, the two edges from it, and the unit
+// geometric normal (e1 x e2, zero if the edges are collinear). The edges are differences of fixed-point
+// vertices, so v0 + e1 and v0 + e2 are exactly the other vertices and
+// triangles sharing an edge stay watertight.
+struct tri_isect
+{
+    using fixed3 = std::array<uint, vec3::nserial>;
+    fixed3 v0, e1, e2, n;
+
+    static constexpr uint nserial = 4 * vec3::nserial;
+
+    void serialize(uint* p) const
+    {
+        for (const fixed3* w : { &v0, &e1, &e2, &n }) {
+            p = std::copy(w->begin(), w->end(), p);
+        }
+    }
+};
+
+inline bbox get_tri_bbox(
+    const std::vector<vec3>& V, const std::array<int, 3>& tri)
+{
+    bbox bb;
+    for (int i = 0; i < 3; ++i)
+    {
+        bb.cmin = bb.cmin.cwiseMin(V[tri[i]]);
+        bb.cmax = bb.cmax.cwiseMax(V[tri[i]]);
+    }
+    return bb;
+}
+
+inline bbox get_nodes_bbox(
+    const tri* tris_beg, const tri* tris_end)
+{
+    bbox bb;
+    for (auto* p = tris_beg; p < tris_end; ++p)
+    {
+        bb.cmin = bb.cmin.cwiseMin(p->bb.cmin);
+        bb.cmax = bb.cmax.cwiseMax(p->bb.cmax);
+    }
+    return bb;
+}
+
+// Slab test. t_near is where the ray enters the box (can be negative
+// if it starts inside).
+inline bool ray_hits_bbox(const vec3& rorig, const vec3& rdir, const bbox& bb, float& t_near)
+{
+    float t_entry = -std::numeric_limits<float>::infinity();
+    float t_exit = std::numeric_limits<float>::infinity();
+
+    for (int k = 0; k < 3; ++k)
+    {
+        if (rdir[k] == 0) {
+            continue;
+        }
+        float t1 = (bb.cmin[k] - rorig[k]) / rdir[k];
+        float t2 = (bb.cmax[k] - rorig[k]) / rdir[k];
+        
+        if (rdir[k] > 0) {
+            t_entry = std::max(t_entry, t1);
+            t_exit = std::min(t_exit, t2);
+        }
+        else {
+            t_entry = std::max(t_entry, t2);
+            t_exit = std::min(t_exit, t1);
+        }
+    }
+    t_near = t_entry;
+    return t_exit >= t_entry && t_exit >= 0;
+}
+
+// Moller-Trumbore. Returns the distance along rdir, or infinity.
+inline float ray_tri(const vec3& rorig, const vec3& rdir, 
+    const vec3& v0, const vec3& v1, const vec3& v2)
+{
+    constexpr float eps = 1e-7f;
+    const float miss = std::numeric_limits<float>::infinity();
+
+    vec3 e1 = v1 - v0, e2 = v2 - v0;
+    vec3 pv = rdir.cross(e2);
+    float det = e1.dot(pv);
+    if (std::abs(det) < eps) { return miss; }
+
+    float inv_det = 1 / det;
+    vec3 tv = rorig - v0;
+    float u = tv.dot(pv) * inv_det;
+    if (u < 0 || u > 1) { return miss; }
+
+    vec3 qv = tv.cross(e1);
+    float v = rdir.dot(qv) * inv_det;
+    if (v < 0 || u + v > 1) { return miss; }
+
+    float t = e2.dot(qv) * inv_det;
+    return t > eps ? t : miss;
+}
+
+// Geometry from a single mesh file.
+// Indices are local to the mesh. Missing normals, UVs
+// and materials are marked with -1 (fixed by Scene).
+struct mesh
+{
+    std::vector<vec3> V; // vertices
+    std::vector<vec3> NV; // normals
+#if ENABLE_TEXTURES
+    std::vector<uv> UV; // texture coords
+#endif
+    std::vector<mat> M; // materials
+    std::vector<tri> F; // triangles (bb not set)
+};
+
+// Load mesh file (.obj, binary .ply, .glb or .rtmesh).
+int load_mesh(const fs::path& path, mesh& out, bool verbose = false);
+
+// Mesh files loaded once and shared, read-only, by scenes built on
+// several threads (see scene_opts::meshes).
+class mesh_cache
+{
+public:
+    // Loads the file on first use; threads asking for it meanwhile
+    // wait for that load.
+    int get(const fs::path& path, bool verbose, std::shared_ptr<const mesh>& out);
+
+    size_t size() const; // files loaded
+    size_t requests() const;
+
+private:
+    using entry = std::shared_future<std::shared_ptr<const mesh>>;
+
+    mutable std::mutex m_mtx;
+    std::map<fs::path, entry> m_meshes; // by canonical path, null if failed
+    size_t m_requests = 0;
+};
+
+// Save mesh in native binary format (.rtmesh).
+// This is the fastest format to load.
+int save_rtmesh(const fs::path& path, const mesh& m);
+
+// Save an RGB image (3 bytes per pixel, top row first) in the format
+// given by the extension: .png (encoded on all threads), .qoi, .ppm,
+// .bmp, or anything else as raw bytes.
+int save_image(const fs::path& path, const char* rgb, uint width, uint height);
+
+// Save a scene buffer as a C header with a static array named after
+// the file. Formatted on all threads and streamed to disk.
+int write_c_header(const fs::path& path, std::span<const uint> buf);
+
+// Save a scene buffer as an ELF relocatable object for target (see
+// is_obj_target()), or for a .s/.S path as GNU assembly that includes
+// a .bin written next to it. Defines <name> and <name>_len (words),
+// named after the file.
+int write_object(const fs::path& path, std::span<const uint> buf, const std::string& target);
+bool is_obj_target(const std::string& target);
+
+enum class send_method
+{
+    Buffered, // plain send()
+    Sendfile, // sendfile() from the page cache
+    Zerocopy, // MSG_ZEROCOPY from user memory
+    ZerocopyCopied // MSG_ZEROCOPY, but the kernel copied (e.g. loopback)
+};
+
+// Sends one frame (a 4-byte length in network byte order, then the
+// payload) on a connected TCP socket, without copying the payload
+// where possible: with sendfile() if fd is a file holding the payload
+// at offset 0, with MSG_ZEROCOPY otherwise. Falls back to plain send()
+// if neither is available. Linux only, returns -1 elsewhere.
+int send_frame_zerocopy(int sock, const void* data, size_t nbytes, int fd,
+    send_method& used, bool verbose = false);
+
 enum class serial_format
 {
     // duplicate vertices, normals, and UVs instead of using indices.
@@ -291,15 +602,179 @@ enum class serial_format
     // memory usage significantly
     Duplicate,
     // keep the indices and don't duplicate.
-    NoDuplicate
+    NoDuplicate,
+    // each BV's triangles form a meshlet with its own vertex and
+    // normal tables and packed 8 or 16-bit local indices, so a BV
+    // can be fetched in one burst. much smaller than Duplicate.
+    Meshlet
 };
 
-struct Scene
+// Fixed header sizes of each format, in words.
+
+// magic, resX, resY, numL, numBV, camOff, BVoff, 
+// Voff, NVoff, Foff, NFoff, MFoff, Moff, Loff, optional: UVoff, UFoff
+inline constexpr int nhdr_noduplicate = 14 + 2 * textures_enabled();
+
+// magic, resX, resY, numL, numBV, camOff, BVoff, 
+// FVoff, FNVoff, FMoff, Loff, optional: FUVoff
+inline constexpr int nhdr_duplicate = 11 + textures_enabled();
+
+// sizes of the Duplicate FV and FNV sections
+inline uint dup_fv_nserial(size_t ntris, bool quantized) {
+    return quantized ? packed_words(ntris * 9, 16) : uint(ntris) * 3 * vec3::nserial;
+}
+inline uint dup_fnv_nserial(size_t ntris, bool quantized) {
+    return quantized ? uint(ntris) * 3 : uint(ntris) * 3 * vec3::nserial;
+}
+
+// magic, resX, resY, numL, numBV, numML, camOff, BVoff, 
+// MLoff, Moff, Loff
+inline constexpr int nhdr_meshlet = 11;
+
+// Optional serialized sections. If any are present, they are listed
+// in a directory right after the fixed header (count, then id/offset
+// pairs). Readers that don't know about them are unaffected since
+// every other section is located through its offset in the header.
+enum class serial_ext : uint
+{
+    // numI, then per instance: first BV, num BVs, 
+    // object-to-world xform, world-to-object xform, world bbox
+    Instances = 1,
+    // Quantized geometry (scene_opts::quantize). log2 of the lattice
+    // step in 16.16 units, then per BV: lattice origin (3 words, 16.16).
+    // Positions are 3x16-bit offsets from their BV's origin, normals are
+    // octahedral 2x16-bit snorm.
+    Quantization = 2,
+    // Precomputed intersection data (scene_opts::isect_data).
+    // One tri_isect per triangle, in triangle order.
+    TriIsect = 3,
+    // BV visiting orders (bv_order::Octant). First triangle of each BV,
+    // then for each ray direction octant (see dir_octant), all BV
+    // indices in visiting order. Each object's BVs stay in its range.
+    BVOrder = 4,
+    // Lights that can reach each BV (scene_opts::light_cutoff). Per BV,
+    // a bitmask of ceil(numL / 32) words, bit i of word i / 32 for L[i].
+    LightMask = 5,
+    // Shadow classes (scene_opts::shadow_samples). Per BV, 2 bits per 
+    // light (a shadow_class) packed LSB first into ceil(numL / 16) words.
+    ShadowMask = 6
+};
+
+// Shadow state of all points of a BV with respect to one light.
+enum class shadow_class : byte
+{
+    Trace = 0, // mixed or unknown, trace shadow rays
+    Lit = 1,
+    Occluded = 2
+};
+
+// Order in which BVs are serialized or visited.
+enum class bv_order
+{
+    // as built (median split leaves)
+    Tree,
+    // sorted by distance from the camera
+    Front,
+    // tree order, plus a near-to-far order for each ray direction octant
+    Octant
+};
+
+// Octant of a ray direction, bit k set if component k is negative.
+inline uint dir_octant(const vec3& d)
+{
+    return uint(d[0] < 0) | (uint(d[1] < 0) << 1) | (uint(d[2] < 0) << 2);
+}
+
+struct scene_opts
 {
     // max_bv must be a power of 2.
-    Scene(const fs::path& scene_path, const uint max_bv, 
-        serial_format ser_fmt = serial_format::Duplicate, 
-        bool verbose = false);
+    uint max_bv = 128;
+    serial_format ser_fmt = serial_format::Duplicate;
+    bv_order bv_ord = bv_order::Tree;
+    // Allow BV nodes to be split by a plane, with triangles crossing it
+    // referenced from both sides, adding up to split_budget * numTris
+    // references (so 0.25 is 25% more). 0 is off.
+    float split_budget = 0;
+    // Keep meshes in object space with per-mesh BVs and an
+    // instance table, instead of baking each instance.
+    bool instancing = false;
+    // Drop triangles that cannot affect the image (outside the view
+    // frustum expanded by cull_margin, and outside shadow ray bounds).
+    bool cull = false;
+    float cull_margin = 0;
+    // Simplify objects so the scene has at most tri_budget
+    // triangles, favoring those that cover more pixels. 0 is off.
+    size_t tri_budget = 0;
+    // Send positions as 16-bit offsets within each BV and normals as
+    // 32-bit octahedral (Duplicate and Meshlet formats only).
+    bool quantize = false;
+    // Add precomputed ray-triangle intersection data.
+    bool isect_data = false;
+    // Mark a light as reaching a BV only if its brightest channel, with
+    // inverse-square falloff to the nearest point of the BV, is at
+    // least light_cutoff. 0 is off.
+    float light_cutoff = 0;
+    // Classify BV/light pairs as lit, occluded or mixed by casting up
+    // to shadow_samples rays on the host. 0 is off.
+    uint shadow_samples = 0;
+    // When refitting to a new frame, rebuild the BVs instead once their
+    // SAH cost has grown by this factor since they were built.
+    float refit_threshold = 1.5f;
+    // Camera properties (as in a .scene file) and resolution that
+    // replace the scene file's. {0, 0} keeps the file's resolution.
+    std::vector<std::string> camera_props;
+    std::pair<uint, uint> res = { 0, 0 };
+    // Take meshes from here instead of loading them. nullptr loads
+    // them for this scene only.
+    mesh_cache* meshes = nullptr;
+    bool verbose = false;
+
+    // Whether the scene built depends on the camera or resolution
+    // (beyond the camera section and header).
+    bool view_dependent() const {
+        return cull || tri_budget > 0 || bv_ord == bv_order::Front;
+    }
+};
+
+// Triangles and BVs belonging to one mesh.
+struct object
+{
+    uint Fbeg, Fend;
+    uint BVbeg, BVend; // set by BV construction
+};
+
+// Placement of an object in the world (two-level layout only).
+struct instance
+{
+    uint obj; // index of object
+    xform T; // object to world
+
+    static constexpr uint nserial = 2 + 2 * xform::nserial + bbox::nserial;
+};
+
+// Triangles of one BV with local vertex and normal tables (Meshlet 
+// format). A BV only spans several meshlets if a table would
+// overflow 16-bit indices.
+struct meshlet
+{
+    uint bv; // not serialized
+    uint Fbeg, Fend;
+    std::vector<int> V, NV; // global ids of local entries
+#if ENABLE_TEXTURES
+    std::vector<int> UV;
+#endif
+    std::vector<uint16_t> idx; // per tri: local V, NV (and UV) indices
+    uint idxbits; // 8 or 16
+
+    // data offset, ntris, numV, numNV, optional: numUV, idxbits
+    static constexpr uint nhdr = 5 + textures_enabled();
+    // V, NV, (UV) tables, packed indices, 16-bit matids
+    uint ndata(bool quantized) const;
+};
+
+struct Scene
+{
+    Scene(const fs::path& scene_path, const scene_opts& opts);
 
     camera C; // camera
     std::pair<uint, uint> R; // resolution
@@ -315,6 +790,13 @@ struct Scene
     std::vector<tri> F; // triangles
     std::vector<bv> BV; // bounding volumes
 
+    // Objects. Without instancing, meshes are baked into world space 
+    // and become a single object once BVs are built.
+    std::vector<object> O;
+    std::vector<instance> I; // instances (two-level layout only)
+    std::vector<meshlet> ML; // meshlets (Meshlet format only)
+    std::array<std::vector<uint>, 8> BVoct; // BV orders (Octant order only)
+
     const std::string& name() const { return m_scname; }
 
     bool ok() const { return m_ok; }
@@ -326,18 +808,84 @@ struct Scene
     uint nserial() const;
     void serialize(uint* buf) const;
 
+    // World-space bounds of an instance.
+    bbox inst_bbox(const instance& inst) const;
+
+    // Moves the vertices to a new frame and refits the BVs, or rebuilds
+    // them if they got too loose (then rebuilt is set and the scene must
+    // be serialized again). A frame has one mesh per mesh file of the
+    // scene, in the order they are first referenced, with the same vertices.
+    int refit(const std::vector<mesh>& frame, bool& rebuilt);
+    // Nonzero (with an error printed) if this scene can't be refitted.
+    int check_refit() const;
+    // Rewrites only the BV and vertex sections of a buffer filled by
+    // serialize(), after a refit without rebuild.
+    void serialize_refit(uint* buf) const;
+    // SAH cost of the BVs: expected triangle tests for a ray hitting the scene.
+    float sah_cost() const;
+    // Mesh files the scene was built from, in the order they are first referenced.
+    const std::vector<fs::path>& mesh_paths() const { return m_meshpaths; }
+
 private:
-    int read_scenefile(const fs::path& scenepath, std::vector<fs::path>& out_objpaths);
-    int read_objs(const std::vector<fs::path>& objpaths);
+    // mesh file reference from the .scene file
+    struct obj_ref
+    {
+        fs::path path;
+        xform T;
+    };
+
+    int read_scenefile(const fs::path& scenepath, std::vector<obj_ref>& out_objrefs);
+    int read_objs(const std::vector<obj_ref>& objrefs);
+    int apply_view_opts();
+
+    int cull_tris();
+    void remove_tris(const std::vector<char>& keep);
+    void compact_verts();
+    void remove_degenerate_tris(std::vector<int>& fixidx);
+
+    int simplify_tris(size_t budget);
 
     int init_bvs(const uint max_bv);
     void gather_bvs(tri* tris_beg, tri* tris_end, uint depth = 0);
+    void gather_bvs_split(std::vector<tri>&& tris, uint depth,
+        size_t budget, std::vector<tri>& out);
+    std::vector<uint> bv_tri_offsets() const;
+    std::vector<bbox> bv_tri_bounds(const std::vector<uint>& BVbeg) const;
+    void order_bvs();
+    void reorder_verts();
+    int build_meshlets();
+    uint* serialize_meshlet(const meshlet& ml, uint* p) const;
+
+    int quantize_geometry();
+    std::array<uint16_t, 3> quantize_pos(uint bvid, const vec3& v) const;
+    vec3 dequantize_pos(uint bvid, const std::array<uint16_t, 3>& q) const;
+    uint* serialize_quantized_dup(uint* p) const;
+
+    int build_isect_data();
+    int build_light_masks();
+    int build_shadow_masks();
+
+    std::vector<std::pair<serial_ext, uint>> ext_sections() const;
+    uint* serialize_ext(serial_ext ext, uint* p) const;
 
 private:
     std::string m_scname;
-    serial_format m_serfmt;
-    bool m_verbose;
+    scene_opts m_opts;
     uint m_bv_stop_depth;
+    size_t m_nsplit_refs; // references added by spatial splits
+    uint m_qshift; // lattice step is 1 << m_qshift in 16.16
+    std::vector<std::array<int64_t, 3>> m_qorigin; // per BV, in 16.16
+    std::vector<tri_isect> m_isect;
+    std::vector<uint> m_lightmask; // per BV
+    std::vector<uint> m_shadowmask; // per BV
+    // Vertex sources, for refitting: index into a frame and into m_refT.
+    // Empty when vertices can't be traced back to the mesh files.
+    std::vector<int> m_Vsrc;
+    std::vector<uint> m_Vxf;
+    std::vector<xform> m_refT; // transform of each mesh reference
+    std::vector<int> m_frameVbase; // first vertex of each mesh in a frame
+    std::vector<fs::path> m_meshpaths;
+    float m_sah_built; // SAH cost when BVs were built
     bool m_ok;
 };
 
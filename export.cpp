@@ -0,0 +1,308 @@
+
+#include <cstdio>
+#include <cstring>
+
+#include "defs.hpp"
+
+// Scene buffers for firmware: as a C header, or as an object file that
+// links in without compiling anything.
+
+// C identifier from a file stem.
+static std::string c_symbol(const fs::path& path)
+{
+    std::string name = path.stem().string();
+    for (char& c : name)
+    {
+        bool alnum = ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || ('0' <= c && c <= '9');
+        if (!alnum) { c = '_'; }
+    }
+    if (name.empty() || ('0' <= name[0] && name[0] <= '9')) {
+        name.insert(name.begin(), '_');
+    }
+    return name;
+}
+
+// ----------------------------- C header ------------------------------
+
+// Every word is printed as 0x%08x, 12 to a line, so each line has the
+// same length and chunks of lines can be formatted independently.
+static constexpr size_t hdr_words_per_line = 12;
+static constexpr size_t hdr_lines_per_chunk = 8192;
+static constexpr size_t hdr_line_chars = 5 + hdr_words_per_line * 12; // "\n    ", "0x%08x, "
+
+static size_t format_hdr_lines(std::span<const uint> words, bool last, char* out)
+{
+    static constexpr char hex[] = "0123456789abcdef";
+    char* p = out;
+    for (size_t i = 0; i < words.size(); ++i)
+    {
+        if (i % hdr_words_per_line == 0) {
+            std::memcpy(p, "\n    ", 5);
+            p += 5;
+        }
+        const uint w = words[i];
+        p[0] = '0'; p[1] = 'x';
+        for (int k = 0; k < 8; ++k) {
+            p[2 + k] = hex[(w >> (28 - 4 * k)) & 0xf];
+        }
+        p += 10;
+        if (!last || i + 1 != words.size()) {
+            p[0] = ','; p[1] = ' ';
+            p += 2;
+        }
+    }
+    return size_t(p - out);
+}
+
+int write_c_header(const fs::path& outpath, std::span<const uint> buf)
+{
+    const std::string name = c_symbol(outpath);
+    std::string guard = name;
+    for (char& c : guard) {
+        c = to_upper(c);
+    }
+    guard += "_H";
+
+    scopedFILE f = SAFE_FOPEN(outpath.c_str(), "wb");
+    if (!f) { return mERROR("could not open output file"); }
+
+    const std::string head = "#ifndef " + guard + "\n#define " + guard +
+        "\nstatic const int " + name + "[] = {";
+    bool ok = std::fwrite(head.data(), 1, head.size(), f.get()) == head.size();
+
+    // a batch of chunks is formatted on all threads, then written
+    // out in order while memory stays bounded
+    const size_t chunk_words = hdr_words_per_line * hdr_lines_per_chunk;
+    const size_t nchunks = (buf.size() + chunk_words - 1) / chunk_words;
+    const size_t batch = 2 * num_threads();
+    std::vector<std::vector<char>> text(std::min(batch, nchunks));
+    std::vector<size_t> len(text.size());
+
+    for (size_t c0 = 0; ok && c0 < nchunks; c0 += batch)
+    {
+        const size_t n = std::min(batch, nchunks - c0);
+        parallel_for(n, [&](size_t i)
+        {
+            const size_t beg = (c0 + i) * chunk_words;
+            const size_t end = std::min(buf.size(), beg + chunk_words);
+            text[i].resize(hdr_lines_per_chunk * hdr_line_chars);
+            len[i] = format_hdr_lines(buf.subspan(beg, end - beg), end == buf.size(), text[i].data());
+        });
+        for (size_t i = 0; ok && i < n; ++i) {
+            ok = std::fwrite(text[i].data(), 1, len[i], f.get()) == len[i];
+        }
+    }
+
+    static constexpr char tail[] = "\n};\n#endif\n";
+    ok = ok && std::fwrite(tail, 1, sizeof(tail) - 1, f.get()) == sizeof(tail) - 1;
+    if (!ok) {
+        return mERROR("could not write file");
+    }
+    return 0;
+}
+
+// ---------------------------- object file ----------------------------
+
+// The buffer goes in .rodata as <name> (64-byte aligned), followed by
+// <name>_len, its length in words. Words are stored little-endian,
+// which all supported targets are.
+
+struct obj_target
+{
+    const char* name;
+    bool elf64;
+    uint16_t machine;
+    uint32_t flags;
+};
+
+static constexpr obj_target obj_targets[] = {
+    { "arm", false, 40, 0x05000000 }, // EABI version 5
+    { "aarch64", true, 183, 0 },
+    { "x86_64", true, 62, 0 },
+    { "nios2", false, 113, 0 },
+};
+
+// Little-endian ELF fields, sized for the target's class.
+struct elf_buf
+{
+    bool elf64;
+    std::vector<byte> b;
+
+    void u8(uint v) { b.push_back(byte(v)); }
+    void u16(uint v) { u8(v); u8(v >> 8); }
+    void u32(uint32_t v) { u16(v & 0xffff); u16(v >> 16); }
+    void u64(uint64_t v) { u32(uint32_t(v)); u32(uint32_t(v >> 32)); }
+    void addr(uint64_t v) { elf64 ? u64(v) : u32(uint32_t(v)); }
+    void pad_to(size_t n) { b.resize(std::max(b.size(), n)); }
+};
+
+static int write_elf(FILE* f, const std::string& name, std::span<const uint> buf, const obj_target& t)
+{
+    enum { SHT_PROGBITS = 1, SHT_SYMTAB = 2, SHT_STRTAB = 3 };
+    enum { SHF_ALLOC = 2 };
+    enum { STB_GLOBAL = 1, STT_OBJECT = 1 };
+    enum : uint16_t { ShRodata = 1, ShSymtab, ShStrtab, ShNoteStack, ShShstrtab, ShCount };
+
+    const bool e64 = t.elf64;
+    const size_t ehsize = e64 ? 64 : 52;
+    const size_t shentsize = e64 ? 64 : 40;
+    const size_t symsize = e64 ? 24 : 16;
+    const uint64_t nbytes = buf.size_bytes();
+    if (!e64 && nbytes + 4 > std::numeric_limits<uint32_t>::max() - 4096) {
+        return mERROR("scene too large for a 32-bit object file");
+    }
+
+    const std::string strtab = std::string(1, '\0') + name + '\0' + name + "_len" + '\0';
+    static constexpr char shstrtab[] = "\0.rodata\0.symtab\0.strtab\0.note.GNU-stack\0.shstrtab";
+    const uint32_t shname[ShCount] = { 0, 1, 9, 17, 25, 41 };
+
+    // layout: header, .rodata, then everything else
+    const uint64_t rodata_off = 64;
+    const uint64_t rodata_size = nbytes + 4;
+    const uint64_t symtab_off = round_up(rodata_off + rodata_size, 8);
+    const uint64_t symtab_size = 3 * symsize;
+    const uint64_t strtab_off = symtab_off + symtab_size;
+    const uint64_t shstrtab_off = strtab_off + strtab.size();
+    const uint64_t shoff = round_up(shstrtab_off + sizeof(shstrtab), 8);
+
+    elf_buf h = { e64, {} };
+    const byte ident[16] = { 0x7f, 'E', 'L', 'F', byte(e64 ? 2 : 1), 1 /* LE */, 1 /* version */ };
+    h.b.assign(ident, ident + 16);
+    h.u16(1); // ET_REL
+    h.u16(t.machine);
+    h.u32(1);
+    h.addr(0); // entry
+    h.addr(0); // program headers
+    h.addr(shoff);
+    h.u32(t.flags);
+    h.u16(uint(ehsize));
+    h.u16(0); h.u16(0);
+    h.u16(uint(shentsize));
+    h.u16(ShCount);
+    h.u16(ShShstrtab);
+    h.pad_to(rodata_off);
+
+    elf_buf tail = { e64, {} };
+    tail.pad_to(symtab_off - (rodata_off + rodata_size));
+
+    // null symbol, <name>, <name>_len
+    auto sym = [&](uint32_t nameoff, uint64_t value, uint64_t size)
+    {
+        tail.u32(nameoff);
+        if (e64) {
+            tail.u8(STB_GLOBAL << 4 | STT_OBJECT); tail.u8(0); tail.u16(ShRodata);
+            tail.u64(value); tail.u64(size);
+        } else {
+            tail.u32(uint32_t(value)); tail.u32(uint32_t(size));
+            tail.u8(STB_GLOBAL << 4 | STT_OBJECT); tail.u8(0); tail.u16(ShRodata);
+        }
+    };
+    tail.pad_to(tail.b.size() + symsize);
+    sym(1, 0, nbytes);
+    sym(uint32_t(name.size() + 2), nbytes, 4);
+    tail.b.insert(tail.b.end(), strtab.begin(), strtab.end());
+    tail.b.insert(tail.b.end(), shstrtab, shstrtab + sizeof(shstrtab));
+    tail.pad_to(shoff - (rodata_off + rodata_size));
+
+    auto shdr = [&](uint32_t nm, uint32_t type, uint64_t flags, uint64_t off, uint64_t size,
+        uint32_t link, uint32_t info, uint64_t align, uint64_t entsize)
+    {
+        tail.u32(nm); tail.u32(type);
+        tail.addr(flags); tail.addr(0); tail.addr(off); tail.addr(size);
+        tail.u32(link); tail.u32(info);
+        tail.addr(align); tail.addr(entsize);
+    };
+    tail.pad_to(tail.b.size() + shentsize);
+    shdr(shname[ShRodata], SHT_PROGBITS, SHF_ALLOC, rodata_off, rodata_size, 0, 0, 64, 0);
+    // sh_info: index of the first global symbol
+    shdr(shname[ShSymtab], SHT_SYMTAB, 0, symtab_off, symtab_size, ShStrtab, 1, 8, symsize);
+    shdr(shname[ShStrtab], SHT_STRTAB, 0, strtab_off, strtab.size(), 0, 0, 1, 0);
+    // no executable stack needed
+    shdr(shname[ShNoteStack], SHT_PROGBITS, 0, shstrtab_off, 0, 0, 0, 1, 0);
+    shdr(shname[ShShstrtab], SHT_STRTAB, 0, shstrtab_off, sizeof(shstrtab), 0, 0, 1, 0);
+
+    bool ok = std::fwrite(h.b.data(), 1, h.b.size(), f) == h.b.size();
+    if constexpr (std::endian::native == std::endian::little) {
+        ok = ok && std::fwrite(buf.data(), 1, nbytes, f) == nbytes;
+    }
+    else
+    {
+        auto swapped = std::make_unique_for_overwrite<uint[]>(buf.size());
+        parallel_bswap32(buf.data(), swapped.get(), buf.size());
+        ok = ok && std::fwrite(swapped.get(), 1, nbytes, f) == nbytes;
+    }
+    elf_buf len = { e64, {} };
+    len.u32(uint32_t(buf.size()));
+    ok = ok && std::fwrite(len.b.data(), 1, 4, f) == 4;
+    ok = ok && std::fwrite(tail.b.data(), 1, tail.b.size(), f) == tail.b.size();
+    if (!ok) {
+        return mERROR("could not write file");
+    }
+    return 0;
+}
+
+// GNU assembler source that pulls in a .bin written next to it.
+static int write_incbin(const fs::path& outpath, const std::string& name, std::span<const uint> buf)
+{
+    fs::path binpath = outpath;
+    binpath.replace_extension(".bin");
+    if (int e = write_file(binpath, buf.data(), buf.size())) {
+        return e;
+    }
+
+    scopedFILE f = SAFE_FOPEN(outpath.c_str(), "wb");
+    if (!f) { return mERROR("could not open output file"); }
+
+    const char* n = name.c_str();
+    const std::string bin = binpath.filename().string();
+    int r = std::fprintf(f.get(),
+        "/* scene buffer, assemble with -I<dir of %s> */\n"
+        "    .section .rodata\n"
+        "    .balign 64\n"
+        "    .globl %s\n"
+        "    .type %s, %%object\n"
+        "%s:\n"
+        "    .incbin \"%s\"\n"
+        "    .size %s, . - %s\n"
+        "    .balign 4\n"
+        "    .globl %s_len\n"
+        "    .type %s_len, %%object\n"
+        "%s_len:\n"
+        "    .long %zu\n"
+        "    .size %s_len, 4\n"
+        "    .section .note.GNU-stack,\"\",%%progbits\n",
+        bin.c_str(), n, n, n, bin.c_str(), n, n, n, n, n, buf.size(), n);
+    if (r < 0) {
+        return mERROR("could not write file");
+    }
+    return 0;
+}
+
+bool is_obj_target(const std::string& name)
+{
+    for (auto& t : obj_targets) {
+        if (name == t.name) { return true; }
+    }
+    return false;
+}
+
+int write_object(const fs::path& outpath, std::span<const uint> buf, const std::string& target)
+{
+    const std::string name = c_symbol(outpath);
+    const fs::path ext = outpath.extension();
+    if (ext == ".s" || ext == ".S") {
+        return write_incbin(outpath, name, buf);
+    }
+
+    const obj_target* t = nullptr;
+    for (auto& tt : obj_targets) {
+        if (target == tt.name) { t = &tt; }
+    }
+    if (!t) {
+        return mERROR("unknown object target '%s'", target.c_str());
+    }
+
+    scopedFILE f = SAFE_FOPEN(outpath.c_str(), "wb");
+    if (!f) { return mERROR("could not open output file"); }
+    return write_elf(f.get(), name, buf, *t);
+}
@@ -0,0 +1,443 @@
+
+#include <cstdio>
+#include <cstring>
+#include <array>
+
+#include "defs.hpp"
+#include "io.h"
+
+#if RT_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// Image output. The image arrives as packed RGB rows, which PPM
+// takes as is and PNG/QOI encode while writing, without copying
+// the whole image first.
+
+static void put_be32(byte* p, uint32_t v)
+{
+    p[0] = byte(v >> 24); p[1] = byte(v >> 16);
+    p[2] = byte(v >> 8); p[3] = byte(v);
+}
+
+// ------------------------------- PPM ---------------------------------
+
+static int write_ppm(FILE* f, const byte* rgb, uint w, uint h)
+{
+    size_t n = size_t(w) * h * 3;
+    if (std::fprintf(f, "P6\n%u %u\n255\n", w, h) < 0 ||
+        std::fwrite(rgb, 1, n, f) != n) {
+        return mERROR("could not write file");
+    }
+    return 0;
+}
+
+// ------------------------------- QOI ---------------------------------
+
+// https://qoiformat.org/qoi-specification.pdf. The format is serial
+// (each pixel refers to the ones before it), so this is one pass
+// through a small output buffer.
+static int write_qoi(FILE* f, const byte* rgb, uint w, uint h)
+{
+    enum : byte { OP_INDEX = 0x00, OP_DIFF = 0x40, OP_LUMA = 0x80, OP_RUN = 0xc0, OP_RGB = 0xfe };
+    struct px { byte r, g, b, a; };
+
+    std::vector<byte> out(1 << 16);
+    size_t pos = 0;
+    auto flush = [&] {
+        bool ok = std::fwrite(out.data(), 1, pos, f) == pos;
+        pos = 0;
+        return ok;
+    };
+
+    byte* hdr = out.data();
+    std::memcpy(hdr, "qoif", 4);
+    put_be32(hdr + 4, w);
+    put_be32(hdr + 8, h);
+    hdr[12] = 3; // RGB
+    hdr[13] = 0; // sRGB
+    pos = 14;
+
+    // as in the reference encoder the index starts as all zero RGBA, so an
+    // empty slot never matches a pixel, which always has alpha 255
+    px index[64] = {};
+    px prev = { 0, 0, 0, 255 };
+    uint run = 0;
+    const size_t npx = size_t(w) * h;
+    for (size_t i = 0; i < npx; ++i)
+    {
+        // worst case per pixel is a run flush plus an RGB op
+        if (pos + 5 > out.size() && !flush()) {
+            return mERROR("could not write file");
+        }
+        const px c = { rgb[3 * i], rgb[3 * i + 1], rgb[3 * i + 2], 255 };
+        if (c.r == prev.r && c.g == prev.g && c.b == prev.b)
+        {
+            if (++run == 62 || i + 1 == npx) {
+                out[pos++] = byte(OP_RUN | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            out[pos++] = byte(OP_RUN | (run - 1));
+            run = 0;
+        }
+
+        const uint hash = (c.r * 3 + c.g * 5 + c.b * 7 + c.a * 11) % 64;
+        if (index[hash].r == c.r && index[hash].g == c.g && index[hash].b == c.b &&
+            index[hash].a == c.a) {
+            out[pos++] = byte(OP_INDEX | hash);
+        }
+        else
+        {
+            index[hash] = c;
+            const int8_t dr = int8_t(c.r - prev.r);
+            const int8_t dg = int8_t(c.g - prev.g);
+            const int8_t db = int8_t(c.b - prev.b);
+            const int8_t dr_dg = int8_t(dr - dg), db_dg = int8_t(db - dg);
+
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                out[pos++] = byte(OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+            }
+            else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                out[pos++] = byte(OP_LUMA | (dg + 32));
+                out[pos++] = byte((dr_dg + 8) << 4 | (db_dg + 8));
+            }
+            else {
+                out[pos++] = OP_RGB;
+                out[pos++] = c.r; out[pos++] = c.g; out[pos++] = c.b;
+            }
+        }
+        prev = c;
+    }
+
+    if (pos + 8 > out.size() && !flush()) {
+        return mERROR("could not write file");
+    }
+    static constexpr byte end_marker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    std::memcpy(out.data() + pos, end_marker, sizeof(end_marker));
+    pos += sizeof(end_marker);
+    if (!flush()) {
+        return mERROR("could not write file");
+    }
+    return 0;
+}
+
+// ------------------------------- PNG ---------------------------------
+
+// Encoded pigz-style: the image is cut into bands of rows, which are
+// filtered and deflated on separate threads, each band ending on a
+// byte boundary (a sync flush) so the pieces can be concatenated into
+// one zlib stream. The Adler-32 of the stream is combined from the
+// bands'. Every band is written as its own IDAT chunk.
+//
+// Without zlib, bands are stored uncompressed (valid, but large).
+
+static constexpr size_t png_band_bytes = size_t(1) << 18;
+static constexpr uint32_t adler_base = 65521;
+
+#if RT_HAVE_ZLIB
+
+static uint32_t png_crc32(uint32_t crc, const byte* p, size_t n)
+{
+    while (n > 0)
+    {
+        uInt len = uInt(std::min(n, size_t(1) << 30));
+        crc = uint32_t(::crc32(crc, p, len));
+        p += len;
+        n -= len;
+    }
+    return crc;
+}
+
+static uint32_t adler32_of(const byte* p, size_t n)
+{
+    uLong a = ::adler32(0, nullptr, 0);
+    while (n > 0)
+    {
+        uInt len = uInt(std::min(n, size_t(1) << 30));
+        a = ::adler32(a, p, len);
+        p += len;
+        n -= len;
+    }
+    return uint32_t(a);
+}
+
+#else
+
+static uint32_t png_crc32(uint32_t crc, const byte* p, size_t n)
+{
+    static const auto table = [] {
+        std::array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+
+    crc = ~crc;
+    for (size_t i = 0; i < n; ++i) {
+        crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint32_t adler32_of(const byte* p, size_t n)
+{
+    uint32_t a = 1, b = 0;
+    while (n > 0)
+    {
+        // largest run before b can overflow
+        size_t len = std::min(n, size_t(5552));
+        for (size_t i = 0; i < len; ++i) {
+            a += p[i];
+            b += a;
+        }
+        a %= adler_base;
+        b %= adler_base;
+        p += len;
+        n -= len;
+    }
+    return b << 16 | a;
+}
+
+#endif
+
+// Adler-32 of the concatenation of two pieces, from their checksums
+// and the length of the second (as zlib's adler32_combine()).
+static uint32_t adler32_cat(uint32_t adler1, uint32_t adler2, size_t len2)
+{
+    const uint32_t rem = uint32_t(len2 % adler_base);
+    uint32_t sum1 = adler1 & 0xffff;
+    uint32_t sum2 = uint32_t(uint64_t(rem) * sum1 % adler_base);
+    sum1 += (adler2 & 0xffff) + adler_base - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + adler_base - rem;
+    if (sum1 >= adler_base) { sum1 -= adler_base; }
+    if (sum1 >= adler_base) { sum1 -= adler_base; }
+    if (sum2 >= 2 * adler_base) { sum2 -= 2 * adler_base; }
+    if (sum2 >= adler_base) { sum2 -= adler_base; }
+    return sum2 << 16 | sum1;
+}
+
+static byte paeth(byte a, byte b, byte c)
+{
+    int p = int(a) + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    return pa <= pb && pa <= pc ? a : (pb <= pc ? b : c);
+}
+
+// Filters one row into out (filter type byte, then the row), trying
+// all five filters and keeping the one with the smallest sum of
+// absolute values, as libpng does. prev is nullptr on the first row.
+static void png_filter_row(const byte* row, const byte* prev, size_t n, byte* out, byte* scratch)
+{
+    static constexpr size_t bpp = 3;
+    uint64_t best_cost = ~uint64_t(0);
+
+    // one loop per filter keeps them vectorizable
+    auto try_filter = [&](byte type, auto&& pred)
+    {
+        uint64_t cost = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            const byte v = byte(row[i] - pred(i));
+            scratch[i] = v;
+            cost += uint64_t(std::abs(int(int8_t(v))));
+        }
+        if (cost < best_cost)
+        {
+            best_cost = cost;
+            out[0] = type;
+            std::memcpy(out + 1, scratch, n);
+        }
+    };
+
+    auto left = [&](size_t i) { return i >= bpp ? row[i - bpp] : byte(0); };
+    try_filter(0, [](size_t) { return byte(0); });
+    try_filter(1, left);
+    if (prev)
+    {
+        // Up and Paeth are None and Sub without a row above
+        try_filter(2, [&](size_t i) { return prev[i]; });
+        try_filter(3, [&](size_t i) { return byte((left(i) + prev[i]) >> 1); });
+        try_filter(4, [&](size_t i) {
+            return i >= bpp ? paeth(row[i - bpp], prev[i], prev[i - bpp]) : prev[i];
+        });
+    }
+    else {
+        try_filter(3, [&](size_t i) { return byte(left(i) >> 1); });
+    }
+}
+
+struct png_band
+{
+    uint y0, y1;
+    std::vector<byte> filtered;
+    std::vector<byte> chunk; // IDAT chunk: length, type, data, crc
+    uint32_t adler = 1;
+};
+
+// Deflates band b's filtered rows into its chunk data, primed with
+// the end of the band before it so matches can cross bands.
+static int png_deflate_band(std::vector<png_band>& bands, size_t b)
+{
+    png_band& band = bands[b];
+    const bool last = b + 1 == bands.size();
+    std::vector<byte>& out = band.chunk;
+    out.resize(8);
+
+#if RT_HAVE_ZLIB
+    z_stream zs = {};
+    if (::deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return mERROR("deflateInit failed");
+    }
+    if (b > 0)
+    {
+        const auto& prev = bands[b - 1].filtered;
+        size_t ndict = std::min(prev.size(), size_t(32768));
+        ::deflateSetDictionary(&zs, prev.data() + prev.size() - ndict, uInt(ndict));
+    }
+    out.resize(8 + ::deflateBound(&zs, uLong(band.filtered.size())) + 16);
+
+    zs.next_in = band.filtered.data();
+    zs.avail_in = uInt(band.filtered.size());
+    zs.next_out = out.data() + 8;
+    zs.avail_out = uInt(out.size() - 8);
+    int r = ::deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+    size_t nout = zs.total_out;
+    ::deflateEnd(&zs);
+    if (r != (last ? Z_STREAM_END : Z_OK) || zs.avail_in != 0) {
+        return mERROR("deflate failed");
+    }
+    out.resize(8 + nout);
+#else
+    // stored blocks of up to 64K - 1
+    const auto& in = band.filtered;
+    size_t nblocks = std::max(size_t(1), (in.size() + 65534) / 65535);
+    out.reserve(8 + in.size() + 5 * nblocks + 8);
+    for (size_t i = 0; i < nblocks; ++i)
+    {
+        size_t beg = i * 65535, len = std::min(in.size() - beg, size_t(65535));
+        const byte hdr[5] = { byte(last && i + 1 == nblocks), byte(len), byte(len >> 8),
+            byte(~len), byte(~len >> 8) };
+        out.insert(out.end(), hdr, hdr + 5);
+        out.insert(out.end(), in.begin() + beg, in.begin() + beg + len);
+    }
+#endif
+
+    band.adler = adler32_of(band.filtered.data(), band.filtered.size());
+    return 0;
+}
+
+static int write_png_bands(FILE* f, const byte* rgb, uint w, uint h)
+{
+    const size_t rowbytes = size_t(w) * 3;
+    const uint band_rows = uint(std::max(size_t(1), png_band_bytes / (rowbytes + 1)));
+
+    std::vector<png_band> bands((h + band_rows - 1) / band_rows);
+    for (size_t b = 0; b < bands.size(); ++b) {
+        bands[b].y0 = uint(b * band_rows);
+        bands[b].y1 = std::min(h, bands[b].y0 + band_rows);
+    }
+
+    // filtering needs the row above, which is in the image already,
+    // so all bands can go at once
+    parallel_for(bands.size(), [&](size_t b)
+    {
+        png_band& band = bands[b];
+        band.filtered.resize(size_t(band.y1 - band.y0) * (rowbytes + 1));
+        std::vector<byte> scratch(rowbytes);
+        for (uint y = band.y0; y < band.y1; ++y)
+        {
+            const byte* row = rgb + y * rowbytes;
+            png_filter_row(row, y > 0 ? row - rowbytes : nullptr, rowbytes,
+                band.filtered.data() + (y - band.y0) * (rowbytes + 1), scratch.data());
+        }
+    });
+
+    std::atomic<int> err = 0;
+    parallel_for(bands.size(), [&](size_t b) {
+        if (png_deflate_band(bands, b) != 0) { err = -1; }
+    });
+    if (err) { return -1; }
+
+    // zlib header (32K window, default level) and trailer
+    uint32_t adler = 1;
+    for (auto& band : bands) {
+        adler = adler32_cat(adler, band.adler, band.filtered.size());
+    }
+    static constexpr byte zhdr[2] = { 0x78, 0x9c };
+    auto& first = bands.front().chunk;
+    first.insert(first.begin() + 8, zhdr, zhdr + 2);
+    auto& last = bands.back().chunk;
+    last.resize(last.size() + 4);
+    put_be32(last.data() + last.size() - 4, adler);
+
+    parallel_for(bands.size(), [&](size_t b)
+    {
+        auto& c = bands[b].chunk;
+        put_be32(c.data(), uint32_t(c.size() - 8));
+        std::memcpy(c.data() + 4, "IDAT", 4);
+        c.resize(c.size() + 4);
+        put_be32(c.data() + c.size() - 4, png_crc32(0, c.data() + 4, c.size() - 8));
+    });
+
+    byte head[8 + 25];
+    static constexpr byte signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    std::memcpy(head, signature, 8);
+    byte* ihdr = head + 8;
+    put_be32(ihdr, 13);
+    std::memcpy(ihdr + 4, "IHDR", 4);
+    put_be32(ihdr + 8, w);
+    put_be32(ihdr + 12, h);
+    const byte ihdr_rest[5] = { 8, 2, 0, 0, 0 }; // 8-bit RGB, deflate, adaptive, no interlace
+    std::memcpy(ihdr + 16, ihdr_rest, 5);
+    put_be32(ihdr + 21, png_crc32(0, ihdr + 4, 17));
+
+    byte iend[12] = { 0, 0, 0, 0, 'I', 'E', 'N', 'D' };
+    put_be32(iend + 8, png_crc32(0, iend + 4, 4));
+
+    bool ok = std::fwrite(head, 1, sizeof(head), f) == sizeof(head);
+    for (size_t b = 0; ok && b < bands.size(); ++b) {
+        ok = std::fwrite(bands[b].chunk.data(), 1, bands[b].chunk.size(), f) == bands[b].chunk.size();
+    }
+    ok = ok && std::fwrite(iend, 1, sizeof(iend), f) == sizeof(iend);
+    if (!ok) {
+        return mERROR("could not write file");
+    }
+    return 0;
+}
+
+int save_image(const fs::path& path, const char* rgb, uint w, uint h)
+{
+    DECL_UTF8PATH_CSTR(path)
+    const fs::path ext = path.extension();
+    const auto* px = reinterpret_cast<const byte*>(rgb);
+
+    if (ext == ".bmp")
+    {
+        if (!write_bmp(ppath, rgb, w, h, 3)) {
+            return mERROR("failed to save image");
+        }
+        return 0;
+    }
+    else if (ext != ".png" && ext != ".qoi" && ext != ".ppm") {
+        return write_file(path, rgb, size_t(w) * h * 3);
+    }
+    else if (w == 0 || h == 0) {
+        return mERROR("can't save an empty image");
+    }
+
+    scopedFILE f = SAFE_FOPEN(path.c_str(), "wb");
+    if (!f) { return mERROR("could not open output file"); }
+
+    if (ext == ".png") { return write_png_bands(f.get(), px, w, h); }
+    else if (ext == ".qoi") { return write_qoi(f.get(), px, w, h); }
+    else { return write_ppm(f.get(), px, w, h); }
+}
@@ -0,0 +1,476 @@
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <queue>
+#include <vector>
+#include <numbers>
+
+#include "defs.hpp"
+
+// Quadric error metric simplification (edge collapse).
+// Garland & Heckbert, "Surface Simplification Using Quadric Error Metrics".
+
+namespace {
+
+// Symmetric 4x4 matrix, upper triangle.
+struct quadric
+{
+    double q[10] = {};
+
+    void add_plane(double a, double b, double c, double d, double w)
+    {
+        q[0] += w * a * a; q[1] += w * a * b; q[2] += w * a * c; q[3] += w * a * d;
+        q[4] += w * b * b; q[5] += w * b * c; q[6] += w * b * d;
+        q[7] += w * c * c; q[8] += w * c * d;
+        q[9] += w * d * d;
+    }
+
+    quadric& operator+=(const quadric& rhs)
+    {
+        for (int i = 0; i < 10; ++i) { q[i] += rhs.q[i]; }
+        return *this;
+    }
+
+    double error(const vec3& v) const
+    {
+        double x = v[0], y = v[1], z = v[2];
+        return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x +
+            q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y +
+            q[7] * z * z + 2 * q[8] * z + q[9];
+    }
+
+    // Position minimizing the error, false if ill-conditioned.
+    bool optimum(vec3& v) const
+    {
+        double a00 = q[0], a01 = q[1], a02 = q[2];
+        double a11 = q[4], a12 = q[5], a22 = q[7];
+        double c00 = a11 * a22 - a12 * a12;
+        double c01 = a02 * a12 - a01 * a22;
+        double c02 = a01 * a12 - a02 * a11;
+        double det = a00 * c00 + a01 * c01 + a02 * c02;
+        if (std::abs(det) < 1e-12) { return false; }
+
+        double bx = -q[3], by = -q[6], bz = -q[8];
+        double c11 = a00 * a22 - a02 * a02;
+        double c12 = a01 * a02 - a00 * a12;
+        double c22 = a00 * a11 - a01 * a01;
+        v = {
+            float((c00 * bx + c01 * by + c02 * bz) / det),
+            float((c01 * bx + c11 * by + c12 * bz) / det),
+            float((c02 * bx + c12 * by + c22 * bz) / det) };
+        return true;
+    }
+};
+
+struct collapse
+{
+    double cost;
+    int v0, v1;
+    uint stamp0, stamp1;
+
+    bool operator>(const collapse& rhs) const { return cost > rhs.cost; }
+};
+
+// Indexed mesh of one object.
+struct lod_mesh
+{
+    std::vector<vec3> V;
+    std::vector<std::array<int, 3>> F;
+    std::vector<int> matid;
+};
+
+}
+
+// Edges of one face.
+static constexpr int edge_verts[3][2] = { { 0, 1 }, { 1, 2 }, { 2, 0 } };
+
+static inline vec3 face_normal(const vec3& a, const vec3& b, const vec3& c) {
+    return (b - a).cross(c - a);
+}
+
+// Simplifies m to at most target triangles, unless no more
+// collapses are possible. Borders and material seams are kept.
+static void simplify_mesh(lod_mesh& m, size_t target)
+{
+    const size_t nV = m.V.size();
+    std::vector<quadric> Q(nV);
+    std::vector<std::vector<int>> adj(nV); // faces of each vertex
+    std::vector<char> Falive(m.F.size(), 1);
+    std::vector<uint> stamp(nV, 0);
+    std::vector<char> Valive(nV, 1);
+
+    for (size_t f = 0; f < m.F.size(); ++f)
+    {
+        auto& idx = m.F[f];
+        vec3 n = face_normal(m.V[idx[0]], m.V[idx[1]], m.V[idx[2]]);
+        double area2 = n.norm();
+        if (area2 > 0) {
+            n = n / float(area2);
+        }
+        double d = -n.dot(m.V[idx[0]]);
+        for (int j = 0; j < 3; ++j)
+        {
+            Q[idx[j]].add_plane(n[0], n[1], n[2], d, area2);
+            adj[idx[j]].push_back(int(f));
+        }
+    }
+
+    // Find border edges (one face) and material seams, and
+    // constrain them with planes perpendicular to their faces.
+    struct edge { int a, b, f; };
+    std::vector<edge> edges;
+    edges.reserve(m.F.size() * 3);
+    for (size_t f = 0; f < m.F.size(); ++f) {
+        for (auto& ev : edge_verts) {
+            int a = m.F[f][ev[0]], b = m.F[f][ev[1]];
+            edges.push_back({ std::min(a, b), std::max(a, b), int(f) });
+        }
+    }
+    std::sort(edges.begin(), edges.end(), [](const edge& l, const edge& r) {
+        return l.a != r.a ? l.a < r.a : l.b < r.b; });
+
+    constexpr double border_weight = 1000;
+    for (size_t i = 0; i < edges.size();)
+    {
+        size_t j = i + 1;
+        bool seam = false;
+        while (j < edges.size() && edges[j].a == edges[i].a && edges[j].b == edges[i].b) {
+            seam = seam || m.matid[edges[j].f] != m.matid[edges[i].f];
+            j++;
+        }
+        if (j - i == 1 || seam)
+        {
+            for (size_t k = i; k < j; ++k)
+            {
+                auto& idx = m.F[edges[k].f];
+                const vec3& pa = m.V[edges[k].a];
+                const vec3& pb = m.V[edges[k].b];
+                vec3 e = pb - pa;
+                vec3 n = e.cross(face_normal(m.V[idx[0]], m.V[idx[1]], m.V[idx[2]]));
+                float nn = n.norm();
+                if (nn == 0) { continue; }
+                n = n / nn;
+                double w = border_weight * e.dot(e);
+                Q[edges[k].a].add_plane(n[0], n[1], n[2], -n.dot(pa), w);
+                Q[edges[k].b].add_plane(n[0], n[1], n[2], -n.dot(pa), w);
+            }
+        }
+        i = j;
+    }
+
+    auto best_pos = [&](int v0, int v1, vec3& p)
+    {
+        quadric q = Q[v0];
+        q += Q[v1];
+        if (!q.optimum(p)) {
+            p = 0.5f * (m.V[v0] + m.V[v1]);
+        }
+        double cost = q.error(p);
+        // endpoints can be better if the optimum is degenerate
+        for (const vec3& c : { m.V[v0], m.V[v1] }) {
+            double ce = q.error(c);
+            if (ce < cost) { cost = ce; p = c; }
+        }
+        return std::max(cost, 0.0);
+    };
+
+    std::priority_queue<collapse, std::vector<collapse>, std::greater<>> heap;
+    auto push_edge = [&](int a, int b)
+    {
+        vec3 p;
+        double cost = best_pos(a, b, p);
+        heap.push({ cost, a, b, stamp[a], stamp[b] });
+    };
+    for (size_t i = 0; i < edges.size(); ++i) {
+        if (i == 0 || edges[i].a != edges[i - 1].a || edges[i].b != edges[i - 1].b) {
+            push_edge(edges[i].a, edges[i].b);
+        }
+    }
+    edges = {};
+
+    // Moving v to p must not flip any face that doesn't contain other.
+    auto flips = [&](int v, int other, const vec3& p)
+    {
+        for (int f : adj[v])
+        {
+            if (!Falive[f]) { continue; }
+            auto& idx = m.F[f];
+            if (idx[0] == other || idx[1] == other || idx[2] == other) {
+                continue;
+            }
+            vec3 nold = face_normal(m.V[idx[0]], m.V[idx[1]], m.V[idx[2]]);
+            vec3 pv[3] = { m.V[idx[0]], m.V[idx[1]], m.V[idx[2]] };
+            for (int j = 0; j < 3; ++j) {
+                if (idx[j] == v) { pv[j] = p; }
+            }
+            vec3 nnew = face_normal(pv[0], pv[1], pv[2]);
+            if (nold.dot(nnew) <= 0) { return true; }
+        }
+        return false;
+    };
+
+    size_t nalive = m.F.size();
+    std::vector<int> nbrs;
+    while (nalive > target && !heap.empty())
+    {
+        collapse c = heap.top();
+        heap.pop();
+
+        int v0 = c.v0, v1 = c.v1;
+        if (!Valive[v0] || !Valive[v1] ||
+            stamp[v0] != c.stamp0 || stamp[v1] != c.stamp1) {
+            continue; // stale
+        }
+
+        vec3 p;
+        best_pos(v0, v1, p);
+        if (flips(v0, v1, p) || flips(v1, v0, p)) {
+            continue;
+        }
+
+        // merge v1 into v0
+        m.V[v0] = p;
+        Q[v0] += Q[v1];
+        Valive[v1] = 0;
+        stamp[v0]++;
+
+        for (int f : adj[v1])
+        {
+            if (!Falive[f]) { continue; }
+            auto& idx = m.F[f];
+            if (idx[0] == v0 || idx[1] == v0 || idx[2] == v0) {
+                Falive[f] = 0;
+                nalive--;
+            }
+            else {
+                for (int j = 0; j < 3; ++j) {
+                    if (idx[j] == v1) { idx[j] = v0; }
+                }
+                adj[v0].push_back(f);
+            }
+        }
+        adj[v1] = {};
+
+        // drop dead faces and requeue edges around v0
+        std::erase_if(adj[v0], [&](int f) { return !Falive[f]; });
+        nbrs.clear();
+        for (int f : adj[v0]) {
+            for (int v : m.F[f]) {
+                if (v != v0) { nbrs.push_back(v); }
+            }
+        }
+        std::sort(nbrs.begin(), nbrs.end());
+        nbrs.erase(std::unique(nbrs.begin(), nbrs.end()), nbrs.end());
+        for (int v : nbrs) {
+            stamp[v]++;
+        }
+        for (int v : nbrs) {
+            // edges of v that don't touch v0 are stale now too
+            for (int f : adj[v]) {
+                if (!Falive[f]) { continue; }
+                for (int w : m.F[f]) {
+                    if (w != v && w != v0 && v < w) { push_edge(v, w); }
+                }
+            }
+            push_edge(std::min(v, v0), std::max(v, v0));
+        }
+    }
+
+    // compact
+    std::vector<int> Vmap(nV, -1);
+    std::vector<vec3> newV;
+    size_t nf = 0;
+    for (size_t f = 0; f < m.F.size(); ++f)
+    {
+        if (!Falive[f]) { continue; }
+        for (int& v : m.F[f])
+        {
+            if (Vmap[v] < 0) {
+                Vmap[v] = int(newV.size());
+                newV.push_back(m.V[v]);
+            }
+            v = Vmap[v];
+        }
+        m.F[nf] = m.F[f];
+        m.matid[nf] = m.matid[f];
+        nf++;
+    }
+    m.F.resize(nf);
+    m.matid.resize(nf);
+    m.V = std::move(newV);
+}
+
+// Projected area of a bbox in pixels (rough, treats it as a sphere).
+static double projected_pixels(const bbox& bb, const camera& C, std::pair<uint, uint> R)
+{
+    const double img_pixels = double(R.first) * R.second;
+    double radius = 0.5 * (bb.cmax - bb.cmin).norm();
+    double dist = (bb.center() - C.eye).norm();
+    if (dist <= radius) {
+        return img_pixels;
+    }
+    double pixel_size = C.height / R.second; // on the image plane
+    double rp = radius / dist * C.focal_len / pixel_size;
+    return std::min(img_pixels, std::numbers::pi * rp * rp);
+}
+
+int Scene::simplify_tris(size_t budget)
+{
+    const char* pscname = m_scname.c_str();
+    if (!I.empty()) {
+        return mERROR("%s: LOD is not supported with instancing", pscname);
+    } else if (textures_enabled()) {
+        return mERROR("%s: LOD does not preserve texture coordinates", pscname);
+    }
+    if (F.size() <= budget) {
+        if (m_opts.verbose) {
+            std::printf("%s: %zu triangle(s) within budget\n", pscname, F.size());
+        }
+        return 0;
+    }
+
+    auto tbeg = chrono::high_resolution_clock::now();
+
+    // Give each object triangles in proportion to its size on screen,
+    // capping everything at the same density (triangles per pixel).
+    const size_t nobjs = O.size();
+    std::vector<double> pixels(nobjs);
+    for (size_t i = 0; i < nobjs; ++i)
+    {
+        bbox bb = get_nodes_bbox(F.data() + O[i].Fbeg, F.data() + O[i].Fend);
+        pixels[i] = projected_pixels(bb, C, R);
+    }
+
+    // a handful of triangles per object, so nothing vanishes
+    constexpr size_t min_tris = 4;
+    auto targets_for = [&](double density, std::vector<size_t>& targets)
+    {
+        size_t total = 0;
+        for (size_t i = 0; i < nobjs; ++i)
+        {
+            size_t n = O[i].Fend - O[i].Fbeg;
+            double t = std::max(double(std::min(n, min_tris)), density * pixels[i]);
+            targets[i] = size_t(std::min(double(n), t));
+            total += targets[i];
+        }
+        return total;
+    };
+
+    // binary search for the density that meets the budget
+    std::vector<size_t> targets(nobjs);
+    double lo = 0, hi = double(F.size());
+    for (int it = 0; it < 64; ++it)
+    {
+        double mid = 0.5 * (lo + hi);
+        if (targets_for(mid, targets) > budget) { hi = mid; }
+        else { lo = mid; }
+    }
+    targets_for(lo, targets);
+
+    std::vector<size_t> todo;
+    for (size_t i = 0; i < nobjs; ++i) {
+        if (targets[i] < O[i].Fend - O[i].Fbeg) { todo.push_back(i); }
+    }
+
+    std::vector<lod_mesh> lods(todo.size());
+    parallel_for(todo.size(), [&](size_t k)
+    {
+        const object& o = O[todo[k]];
+        lod_mesh& lm = lods[k];
+
+        // gather this object's vertices
+        std::vector<int> Vmap;
+        int Vmin = std::numeric_limits<int>::max(), Vmax = 0;
+        for (uint f = o.Fbeg; f < o.Fend; ++f) {
+            for (int v : F[f].Vidx) {
+                Vmin = std::min(Vmin, v);
+                Vmax = std::max(Vmax, v);
+            }
+        }
+        Vmap.assign(Vmax - Vmin + 1, -1);
+        for (uint f = o.Fbeg; f < o.Fend; ++f)
+        {
+            std::array<int, 3> idx;
+            for (int j = 0; j < 3; ++j)
+            {
+                int& lv = Vmap[F[f].Vidx[j] - Vmin];
+                if (lv < 0) {
+                    lv = int(lm.V.size());
+                    lm.V.push_back(V[F[f].Vidx[j]]);
+                }
+                idx[j] = lv;
+            }
+            lm.F.push_back(idx);
+            lm.matid.push_back(F[f].matid);
+        }
+        simplify_mesh(lm, targets[todo[k]]);
+    });
+
+    // Rebuild F. Simplified objects get new vertices and
+    // smooth (area-weighted) normals.
+    std::vector<tri> newF;
+    newF.reserve(F.size());
+    size_t next = 0;
+    for (size_t i = 0; i < nobjs; ++i)
+    {
+        object& o = O[i];
+        uint beg = uint(newF.size());
+        if (next < todo.size() && todo[next] == i)
+        {
+            lod_mesh& lm = lods[next++];
+            if (m_opts.verbose) {
+                std::printf("%s: object %zu, %u -> %zu triangle(s) (%.0f pixels)\n",
+                    pscname, i, o.Fend - o.Fbeg, lm.F.size(), pixels[i]);
+            }
+            const int baseV = int(V.size());
+            const int baseNV = int(NV.size());
+
+            std::vector<vec3> normals(lm.V.size(), { 0, 0, 0 });
+            for (auto& idx : lm.F)
+            {
+                vec3 n = face_normal(lm.V[idx[0]], lm.V[idx[1]], lm.V[idx[2]]);
+                for (int v : idx) { normals[v] += n; }
+            }
+            for (auto& n : normals) {
+                float nn = n.norm();
+                n = nn > 0 ? n / nn : vec3(0, 0, 1);
+            }
+            V.insert(V.end(), lm.V.begin(), lm.V.end());
+            NV.insert(NV.end(), normals.begin(), normals.end());
+
+            for (size_t f = 0; f < lm.F.size(); ++f)
+            {
+                tri t;
+                for (int j = 0; j < 3; ++j) {
+                    t.Vidx[j] = baseV + lm.F[f][j];
+                    t.NVidx[j] = baseNV + lm.F[f][j];
+                }
+                t.matid = lm.matid[f];
+                t.bb = get_tri_bbox(V, t.Vidx);
+                newF.push_back(t);
+            }
+        }
+        else {
+            newF.insert(newF.end(), F.begin() + o.Fbeg, F.begin() + o.Fend);
+        }
+        o.Fbeg = beg;
+        o.Fend = uint(newF.size());
+    }
+
+    size_t old_ntris = F.size();
+    F = std::move(newF);
+    compact_verts();
+
+    auto tend = chrono::high_resolution_clock::now();
+    std::printf("%s: simplified %zu object(s), %zu -> %zu triangle(s) in ",
+        pscname, todo.size(), old_ntris, F.size());
+    print_duration(std::cout << std::flush, tend - tbeg);
+    std::cout << "\n";
+
+    if (F.size() > budget) {
+        std::printf("%s: could not meet triangle budget of %zu\n", pscname, budget);
+    }
+    return 0;
+}
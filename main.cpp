@@ -4,10 +4,11 @@
 #include <iostream>
 #include <string_view>
 #include <memory>
-#include <charconv>
+#include <span>
 
 #include "cxxopts.hpp"
 #include "defs.hpp"
+#include "transport.hpp"
 
 #include "io.h"
 
@@ -16,77 +17,60 @@
 #define RT_DEFAULT_PORT "50000"
 #define RT_DEFAULTARGS RT_DEFAULT_HOST "," RT_DEFAULT_PORT
 
-#ifdef _WIN32
-static bool tcp_init = false;
-
-// no multithreading, so this is okay.
-static bool tcp_win32_initonce() {
-    if (!tcp_init) {
-        tcp_init = (TCP_win32_init() == 0);
-    }
-    return tcp_init;
-}
-#endif
-
-static int raytrace(const fs::path& outpath, std::string_view host, std::string_view port, 
-    std::pair<uint, uint> resn, BufWithSize<uint>& buf, bool verbose = false)
+// Sends a scene over xport and saves the image it gets back. fd is a
+// file holding buf, or -1 (see transport::send_scene()).
+static int raytrace(const fs::path& outpath, transport& xport,
+    std::pair<uint, uint> resn, std::span<const uint> buf, int fd = -1, bool verbose = false)
 {
-#ifdef _WIN32
-    if (!tcp_win32_initonce()) {
-        return mERROR("failed to initialize TCP");
-    }
-#endif 
 #define DASHES "----------------------------\n"
 
-    const uint nbytes_sc = uint(buf.size * 4);
-    const uint nbytes_img = resn.first * resn.second * 3;
+    const size_t nbytes_sc = buf.size_bytes();
+    const size_t nbytes_img = size_t(resn.first) * resn.second * 3;
 
-    std::printf("Sending scene to FPGA at '%s'...\n", host.data());
+    std::printf("Sending scene to %s...\n", xport.name().c_str());
     if (verbose) { std::printf(DASHES); }
-    
-    socket_t socket = TCP_connect2(host.data(), port.data(), verbose);
-    if (socket == INV_SOCKET) {
-        return -1;
-    }
-    if (TCP_send2(socket, (char*)buf.get(), nbytes_sc, verbose) != nbytes_sc) {
+
+    // ends the frame on every path
+    auto frame = std::unique_ptr<transport, void(*)(transport*)>(&xport,
+        [](transport* x) { x->end_frame(); });
+
+    auto tsend = chrono::high_resolution_clock::now();
+    const char* method = "";
+    if (xport.send_scene(buf, fd, method) != 0) {
         return -1;
     }
+    auto tsent = chrono::high_resolution_clock::now();
+    double secs = chrono::duration<double>(tsent - tsend).count();
+    double mbytes = nbytes_sc / 1e6;
+    std::printf("Uploaded %.1f MB at %.0f MB/s (%s)\n", mbytes,
+        secs > 0 ? mbytes / secs : 0., method);
 
     if (verbose) { std::printf(DASHES); }
     std::printf("Waiting for image...\n");
     if (verbose) { std::printf(DASHES); }
     
-    char* pdata;
-    int nrecv = TCP_recv2(socket, &pdata, verbose);
-    auto data = scoped_cptr<char[]>(pdata);
-    if (nrecv < 0) {
+    std::span<const char> data;
+    if (xport.recv_image(data) != 0) {
         if (verbose) { std::printf(DASHES); }
-        return mERROR("failed to receive image");
+        return -1;
     }
-    else if (nrecv != nbytes_img) {
-        TCP_close(socket);
+    else if (data.size() != nbytes_img) {
         if (verbose) { std::printf(DASHES); }
-        return mERROR("received %d bytes, expected %u", nrecv, nbytes_img);
+        return mERROR("received %zu bytes, expected %zu", data.size(), nbytes_img);
     }
-
-    TCP_close(socket);
     if (verbose) { std::printf(DASHES); }
 
     DECL_UTF8PATH_CSTR(outpath)
-    fs::path outext = outpath.extension();
-
-    bool wr_err = false;
-    if (outext == ".bmp") {
-        wr_err = !write_bmp(poutpath, data.get(), resn.first, resn.second, 3);
-    } else if (outext == ".png") {
-        wr_err = !write_png(poutpath, data.get(), resn.first, resn.second, 3);
-    } 
-    else { wr_err = write_file(outpath, data.get(), nbytes_img); }
-
-    if (wr_err) {
-        return mERROR("failed to save image");
+    auto tsave = chrono::high_resolution_clock::now();
+    if (save_image(outpath, data.data(), resn.first, resn.second) != 0) {
+        return -1;
+    }
+    if (verbose)
+    {
+        std::cout << "Encoded image in ";
+        print_duration(std::cout, chrono::high_resolution_clock::now() - tsave);
+        std::cout << "\n";
     }
-    
     std::printf("Saved image to %s\n", poutpath);
     return 0;
 
@@ -108,115 +92,268 @@ static void BV_report(const Scene& sc)
     const vec3 incr_diru = aspratio * world_du * sc.C.u;
     const vec3 incr_dirv = -world_dv * sc.C.v;
 
-    // camera ray
-    vec3 rorig = sc.C.eye, rdir = base_dir;
+    // without instancing, everything is one object in world space
+    std::vector<instance> insts = sc.I;
+    if (insts.empty()) {
+        insts.push_back({ 0, xform::identity() });
+    }
+    std::vector<xform> Tinv(insts.size());
+    size_t world_ntris = 0;
+    for (size_t i = 0; i < insts.size(); ++i) {
+        insts[i].T.inverse(Tinv[i]);
+        world_ntris += sc.O[insts[i].obj].Fend - sc.O[insts[i].obj].Fbeg;
+    }
+    const std::vector<uint> BVbeg = [&] {
+        std::vector<uint> offs(sc.BV.size() + 1, 0);
+        for (size_t i = 0; i < sc.BV.size(); ++i) {
+            offs[i + 1] = offs[i] + sc.BV[i].ntris;
+        }
+        return offs;
+    }();
+    const bool octant = !sc.BVoct[0].empty();
 
-    // intersect every ray with every bounding volume and count intersection
-    // "candidates" (triangles that cannot be eliminated by BVs)
-    size_t total_candtris = 0, total_candbvs = 0;
-    size_t max_candtris = 0, max_candbvs = 0;
-    size_t nrays_inter = 0;
-    for (uint i = 0; i < sc.R.second; ++i) 
+    struct stats
+    {
+        size_t candtris = 0, candbvs = 0;
+        size_t max_candtris = 0, max_candbvs = 0;
+        size_t nrays_inter = 0, nrays_hit = 0;
+        size_t tests_first_hit = 0; // tri tests until the first hit
+        size_t tests_early_exit = 0; // skipping BVs behind the nearest hit
+    };
+
+    // Intersect every ray with every bounding volume and count intersection
+    // "candidates" (triangles that cannot be eliminated by BVs). BVs are 
+    // visited in serialized order (or the ray's octant order) to see how
+    // soon a hit is found. Rows run in parallel.
+    std::vector<stats> rows(sc.R.second);
+    parallel_for(sc.R.second, [&](size_t i)
     {
-        for (uint j = 0; j < sc.R.first; ++j) 
+        stats& st = rows[i];
+        vec3 rdir = base_dir + float(i) * incr_dirv;
+        for (uint j = 0; j < sc.R.first; ++j, rdir += incr_diru)
         {
-            size_t candtris = 0, candbvs = 0;
-            for (const bv& bv : sc.BV) 
-            {
-                auto& bb = bv.bb;
-                float t_entry = -std::numeric_limits<float>::infinity();
-                float t_exit = std::numeric_limits<float>::infinity();
+            size_t candtris = 0, candbvs = 0, ntests = 0;
+            size_t tests_first_hit = 0;
+            float t_best = std::numeric_limits<float>::infinity();
+            size_t tests_early_exit = 0;
 
-                for (int k = 0; k < 3; ++k)
+            for (size_t n = 0; n < insts.size(); ++n)
+            {
+                // test in object space. the xform is affine, so
+                // t is the same in both spaces
+                const object& obj = sc.O[insts[n].obj];
+                const vec3 oorig = Tinv[n].apply(sc.C.eye);
+                const vec3 odir = Tinv[n].apply_dir(rdir);
+                const uint oct = dir_octant(odir);
+
+                for (uint k = obj.BVbeg; k < obj.BVend; ++k)
                 {
-                    if (rdir[k] == 0) {
+                    uint b = octant ? sc.BVoct[oct][k] : k;
+                    float t_near;
+                    if (!ray_hits_bbox(oorig, odir, sc.BV[b].bb, t_near)) {
                         continue;
                     }
-                    float t1 = (bb.cmin[k] - rorig[k]) / rdir[k];
-                    float t2 = (bb.cmax[k] - rorig[k]) / rdir[k];
-                    
-                    if (rdir[k] > 0) {
-                        t_entry = std::max(t_entry, t1);
-                        t_exit = std::min(t_exit, t2);
-                    }
-                    else {
-                        t_entry = std::max(t_entry, t2);
-                        t_exit = std::min(t_exit, t1);
-                    }
-                }
-
-                if (t_exit >= t_entry && t_exit >= 0) {
-                    candtris += bv.ntris;
+                    candtris += sc.BV[b].ntris;
                     candbvs++;
+
+                    const bool skip = t_near > t_best;
+                    for (uint f = BVbeg[b]; f < BVbeg[b + 1]; ++f)
+                    {
+                        const tri& t = sc.F[f];
+                        float th = ray_tri(oorig, odir, sc.V[t.Vidx[0]], 
+                            sc.V[t.Vidx[1]], sc.V[t.Vidx[2]]);
+                        ntests++;
+                        if (!skip) { tests_early_exit++; }
+                        if (th < std::numeric_limits<float>::infinity() && tests_first_hit == 0) {
+                            tests_first_hit = ntests;
+                        }
+                        if (!skip) { t_best = std::min(t_best, th); }
+                    }
                 }
             }
             if (candbvs > 0) {
-                nrays_inter++;
+                st.nrays_inter++;
             }
-            max_candtris = std::max(max_candtris, candtris);
-            max_candbvs = std::max(max_candbvs, candbvs);
-
-            total_candtris += candtris;
-            total_candbvs += candbvs;
-
-            rdir += incr_diru;
+            if (tests_first_hit > 0) {
+                st.nrays_hit++;
+                st.tests_first_hit += tests_first_hit;
+            }
+            st.tests_early_exit += tests_early_exit;
+            st.max_candtris = std::max(st.max_candtris, candtris);
+            st.max_candbvs = std::max(st.max_candbvs, candbvs);
+            st.candtris += candtris;
+            st.candbvs += candbvs;
         }
-        rdir -= (float(sc.R.first) * incr_diru); // reset
-        rdir += incr_dirv;
+    });
+
+    stats tot;
+    for (const auto& st : rows)
+    {
+        tot.candtris += st.candtris;
+        tot.candbvs += st.candbvs;
+        tot.max_candtris = std::max(tot.max_candtris, st.max_candtris);
+        tot.max_candbvs = std::max(tot.max_candbvs, st.max_candbvs);
+        tot.nrays_inter += st.nrays_inter;
+        tot.nrays_hit += st.nrays_hit;
+        tot.tests_first_hit += st.tests_first_hit;
+        tot.tests_early_exit += st.tests_early_exit;
     }
 
     auto nrays = size_t(sc.R.first) * sc.R.second;
-    float candavg = float(total_candtris) / (sc.F.size() * nrays);
+    float candavg = float(tot.candtris) / (world_ntris * nrays);
 
     std::cout << "----------- BV report -----------\n";
     std::cout << "Num BVs: " << sc.BV.size() << "\n";
+    if (!sc.I.empty()) {
+        std::cout << "Num instances: " << sc.I.size() << "\n";
+    }
     std::cout << "Percent tris eliminated: " << 100 * (1 - candavg) << "%\n";
-    std::cout << "Avg candidate tris per ray: " << float(total_candtris) / nrays << "\n";
-    std::cout << "Avg candidate BVs per ray: " << float(total_candbvs) / nrays << "\n";
-    std::cout << "Avg candidate tris per intersecting ray: " << float(total_candtris) / nrays_inter << "\n";
-    std::cout << "Avg candidate BVs per intersecting ray: " << float(total_candbvs) / nrays_inter << "\n";
-    std::cout << "Avg cand tris per cand BV: " << float(total_candtris) / total_candbvs << "\n";
-    std::cout << "Max candidate tris: " << max_candtris << "\n";
-    std::cout << "Max candidate BVs: " << max_candbvs << "\n";
+    std::cout << "Avg candidate tris per ray: " << float(tot.candtris) / nrays << "\n";
+    std::cout << "Avg candidate BVs per ray: " << float(tot.candbvs) / nrays << "\n";
+    std::cout << "Avg candidate tris per intersecting ray: " << float(tot.candtris) / tot.nrays_inter << "\n";
+    std::cout << "Avg candidate BVs per intersecting ray: " << float(tot.candbvs) / tot.nrays_inter << "\n";
+    std::cout << "Avg cand tris per cand BV: " << float(tot.candtris) / tot.candbvs << "\n";
+    std::cout << "Max candidate tris: " << tot.max_candtris << "\n";
+    std::cout << "Max candidate BVs: " << tot.max_candbvs << "\n";
+    std::cout << "Percent rays hitting a tri: " << 100.f * tot.nrays_hit / nrays << "%\n";
+    std::cout << "Avg tri tests until first hit: " << float(tot.tests_first_hit) / tot.nrays_hit << "\n";
+    std::cout << "Avg tri tests per ray, skipping BVs behind nearest hit: " 
+        << float(tot.tests_early_exit) / nrays << "\n";
     std::cout << "---------------------------------\n";
 }
 
-static int to_hdr(const fs::path& outpath, BufWithSize<uint>& buf)
+// Frame list for --frames: one frame per line, with the mesh files of
+// the frame separated by commas (relative to the list).
+static int read_frame_list(const fs::path& listpath, std::vector<std::vector<fs::path>>& frames)
 {
-    std::string name = outpath.stem().string();
-    std::string hdrname = name;
-    for (char& c : hdrname) {
-        c = to_upper(c);
-    }
-    hdrname += "_H";
+    BufWithSize<char> buf;
+    int e = read_file(listpath, buf);
+    if (e) { return e; }
 
-    std::string out = 
-        "#ifndef " + hdrname + 
-        "\n#define " + hdrname + 
-        "\nstatic const int " + name + "[] = {";
+    std::string_view str(buf.get(), buf.size), line;
+    auto dir = listpath.parent_path();
+    while (sv_getline(str, line))
+    {
+        if (line.empty()) { continue; }
+        auto& fr = frames.emplace_back();
+        size_t off;
+        while ((off = line.find(',')) != line.npos) {
+            fr.push_back(dir / line.substr(0, off));
+            line.remove_prefix(off + 1);
+        }
+        fr.push_back(dir / line);
+    }
+    if (frames.empty()) {
+        return mERROR("no frames in %s", listpath.string().c_str());
+    }
+    return 0;
+}
 
-    char strbuf[10] = { '0', 'x' };
-    char* const begin = strbuf + 2;
+// Scene list for --batch: one "<scene>,<output>" per line (relative to
+// the list).
+static int read_batch_list(const fs::path& listpath,
+    std::vector<std::pair<fs::path, fs::path>>& jobs)
+{
+    BufWithSize<char> buf;
+    int e = read_file(listpath, buf);
+    if (e) { return e; }
 
-    for (uint i = 0; i < buf.size; ++i)
+    std::string_view str(buf.get(), buf.size), line;
+    auto dir = listpath.parent_path();
+    for (size_t n = 1; sv_getline(str, line); ++n)
     {
-        if (i % 12 == 0) {
-            out.append("\n    ");
+        while (!line.empty() && is_ws(line.back())) { line.remove_suffix(1); }
+        if (line.empty()) { continue; }
+        size_t off = line.find(',');
+        if (off == line.npos || off == 0 || off + 1 == line.size()) {
+            return mERROR("%s:%zu: expected <scene>,<output>", listpath.string().c_str(), n);
         }
-        auto ret = std::to_chars(begin, std::end(strbuf), buf.ptr[i], 16);
+        jobs.emplace_back(dir / line.substr(0, off), dir / line.substr(off + 1));
+    }
+    if (jobs.empty()) {
+        return mERROR("no scenes in %s", listpath.string().c_str());
+    }
+    return 0;
+}
 
-        ptrdiff_t nchars = ret.ptr - begin;
-        std::memmove(std::end(strbuf) - nchars, begin, nchars);
-        std::memset(begin, '0', 8 - nchars);
+// Builds the scenes of a batch list several at a time, each mesh file
+// loaded once for all of them, and passes each serialized scene to
+// output(path, res, buf). Failed scenes don't stop the others.
+template <typename Fn>
+static int run_batch(const fs::path& listpath, scene_opts opts, Fn&& output)
+{
+    std::vector<std::pair<fs::path, fs::path>> jobs;
+    int e = read_batch_list(listpath, jobs);
+    if (e) { return e; }
 
-        out.append(strbuf, 10);
-        if (i != buf.size - 1) {
-            out.append(", ");
+    auto tbeg = chrono::high_resolution_clock::now();
+
+    mesh_cache meshes;
+    opts.meshes = &meshes;
+
+    // One scene per worker. The threads of a scene's own parallel work
+    // are split between the scenes still running, so a long last scene
+    // gets them all.
+    const size_t nthreads = num_threads();
+    const size_t nworkers = std::min(nthreads, jobs.size());
+    std::atomic<size_t> next = 0, left = jobs.size();
+    std::atomic<size_t> nfailed = 0, ntris = 0, nwords = 0;
+    auto worker = [&]
+    {
+        for (size_t i; (i = next++) < jobs.size(); --left)
+        {
+            thread_budget = std::max<size_t>(1, nthreads / std::min(left.load(), nworkers));
+
+            Scene scene(jobs[i].first, opts);
+            int err = scene ? 0 : -1;
+            if (!err)
+            {
+                BufWithSize<uint> buf;
+                buf.size = scene.nserial();
+                buf.ptr = std::make_unique_for_overwrite<uint[]>(buf.size);
+                scene.serialize(buf.get());
+                err = output(jobs[i].second, scene.R, std::span<const uint>(buf.get(), buf.size));
+                ntris += scene.F.size();
+                nwords += buf.size;
+            }
+            if (err) { ++nfailed; }
+        }
+    };
+    {
+        std::vector<std::jthread> workers;
+        for (size_t i = 1; i < nworkers; ++i) {
+            workers.emplace_back(worker);
         }
+        worker();
     }
-    out.append("\n};\n#endif\n");
 
-    return write_file(outpath, out.c_str(), out.length());
+    auto tend = chrono::high_resolution_clock::now();
+    double secs = chrono::duration<double>(tend - tbeg).count();
+    double mbytes = double(nwords) * sizeof(uint) / (1 << 20);
+    size_t ndone = jobs.size() - nfailed;
+
+    std::cout << "----------- Batch report -----------\n";
+    std::printf("Scenes: %zu converted, %zu failed\n", ndone, size_t(nfailed));
+    std::printf("Mesh files: %zu loaded for %zu reference(s)\n",
+        meshes.size(), meshes.requests());
+    std::printf("Output: %zu triangle(s), %.1f MB\n", size_t(ntris), mbytes);
+    std::cout << "Completed in ";
+    print_duration(std::cout, tend - tbeg);
+    std::printf(": %.1f scenes/s, %.1f MB/s, %.2f Mtris/s\n",
+        ndone / secs, mbytes / secs, ntris / secs * 1e-6);
+    std::cout << "------------------------------------\n";
+
+    return nfailed ? EXIT_FAILURE : 0;
+}
+
+// Output path of frame n: out_0000.ext, out_0001.ext, ...
+static fs::path frame_path(const fs::path& outpath, size_t n)
+{
+    char suffix[16];
+    std::snprintf(suffix, sizeof(suffix), "_%04zu", n);
+    fs::path p = outpath;
+    p.replace_filename(outpath.stem().string() + suffix + outpath.extension().string());
+    return p;
 }
 
 int main(int argc, char** argv)
@@ -225,12 +362,34 @@ int main(int argc, char** argv)
     opts.add_options()
         ("h,help", "Show usage.")
         ("i,in", "Scene to render (.scene or binary file).", cxxopts::value<std::string>(), "<file>")
-        ("o,out", "Output (.bmp, .png, or binary file).", cxxopts::value<std::string>(), "<file>")
-        ("dest", "FPGA network destination.", cxxopts::value<std::string>()->default_value(RT_DEFAULTARGS), "<host>,<port>")
+        ("o,out", "Output (.bmp, .png, .qoi, .ppm, or binary file).", cxxopts::value<std::string>(), "<file>")
+        ("dest", "FPGA network destination, or shared memory link to a local proxy.", cxxopts::value<std::string>()->default_value(RT_DEFAULTARGS), "<host>,<port>|shm:<name>")
         ("max-bv", "Max bounding volumes. Must be a power of 2.", cxxopts::value<uint>()->default_value("128"), "<uint>")      
-        ("serfmt", "Serialization format.", cxxopts::value<std::string>()->default_value("dup"), "<dup|nodup>")
+        ("serfmt", "Serialization format.", cxxopts::value<std::string>()->default_value("dup"), "<dup|nodup|meshlet>")
+        ("bv-order", "BV order: as built, nearest to camera first, or per ray octant.", cxxopts::value<std::string>()->default_value("tree"), "<tree|front|octant>")
+        ("split-budget", "Let BVs share long triangles, adding up to this fraction of references.", cxxopts::value<float>()->default_value("0"), "<float>")
+        ("instancing", "Upload instanced meshes once, with per-mesh BVs and an instance table.")
+        ("cull", "Drop triangles outside the view frustum and shadow bounds.")
+        ("cull-margin", "Distance kept around the view frustum for reflections.", cxxopts::value<float>()->default_value("0"), "<float>")
+        ("quantize", "Send 16-bit positions and octahedral normals (dup and meshlet formats).")
+        ("isect-data", "Add precomputed ray-triangle intersection data.")
+        ("light-cutoff", "Add per-BV masks of lights brighter than this after falloff.", cxxopts::value<float>()->default_value("0"), "<float>")
+        ("shadow-samples", "Precompute BV/light shadow classes with up to this many rays each.", cxxopts::value<uint>()->default_value("0"), "<uint>")
+        ("tri-budget", "Simplify distant objects to fit in this many triangles.", cxxopts::value<uint>(), "<uint>")
+        ("frames", "Animate the scene: list of mesh files per frame, outputs numbered.", cxxopts::value<std::string>(), "<file>")
+        ("refit-threshold", "Rebuild BVs when refitting grows their SAH cost by this factor.", cxxopts::value<float>()->default_value("1.5"), "<float>")
         ("b,tobin", "Convert scene to .bin.")
         ("c,tohdr", "Convert scene to C header.")
+        ("toobj", "Convert scene to an object file (.o), or assembly with .incbin (.s/.S).")
+        ("obj-target", "Object file architecture.", cxxopts::value<std::string>()->default_value("arm"), "<arm|aarch64|x86_64|nios2>")
+        ("m,tomesh", "Convert mesh (.obj, .ply, .glb) to .rtmesh.")
+        ("zerocopy", "Upload with sendfile() or MSG_ZEROCOPY where available (Linux).")
+        ("delta", "Upload only the blocks of the scene the device doesn't hold yet.")
+        ("compress", "Upload scenes packed (needs a device that unpacks them).")
+        ("serve", "Run as a render service taking jobs on this Unix socket.", cxxopts::value<std::string>(), "<path>")
+        ("devices", "Render service devices, one --dest per line (default: --dest).", cxxopts::value<std::string>(), "<file>")
+        ("cache-mb", "Render service scene cache size in MB.", cxxopts::value<uint>()->default_value("1024"), "<uint>")
+        ("batch", "Convert the scenes of this list concurrently, sharing mesh files.", cxxopts::value<std::string>(), "<file>")
         ("bv-report", "Report on BV efficiency (might take a few seconds).")
         ("v,verbose", "Verbose mode.");
 
@@ -247,44 +406,71 @@ int main(int argc, char** argv)
         return 0;
     }
 
-    if (args["in"].count() == 0) {
+    const bool serve = args["serve"].count() != 0;
+    const bool batch = args["batch"].count() != 0;
+    if ((serve || batch) && args["in"].count() != 0) {
+        return mERROR("option --in is invalid");
+    }
+    else if (!serve && !batch && args["in"].count() == 0) {
         return mERROR("no input file");
     }
+    else if (!serve && (args["devices"].count() != 0 || args["cache-mb"].count() != 0)) {
+        return mERROR("options --devices and --cache-mb need --serve");
+    }
 
     bool tobin = args["tobin"].count() != 0;
     bool tohdr = args["tohdr"].count() != 0;
+    bool toobj = args["toobj"].count() != 0;
+    bool tomesh = args["tomesh"].count() != 0;
     bool bv_report = args["bv-report"].count() != 0;
 
-    int run_util = int(tobin) + int(tohdr) + int(bv_report);
-    if (run_util > 1) {
+    int run_util = int(tobin) + int(tohdr) + int(toobj) + int(tomesh) + int(bv_report);
+    if (run_util + int(serve) > 1) {
         return mERROR("more than one target");
     }
+    else if (batch && !(tobin || tohdr || toobj)) {
+        return mERROR("option --batch needs --tobin, --tohdr or --toobj");
+    }
+    auto& objtarget = args["obj-target"].as<std::string>();
+    if (args["obj-target"].count() != 0 && !toobj) {
+        return mERROR("option --obj-target is invalid");
+    } else if (!is_obj_target(objtarget)) {
+        return mERROR("invalid object file architecture");
+    }
 
-    bool run_rt = !run_util;
-    std::string rthost, rtport;
-    if (run_rt) {
-        auto& rtargs = args["dest"].as<std::string>();
+    bool run_rt = !run_util && !serve;
+    bool zerocopy = args["zerocopy"].count() != 0;
+    if (zerocopy && !run_rt && !serve) {
+        return mERROR("option --zerocopy is invalid");
+    }
+    bool delta = args["delta"].count() != 0;
+    if (delta && !run_rt && !serve) {
+        return mERROR("option --delta is invalid");
+    }
+    bool compress = args["compress"].count() != 0;
+    if (compress && !run_rt && !serve) {
+        return mERROR("option --compress is invalid");
+    } else if (compress && zerocopy) {
+        return mERROR("options --compress and --zerocopy don't go together");
+    }
 
-        size_t sepoff = rtargs.find(',');
-        if (sepoff == rtargs.npos) {
-            rthost = rtargs;
-            rtport = RT_DEFAULT_PORT;
-        }
-        else if (sepoff == 0) {
-            return mERROR("missing FPGA hostname/ipaddr");
-        }
-        else {
-            rthost = rtargs.substr(0, sepoff);
-            rtport = rtargs.substr(sepoff + 1);
-        }
+    std::unique_ptr<transport> xport;
+    if (run_rt)
+    {
+        int e = make_transport(args["dest"].as<std::string>(), RT_DEFAULT_PORT,
+            zerocopy, delta, compress, args["verbose"].count() != 0, xport);
+        if (e) { return e; }
     }
-    else if (args["dest"].count() != 0) {
+    else if (!serve && args["dest"].count() != 0) {
         return mERROR("option --dest is invalid");
     }
 
-    fs::path inpath = args["in"].as<std::string>();
-    
-    bool needs_outpath = run_rt || tobin || tohdr;
+    fs::path inpath;
+    if (!serve && !batch) {
+        inpath = args["in"].as<std::string>();
+    }
+
+    bool needs_outpath = !batch && (run_rt || tobin || tohdr || toobj || tomesh);
     bool has_outpath = args["out"].count() != 0;
     if (needs_outpath && !has_outpath) {
         return mERROR("missing output file");
@@ -301,71 +487,253 @@ int main(int argc, char** argv)
     auto& serfmtstr = args["serfmt"].as<std::string>();
     bool dup = serfmtstr == "dup";
     bool nodup = serfmtstr == "nodup";
-    serial_format serfmt = dup ?
-        serial_format::Duplicate : serial_format::NoDuplicate;
+    bool meshlet = serfmtstr == "meshlet";
+    serial_format serfmt = dup ? serial_format::Duplicate :
+        nodup ? serial_format::NoDuplicate : serial_format::Meshlet;
 
-    if (!dup && !nodup) {
+    if (!dup && !nodup && !meshlet) {
         return mERROR("invalid serialization format");
     }
 
-    bool verbose = args["verbose"].count() != 0;
-    uint max_bv = args["max-bv"].as<uint>();
+    auto& bvordstr = args["bv-order"].as<std::string>();
+    bv_order bvord = bv_order::Tree;
+    if (bvordstr == "front") {
+        bvord = bv_order::Front;
+    } else if (bvordstr == "octant") {
+        bvord = bv_order::Octant;
+    } else if (bvordstr != "tree") {
+        return mERROR("invalid BV order");
+    }
+
+    scene_opts scopts;
+    scopts.max_bv = args["max-bv"].as<uint>();
+    scopts.ser_fmt = serfmt;
+    scopts.bv_ord = bvord;
+    scopts.split_budget = args["split-budget"].as<float>();
+    if (scopts.split_budget < 0) {
+        return mERROR("split budget must be non-negative");
+    }
+    scopts.instancing = args["instancing"].count() != 0;
+    scopts.cull = args["cull"].count() != 0;
+    scopts.cull_margin = args["cull-margin"].as<float>();
+    if (args["cull-margin"].count() != 0 && !scopts.cull) {
+        return mERROR("option --cull-margin requires --cull");
+    } else if (scopts.cull_margin < 0) {
+        return mERROR("cull margin must be non-negative");
+    }
+    if (args["tri-budget"].count() != 0)
+    {
+        scopts.tri_budget = args["tri-budget"].as<uint>();
+        if (scopts.tri_budget == 0) {
+            return mERROR("triangle budget must be positive");
+        }
+    }
+    scopts.quantize = args["quantize"].count() != 0;
+    scopts.isect_data = args["isect-data"].count() != 0;
+    scopts.light_cutoff = args["light-cutoff"].as<float>();
+    if (scopts.light_cutoff < 0) {
+        return mERROR("light cutoff must be non-negative");
+    }
+    scopts.shadow_samples = args["shadow-samples"].as<uint>();
+    scopts.refit_threshold = args["refit-threshold"].as<float>();
+    if (scopts.refit_threshold < 1) {
+        return mERROR("refit threshold must be at least 1");
+    }
+    scopts.verbose = args["verbose"].count() != 0;
+    const bool verbose = scopts.verbose;
+
+    if (serve)
+    {
+        std::vector<std::string> dests;
+        if (args["devices"].count() != 0)
+        {
+            BufWithSize<char> list;
+            int e = read_file(args["devices"].as<std::string>(), list);
+            if (e) { return e; }
+
+            std::string_view str(list.get(), list.size), line;
+            while (sv_getline(str, line))
+            {
+                while (!line.empty() && is_ws(line.back())) { line.remove_suffix(1); }
+                if (!line.empty()) { dests.emplace_back(line); }
+            }
+            if (dests.empty()) {
+                return mERROR("no devices listed");
+            }
+        }
+        else { dests.push_back(args["dest"].as<std::string>()); }
+
+        std::vector<std::unique_ptr<transport>> devices(dests.size());
+        for (size_t i = 0; i < dests.size(); ++i)
+        {
+            int e = make_transport(dests[i], RT_DEFAULT_PORT, zerocopy, delta, compress, verbose, devices[i]);
+            if (e) { return e; }
+        }
+        if (args["frames"].count() != 0) {
+            return mERROR("option --frames is invalid");
+        }
+        return run_daemon(args["serve"].as<std::string>(), devices,
+            size_t(args["cache-mb"].as<uint>()) << 20, scopts);
+    }
+
+    std::vector<std::vector<fs::path>> frames;
+    if (args["frames"].count() != 0)
+    {
+        if (tomesh || bv_report || batch) {
+            return mERROR("option --frames is invalid");
+        } else if (inpath.extension() != ".scene") {
+            return mERROR("frames expect .scene file");
+        }
+        int e = read_frame_list(args["frames"].as<std::string>(), frames);
+        if (e) { return e; }
+    }
 
     // the real work begins
     auto tbeg = chrono::high_resolution_clock::now();
 
-    // ---------------- Read scene ----------------- 
+    // ---------------- Convert mesh ----------------
+    if (tomesh)
+    {
+        mesh m;
+        int err = load_mesh(inpath, m, verbose);
+        if (!err) { err = save_rtmesh(outpath, m); }
+        if (err) { return err; }
+
+        auto tend = chrono::high_resolution_clock::now();
+        std::cout << "Saved output to " << outpath << "\n";
+        std::cout << "Completed in ";
+        print_duration(std::cout, tend - tbeg);
+        std::cout << ".\n";
+        return 0;
+    }
+
+    // scene buffer
     BufWithSize<uint> Scbuf;
+    mapped_file Scfile;
+    std::span<const uint> Scdata; // Scbuf, or Scfile if used as is
     std::pair<uint, uint> Scres;
+
+    // ------------ Output ------------ 
+    auto do_output = [&](const fs::path& out, std::pair<uint, uint> res,
+        std::span<const uint> buf)
+    {
+        int err = 0;
+        if (run_rt) {
+            err = raytrace(out, *xport, res, buf, Scfile.fd(), verbose);
+        } else {
+            if (tobin) {
+                err = write_file(out, buf.data(), buf.size());
+            } 
+            else if (tohdr) {
+                err = write_c_header(out, buf);
+            } 
+            else if (toobj) {
+                err = write_object(out, buf, objtarget);
+            }
+            else if (!bv_report) {
+                assert(false && "no output");
+            }
+            if (!err && !bv_report) {
+                std::cout << "Saved output to " << out << "\n";
+            }
+        }
+        return err;
+    };
+
+    // ---------------- Batch ----------------
+    if (batch) {
+        return run_batch(args["batch"].as<std::string>(), scopts, do_output);
+    }
+
+    // ---------------- Read scene ----------------- 
     if (inpath.extension() == ".scene")
     {
-        Scene scene(inpath, max_bv, serfmt, verbose);
+        Scene scene(inpath, scopts);
         if (!scene) { return EXIT_FAILURE; }
 
-        Scbuf.size = scene.nserial();
-        Scbuf.ptr = std::make_unique<uint[]>(Scbuf.size);
-        scene.serialize(Scbuf.get());
+        // serialize straight into the transport's memory if it has
+        // some, unless frames are refitted in place in Scbuf
+        const size_t nwords = scene.nserial();
+        uint* dst = xport && frames.empty() ? xport->scene_buffer(nwords) : nullptr;
+        if (!dst)
+        {
+            Scbuf.size = nwords;
+            Scbuf.ptr = std::make_unique<uint[]>(Scbuf.size);
+            dst = Scbuf.get();
+        }
+        scene.serialize(dst);
+        Scdata = { dst, nwords };
         Scres = scene.R;
 
         if (bv_report) { BV_report(scene); }
+
+        // frame 0 is the scene as loaded, then each listed frame
+        if (!frames.empty())
+        {
+            int err = scene.check_refit();
+            if (!err) { err = do_output(frame_path(outpath, 0), Scres, Scdata); }
+            for (size_t n = 0; !err && n < frames.size(); ++n)
+            {
+                std::vector<mesh> frame(frames[n].size());
+                for (size_t i = 0; !err && i < frame.size(); ++i) {
+                    err = load_mesh(frames[n][i], frame[i], verbose);
+                }
+                bool rebuilt = false;
+                if (!err) { err = scene.refit(frame, rebuilt); }
+                if (err) { break; }
+
+                if (rebuilt)
+                {
+                    Scbuf.size = scene.nserial();
+                    Scbuf.ptr = std::make_unique<uint[]>(Scbuf.size);
+                    scene.serialize(Scbuf.get());
+                    Scdata = { Scbuf.get(), Scbuf.size };
+                }
+                else { scene.serialize_refit(Scbuf.get()); }
+                err = do_output(frame_path(outpath, n + 1), Scres, Scdata);
+            }
+            if (err) { return err; }
+
+            auto tend = chrono::high_resolution_clock::now();
+            std::cout << "Completed " << frames.size() + 1 << " frames in ";
+            print_duration(std::cout, tend - tbeg);
+            std::cout << ".\n";
+            return 0;
+        }
     } 
     else {
         if (bv_report) {
             return mERROR("bv report expects .scene file");
         }
-        int e = read_file(inpath, Scbuf);
+        // mapped and sent as is if the endianness matches,
+        // otherwise swapped into a buffer. sendfile() reads the file
+        // from the page cache itself, so don't fault it all in first.
+        int e = Scfile.open(inpath, !zerocopy);
         if (e) { return e; }
+        if (Scfile.size() % sizeof(uint) != 0) {
+            return mERROR("input file is not %ubyte-aligned", uint(sizeof(uint)));
+        }
 
-        if (Scbuf.ptr[0] == Scene::MAGIC) {
-            Scres = { Scbuf.ptr[1], Scbuf.ptr[2] };
+        std::span<const uint> words(reinterpret_cast<const uint*>(Scfile.data()),
+            Scfile.size() / sizeof(uint));
+        if (words.size() < 3) {
+            return mERROR("missing magic number");
         }
-        else if (Scbuf.ptr[0] == bswap32(Scene::MAGIC)) {         
-            for (uint i = 0; i < Scbuf.size; ++i) {
-                Scbuf.ptr[i] = bswap32(Scbuf.ptr[i]);
-            }
-            Scres = { Scbuf.ptr[1], Scbuf.ptr[2] };
+        else if (words[0] == Scene::MAGIC) {
+            Scdata = words;
+        }
+        else if (words[0] == bswap32(Scene::MAGIC)) {
+            Scbuf.size = words.size();
+            Scbuf.ptr = std::make_unique_for_overwrite<uint[]>(Scbuf.size);
+            parallel_bswap32(words.data(), Scbuf.get(), Scbuf.size);
+            Scdata = { Scbuf.get(), Scbuf.size };
+            Scfile.close();
         }
         else return mERROR("missing magic number");
+        Scres = { Scdata[1], Scdata[2] };
     }
 
-    // ------------ Do output ------------ 
-    int err = 0;
-    if (run_rt) {
-        err = raytrace(outpath, rthost, rtport, Scres, Scbuf, verbose);
-    } else {
-        if (tobin) {
-            err = write_file(outpath, Scbuf);
-        } 
-        else if (tohdr) {
-            err = to_hdr(outpath, Scbuf);
-        } 
-        else if (!bv_report) {
-            assert(false && "no output");
-        }
-        if (!err && !bv_report) {
-            std::cout << "Saved output to " << outpath << "\n";
-        }
-    }
+    int err = do_output(outpath, Scres, Scdata);
     if (err) { return err; }
 
     auto tend = chrono::high_resolution_clock::now();
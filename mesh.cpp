@@ -0,0 +1,1275 @@
+
+#include <cassert>
+#include <climits>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <cmath>
+
+#include "rapidobj/rapidobj.hpp"
+#include "defs.hpp"
+
+static_assert(sizeof(vec3) == 3 * sizeof(float), "vec3 is not packed");
+
+static inline bool is_little_endian() {
+    return std::endian::native == std::endian::little;
+}
+
+// ------------------------------- OBJ -------------------------------
+
+static mat obj_to_mat(const rapidobj::Material& mobj)
+{
+    mat m;
+    m.ka = mobj.ambient;
+    m.kd = mobj.diffuse;
+    m.ks = mobj.specular;
+    m.ns = mobj.shininess;
+
+    // solve 1000-2000r+1000r^{2} = ns to get roughness (blender's formula).
+    // then approximate refl as 1-roughness (stupid but should work).
+    // this simplifies to sqrt(ns/1000)
+    assert(m.ns >= 0);
+    float ref_ns = m.ns > 1000 ? 1 : m.ns / 1000;
+    float refl = std::sqrt(ref_ns);
+    m.km = { refl, refl, refl };
+    return m;
+}
+
+static int load_obj(const fs::path& objpath, mesh& out)
+{
+    auto objname = objpath.filename();
+    DECL_UTF8PATH_CSTR(objname)
+
+    rapidobj::Result res = rapidobj::ParseFile(objpath);
+    if (res.error || !rapidobj::Triangulate(res))
+    {
+        return mERROR("%s:%d: %s", pobjname,
+            int(res.error.line_num), res.error.code.message().c_str());
+    }
+
+    auto& objverts = res.attributes.positions;
+    out.V.reserve(objverts.size() / 3);
+    for (size_t i = 0; i < objverts.size(); i += 3) {
+        out.V.push_back({ objverts[i], objverts[i + 1], objverts[i + 2] });
+    }
+
+    auto& objnormals = res.attributes.normals;
+    out.NV.reserve(objnormals.size() / 3);
+    for (size_t i = 0; i < objnormals.size(); i += 3) {
+        out.NV.push_back({ objnormals[i], objnormals[i + 1], objnormals[i + 2] });
+    }
+#if ENABLE_TEXTURES
+    auto& objUV = res.attributes.texcoords;
+    for (size_t i = 0; i < objUV.size(); i += 2) {
+        out.UV.push_back({ objUV[i], objUV[i + 1] });
+    }
+#endif
+    for (const auto& mobj : res.materials) {
+        out.M.push_back(obj_to_mat(mobj));
+    }
+
+    for (const auto& shape : res.shapes)
+    {
+        if (shape.lines.indices.size() != 0 ||
+            shape.points.indices.size() != 0) {
+            return mERROR("%s: polylines/points not supported", pobjname);
+        }
+
+        auto& meshidx = shape.mesh.indices;
+        auto& matids = shape.mesh.material_ids;
+        assert(meshidx.size() / 3 == matids.size());
+
+        for (size_t i = 0; i < meshidx.size(); i += 3)
+        {
+            tri t;
+            t.Vidx = {
+                meshidx[i].position_index,
+                meshidx[i + 1].position_index,
+                meshidx[i + 2].position_index };
+
+            if (meshidx[i].normal_index != -1 &&
+                meshidx[i + 1].normal_index != -1 &&
+                meshidx[i + 2].normal_index != -1) [[likely]]
+            {
+                t.NVidx = {
+                    meshidx[i].normal_index,
+                    meshidx[i + 1].normal_index,
+                    meshidx[i + 2].normal_index
+                };
+            }
+            else { t.NVidx[0] = -1; }
+
+#if ENABLE_TEXTURES
+            if (meshidx[i].texcoord_index != -1 &&
+                meshidx[i + 1].texcoord_index != -1 &&
+                meshidx[i + 2].texcoord_index != -1) [[likely]]
+            {
+                t.UVidx = {
+                    meshidx[i].texcoord_index,
+                    meshidx[i + 1].texcoord_index,
+                    meshidx[i + 2].texcoord_index
+                };
+            }
+            else { t.UVidx[0] = -1; }
+#endif
+            t.matid = matids[i / 3];
+            out.F.push_back(t);
+        }
+    }
+    return 0;
+}
+
+// ------------------------------- PLY -------------------------------
+// Binary PLY only (ascii PLY is no faster than OBJ).
+// http://paulbourke.net/dataformats/ply/
+
+namespace {
+
+enum class ply_type { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64 };
+
+struct ply_prop
+{
+    std::string_view name;
+    ply_type type;
+    bool is_list = false;
+    ply_type count_type; // list only
+};
+
+struct ply_elem
+{
+    std::string_view name;
+    size_t count;
+    std::vector<ply_prop> props;
+
+    // size of each element, 0 if variable (has lists)
+    size_t stride() const;
+    const ply_prop* find(std::string_view pname, size_t& off) const;
+};
+
+}
+
+static bool ply_parse_type(std::string_view s, ply_type& t)
+{
+    if (s == "char" || s == "int8") { t = ply_type::Int8; }
+    else if (s == "uchar" || s == "uint8") { t = ply_type::UInt8; }
+    else if (s == "short" || s == "int16") { t = ply_type::Int16; }
+    else if (s == "ushort" || s == "uint16") { t = ply_type::UInt16; }
+    else if (s == "int" || s == "int32") { t = ply_type::Int32; }
+    else if (s == "uint" || s == "uint32") { t = ply_type::UInt32; }
+    else if (s == "float" || s == "float32") { t = ply_type::Float32; }
+    else if (s == "double" || s == "float64") { t = ply_type::Float64; }
+    else { return false; }
+    return true;
+}
+
+static constexpr size_t ply_type_size(ply_type t)
+{
+    switch (t)
+    {
+    case ply_type::Int8: case ply_type::UInt8: return 1;
+    case ply_type::Int16: case ply_type::UInt16: return 2;
+    case ply_type::Int32: case ply_type::UInt32: case ply_type::Float32: return 4;
+    case ply_type::Float64: return 8;
+    }
+    return 0;
+}
+
+size_t ply_elem::stride() const
+{
+    size_t s = 0;
+    for (auto& p : props) {
+        if (p.is_list) { return 0; }
+        s += ply_type_size(p.type);
+    }
+    return s;
+}
+
+const ply_prop* ply_elem::find(std::string_view pname, size_t& off) const
+{
+    off = 0;
+    for (auto& p : props) {
+        if (p.name == pname) { return &p; }
+        off += ply_type_size(p.type);
+    }
+    return nullptr;
+}
+
+template <typename T>
+static inline T ply_load(const byte* p, bool swap)
+{
+    if (!swap) {
+        T v; std::memcpy(&v, p, sizeof(T));
+        return v;
+    }
+    byte b[sizeof(T)];
+    std::reverse_copy(p, p + sizeof(T), b);
+    T v; std::memcpy(&v, b, sizeof(T));
+    return v;
+}
+
+static inline double ply_read(const byte* p, ply_type t, bool swap)
+{
+    switch (t)
+    {
+    case ply_type::Int8: return double(ply_load<int8_t>(p, swap));
+    case ply_type::UInt8: return double(ply_load<uint8_t>(p, swap));
+    case ply_type::Int16: return double(ply_load<int16_t>(p, swap));
+    case ply_type::UInt16: return double(ply_load<uint16_t>(p, swap));
+    case ply_type::Int32: return double(ply_load<int32_t>(p, swap));
+    case ply_type::UInt32: return double(ply_load<uint32_t>(p, swap));
+    case ply_type::Float32: return double(ply_load<float>(p, swap));
+    case ply_type::Float64: return ply_load<double>(p, swap);
+    }
+    return 0;
+}
+
+static constexpr bool ply_is_int(ply_type t)
+{
+    return t != ply_type::Float32 && t != ply_type::Float64;
+}
+
+// Integer value for list counts and face indices, whose types are checked
+// by ply_is_int when the header is read, so nothing goes through a double.
+static inline int64_t ply_read_int(const byte* p, ply_type t, bool swap)
+{
+    switch (t)
+    {
+    case ply_type::Int8: return ply_load<int8_t>(p, swap);
+    case ply_type::UInt8: return ply_load<uint8_t>(p, swap);
+    case ply_type::Int16: return ply_load<int16_t>(p, swap);
+    case ply_type::UInt16: return ply_load<uint16_t>(p, swap);
+    case ply_type::Int32: return ply_load<int32_t>(p, swap);
+    case ply_type::UInt32: return ply_load<uint32_t>(p, swap);
+    case ply_type::Float32: case ply_type::Float64: break;
+    }
+    return -1;
+}
+
+// Skip over one property, returns null if out of bounds.
+static const byte* ply_skip(const byte* p, const byte* end, const ply_prop& pr, bool swap)
+{
+    if (pr.is_list) {
+        if (end - p < ptrdiff_t(ply_type_size(pr.count_type))) { return nullptr; }
+        int64_t n = ply_read_int(p, pr.count_type, swap);
+        p += ply_type_size(pr.count_type);
+        if (n < 0 || size_t(end - p) / ply_type_size(pr.type) < size_t(n)) { return nullptr; }
+        return p + size_t(n) * ply_type_size(pr.type);
+    }
+    if (end - p < ptrdiff_t(ply_type_size(pr.type))) { return nullptr; }
+    return p + ply_type_size(pr.type);
+}
+
+static int load_ply(const fs::path& plypath, mesh& out)
+{
+    auto plyname = plypath.filename();
+    DECL_UTF8PATH_CSTR(plyname)
+
+#define plyERROR(msg) mERROR("%s: %s", pplyname, msg)
+
+    mapped_file mf;
+    int e = mf.open(plypath);
+    if (e) { return e; }
+
+    std::string_view hdr(reinterpret_cast<const char*>(mf.data()), mf.size());
+    size_t hdr_end = hdr.find("end_header");
+    if (!hdr.starts_with("ply") || hdr_end == hdr.npos) {
+        return plyERROR("not a PLY file");
+    }
+    // data starts after the end_header line
+    size_t data_off = hdr.find('\n', hdr_end);
+    if (data_off == hdr.npos) {
+        return plyERROR("truncated header");
+    }
+    hdr = hdr.substr(0, hdr_end);
+
+    bool swap = false, has_fmt = false;
+    std::vector<ply_elem> elems;
+    std::string_view line;
+    while (sv_getline(hdr, line))
+    {
+        if (line.starts_with("format "))
+        {
+            if (line.starts_with("format binary_little_endian ")) {
+                swap = !is_little_endian();
+            } else if (line.starts_with("format binary_big_endian ")) {
+                swap = is_little_endian();
+            } else {
+                return plyERROR("only binary PLY is supported");
+            }
+            has_fmt = true;
+        }
+        else if (line.starts_with("element "))
+        {
+            line.remove_prefix(sizeof("element ") - 1);
+            size_t sp = line.find(' ');
+            if (sp == line.npos) { return plyERROR("invalid element"); }
+
+            ply_elem el;
+            el.name = line.substr(0, sp);
+            auto cnt = line.substr(sp + 1);
+            auto res = std::from_chars(cnt.data(), cnt.data() + cnt.size(), el.count);
+            if (res.ec != std::errc()) { return plyERROR("invalid element count"); }
+            elems.push_back(el);
+        }
+        else if (line.starts_with("property "))
+        {
+            if (elems.empty()) { return plyERROR("property outside element"); }
+            line.remove_prefix(sizeof("property ") - 1);
+
+            ply_prop pr;
+            if (line.starts_with("list "))
+            {
+                line.remove_prefix(sizeof("list ") - 1);
+                size_t sp = line.find(' ');
+                if (sp == line.npos || !ply_parse_type(line.substr(0, sp), pr.count_type)) {
+                    return plyERROR("invalid list property");
+                }
+                if (!ply_is_int(pr.count_type)) {
+                    return plyERROR("list count must have an integer type");
+                }
+                line.remove_prefix(sp + 1);
+                pr.is_list = true;
+            }
+            size_t sp = line.find(' ');
+            if (sp == line.npos || !ply_parse_type(line.substr(0, sp), pr.type)) {
+                return plyERROR("invalid property");
+            }
+            pr.name = line.substr(sp + 1);
+            elems.back().props.push_back(pr);
+        }
+        // ignore comment, obj_info etc.
+    }
+    if (!has_fmt) {
+        return plyERROR("missing format");
+    }
+
+    const byte* p = mf.data() + data_off + 1;
+    const byte* const end = mf.data() + mf.size();
+
+    for (const auto& el : elems)
+    {
+        if (el.name == "vertex")
+        {
+            size_t stride = el.stride();
+            if (stride == 0) { return plyERROR("list properties in vertex not supported"); }
+            if (size_t(end - p) / stride < el.count) { return plyERROR("truncated vertex data"); }
+
+            size_t off[6];
+            const ply_prop* pr[6] = {
+                el.find("x", off[0]), el.find("y", off[1]), el.find("z", off[2]),
+                el.find("nx", off[3]), el.find("ny", off[4]), el.find("nz", off[5]) };
+
+            if (!pr[0] || !pr[1] || !pr[2]) {
+                return plyERROR("missing vertex position");
+            }
+            bool has_normals = pr[3] && pr[4] && pr[5];
+            int nprops = has_normals ? 6 : 3;
+
+            // Fast path: packed float xyz[nxnynz] in native order.
+            bool packed = !swap;
+            for (int i = 0; i < nprops; ++i) {
+                packed = packed && pr[i]->type == ply_type::Float32 && off[i] == i * sizeof(float);
+            }
+
+            out.V.resize(el.count);
+            if (has_normals) { out.NV.resize(el.count); }
+
+            if (packed && stride == sizeof(vec3)) {
+                std::memcpy(out.V.data(), p, el.count * sizeof(vec3));
+            }
+            else if (packed)
+            {
+                for (size_t i = 0; i < el.count; ++i) {
+                    std::memcpy(&out.V[i], p + i * stride, sizeof(vec3));
+                    if (has_normals) {
+                        std::memcpy(&out.NV[i], p + i * stride + sizeof(vec3), sizeof(vec3));
+                    }
+                }
+            }
+            else
+            {
+                for (size_t i = 0; i < el.count; ++i)
+                {
+                    const byte* pv = p + i * stride;
+                    for (int k = 0; k < 3; ++k) {
+                        out.V[i][k] = float(ply_read(pv + off[k], pr[k]->type, swap));
+                    }
+                    if (has_normals) {
+                        for (int k = 0; k < 3; ++k) {
+                            out.NV[i][k] = float(ply_read(pv + off[3 + k], pr[3 + k]->type, swap));
+                        }
+                    }
+                }
+            }
+            p += el.count * stride;
+        }
+        else if (el.name == "face")
+        {
+            const ply_prop* idxprop = nullptr;
+            for (auto& pr : el.props) {
+                if (pr.is_list && (pr.name == "vertex_indices" || pr.name == "vertex_index")) {
+                    idxprop = &pr;
+                }
+            }
+            if (!idxprop) { return plyERROR("missing face indices"); }
+            if (!ply_is_int(idxprop->type)) { return plyERROR("face indices must have an integer type"); }
+            if (out.V.size() > size_t(INT_MAX)) { return plyERROR("too many vertices"); }
+
+            const size_t csize = ply_type_size(idxprop->count_type);
+            const size_t isize = ply_type_size(idxprop->type);
+            const int nverts = int(out.V.size());
+
+            // a face takes at least a count and 3 indices, which bounds
+            // the header's count before it sizes anything
+            if (size_t(end - p) / (csize + 3 * isize) < el.count) {
+                return plyERROR("truncated face data");
+            }
+            out.F.reserve(el.count);
+            for (size_t i = 0; i < el.count; ++i)
+            {
+                for (auto& pr : el.props)
+                {
+                    if (&pr != idxprop) {
+                        p = ply_skip(p, end, pr, swap);
+                        if (!p) { return plyERROR("truncated face data"); }
+                        continue;
+                    }
+                    if (size_t(end - p) < csize) { return plyERROR("truncated face data"); }
+                    int64_t cnt = ply_read_int(p, pr.count_type, swap);
+                    p += csize;
+                    if (cnt < 3) { return plyERROR("face with less than 3 vertices"); }
+                    const size_t n = size_t(cnt);
+                    if (size_t(end - p) / isize < n) { return plyERROR("truncated face data"); }
+
+                    // triangulate as fan, indices are range checked as
+                    // int64 before they are narrowed
+                    int64_t i0 = ply_read_int(p, pr.type, swap);
+                    int64_t iprev = ply_read_int(p + isize, pr.type, swap);
+                    for (size_t k = 2; k < n; ++k)
+                    {
+                        int64_t icur = ply_read_int(p + k * isize, pr.type, swap);
+                        if (i0 < 0 || iprev < 0 || icur < 0 ||
+                            i0 >= nverts || iprev >= nverts || icur >= nverts) {
+                            return plyERROR("face index out of range");
+                        }
+                        tri t;
+                        t.Vidx = { int(i0), int(iprev), int(icur) };
+                        if (!out.NV.empty()) { t.NVidx = t.Vidx; }
+                        else { t.NVidx[0] = -1; }
+#if ENABLE_TEXTURES
+                        t.UVidx[0] = -1;
+#endif
+                        t.matid = -1; // no materials in PLY
+                        out.F.push_back(t);
+                        iprev = icur;
+                    }
+                    p += n * isize;
+                }
+            }
+        }
+        else
+        {
+            // skip unknown element
+            size_t stride = el.stride();
+            if (stride != 0) {
+                if (size_t(end - p) / stride < el.count) { return plyERROR("truncated data"); }
+                p += el.count * stride;
+            }
+            else {
+                for (size_t i = 0; i < el.count && p; ++i) {
+                    for (size_t k = 0; k < el.props.size() && p; ++k) {
+                        p = ply_skip(p, end, el.props[k], swap);
+                    }
+                }
+                if (!p) { return plyERROR("truncated data"); }
+            }
+        }
+    }
+    return 0;
+
+#undef plyERROR
+}
+
+// ------------------------------- GLB -------------------------------
+// Binary glTF 2.0, geometry and base PBR material factors only.
+// https://registry.khronos.org/glTF/specs/2.0/glTF-2.0.html
+
+namespace {
+
+// Minimal JSON DOM. Strings are views into the
+// source, escapes are not decoded (glTF keys never have any).
+struct json
+{
+    enum kind_t { Null, Bool, Number, String, Array, Object };
+
+    kind_t kind = Null;
+    bool b = false;
+    double num = 0;
+    std::string_view str;
+    std::vector<json> arr;
+    std::vector<std::pair<std::string_view, json>> obj;
+
+    const json* find(std::string_view key) const
+    {
+        if (kind != Object) { return nullptr; }
+        for (auto& kv : obj) {
+            if (kv.first == key) { return &kv.second; }
+        }
+        return nullptr;
+    }
+
+    const json* at(size_t i) const {
+        return (kind == Array && i < arr.size()) ? &arr[i] : nullptr;
+    }
+
+    // A whole number in [0, limit), so it can be cast to size_t.
+    bool is_size(size_t limit) const {
+        return kind == Number && num >= 0 && num < double(limit) && num == std::floor(num);
+    }
+
+    // Element at the index held by i, if that is a valid index.
+    const json* at(const json& i) const {
+        return i.is_size(arr.size()) ? at(size_t(i.num)) : nullptr;
+    }
+
+    // Optional size member, dflt if missing, false if it isn't in [0, limit).
+    bool size_or(std::string_view key, size_t dflt, size_t limit, size_t& out) const
+    {
+        auto* v = find(key);
+        if (!v) {
+            out = dflt;
+            return true;
+        }
+        if (!v->is_size(limit)) { return false; }
+        out = size_t(v->num);
+        return true;
+    }
+
+    double num_or(std::string_view key, double dflt) const
+    {
+        auto* v = find(key);
+        return (v && v->kind == Number) ? v->num : dflt;
+    }
+};
+
+struct json_parser
+{
+    const char* p;
+    const char* end;
+    int depth = 0;
+
+    void skip_ws() {
+        while (p != end && is_ws(*p)) { p++; }
+    }
+
+    bool lit(std::string_view s)
+    {
+        if (size_t(end - p) < s.size() || std::string_view(p, s.size()) != s) {
+            return false;
+        }
+        p += s.size();
+        return true;
+    }
+
+    bool parse_str(std::string_view& s)
+    {
+        if (p == end || *p != '"') { return false; }
+        const char* beg = ++p;
+        while (p != end && *p != '"') {
+            if (*p == '\\') { p++; }
+            if (p != end) { p++; }
+        }
+        if (p == end) { return false; }
+        s = { beg, size_t(p - beg) };
+        p++;
+        return true;
+    }
+
+    bool parse(json& v)
+    {
+        if (++depth > 128) { return false; }
+        skip_ws();
+        if (p == end) { return false; }
+
+        bool ok = true;
+        switch (*p)
+        {
+        case '{':
+            v.kind = json::Object; p++; skip_ws();
+            if (p != end && *p == '}') { p++; break; }
+            while (ok)
+            {
+                std::string_view key;
+                skip_ws();
+                ok = parse_str(key);
+                skip_ws();
+                ok = ok && p != end && *p++ == ':';
+                if (!ok) { break; }
+
+                v.obj.emplace_back(key, json{});
+                ok = parse(v.obj.back().second);
+                skip_ws();
+                if (!ok || p == end) { ok = false; break; }
+                if (*p == '}') { p++; break; }
+                ok = *p++ == ',';
+            }
+            break;
+        case '[':
+            v.kind = json::Array; p++; skip_ws();
+            if (p != end && *p == ']') { p++; break; }
+            while (ok)
+            {
+                v.arr.emplace_back();
+                ok = parse(v.arr.back());
+                skip_ws();
+                if (!ok || p == end) { ok = false; break; }
+                if (*p == ']') { p++; break; }
+                ok = *p++ == ',';
+            }
+            break;
+        case '"':
+            v.kind = json::String;
+            ok = parse_str(v.str);
+            break;
+        case 't': v.kind = json::Bool; v.b = true; ok = lit("true"); break;
+        case 'f': v.kind = json::Bool; ok = lit("false"); break;
+        case 'n': ok = lit("null"); break;
+        default:
+        {
+            v.kind = json::Number;
+            if (*p == '+') { p++; }
+            auto res = std::from_chars(p, end, v.num);
+            ok = res.ec == std::errc();
+            p = res.ptr;
+            break;
+        }
+        }
+        depth--;
+        return ok;
+    }
+};
+
+struct glb_ctx
+{
+    const json* accessors;
+    const json* views;
+    const byte* bin;
+    size_t binsize;
+};
+
+// Typed view of a glTF accessor.
+struct glb_accessor
+{
+    const byte* data;
+    size_t count;
+    size_t stride;
+    int ctype; // component type
+    int ncomp; // components per element
+};
+
+}
+
+static constexpr int GLTF_UBYTE = 5121;
+static constexpr int GLTF_USHORT = 5123;
+static constexpr int GLTF_UINT = 5125;
+static constexpr int GLTF_FLOAT = 5126;
+
+static bool glb_get_accessor(const glb_ctx& ctx, const json* idx, glb_accessor& acc)
+{
+    if (!idx || !ctx.accessors) { return false; }
+    const json* a = ctx.accessors->at(*idx);
+    if (!a || a->find("sparse")) { return false; }
+
+    const json* vidx = a->find("bufferView");
+    const json* type = a->find("type");
+    if (!vidx || !type || !ctx.views) { return false; }
+
+    const json* view = ctx.views->at(*vidx);
+    // only the GLB-stored buffer is supported
+    if (!view || view->num_or("buffer", 0) != 0) { return false; }
+
+    acc.ctype = int(a->num_or("componentType", 0));
+    // every element takes at least a byte
+    if (!a->size_or("count", 0, ctx.binsize + 1, acc.count)) { return false; }
+
+    if (type->str == "SCALAR") { acc.ncomp = 1; }
+    else if (type->str == "VEC3") { acc.ncomp = 3; }
+    else { acc.ncomp = 0; }
+
+    size_t csize =
+        acc.ctype == GLTF_UBYTE ? 1 :
+        acc.ctype == GLTF_USHORT ? 2 :
+        (acc.ctype == GLTF_UINT || acc.ctype == GLTF_FLOAT) ? 4 : 0;
+    if (csize == 0 || acc.ncomp == 0) { return false; }
+
+    size_t esize = csize * acc.ncomp;
+    size_t voff, aoff, len;
+    if (!view->size_or("byteStride", 0, ctx.binsize + 1, acc.stride) ||
+        !view->size_or("byteOffset", 0, ctx.binsize + 1, voff) ||
+        !view->size_or("byteLength", 0, ctx.binsize + 1, len) ||
+        !a->size_or("byteOffset", 0, ctx.binsize + 1, aoff)) {
+        return false;
+    }
+    if (acc.stride == 0) { acc.stride = esize; }
+
+    // the view within the buffer, the accessor within the view; no
+    // products, so nothing can wrap around
+    if (len > ctx.binsize - voff || aoff > len) { return false; }
+    const size_t avail = len - aoff;
+    if (acc.count != 0 &&
+        (esize > avail || acc.count - 1 > (avail - esize) / acc.stride)) {
+        return false;
+    }
+    acc.data = ctx.bin + voff + aoff;
+    return true;
+}
+
+static xform glb_node_xform(const json& node)
+{
+    xform x = xform::identity();
+    if (auto* m = node.find("matrix"); m && m->arr.size() == 16)
+    {
+        // column-major 4x4
+        for (int c = 0; c < 4; ++c) {
+            for (int r = 0; r < 3; ++r) {
+                x.m[r][c] = float(m->arr[c * 4 + r].num);
+            }
+        }
+        return x;
+    }
+
+    vec3 s = { 1, 1, 1 };
+    if (auto* sv = node.find("scale"); sv && sv->arr.size() == 3) {
+        s = { float(sv->arr[0].num), float(sv->arr[1].num), float(sv->arr[2].num) };
+    }
+    if (auto* q = node.find("rotation"); q && q->arr.size() == 4)
+    {
+        float qx = float(q->arr[0].num), qy = float(q->arr[1].num);
+        float qz = float(q->arr[2].num), qw = float(q->arr[3].num);
+
+        x.m[0][0] = 1 - 2 * (qy * qy + qz * qz);
+        x.m[0][1] = 2 * (qx * qy - qz * qw);
+        x.m[0][2] = 2 * (qx * qz + qy * qw);
+        x.m[1][0] = 2 * (qx * qy + qz * qw);
+        x.m[1][1] = 1 - 2 * (qx * qx + qz * qz);
+        x.m[1][2] = 2 * (qy * qz - qx * qw);
+        x.m[2][0] = 2 * (qx * qz - qy * qw);
+        x.m[2][1] = 2 * (qy * qz + qx * qw);
+        x.m[2][2] = 1 - 2 * (qx * qx + qy * qy);
+    }
+    for (int r = 0; r < 3; ++r) {
+        for (int c = 0; c < 3; ++c) {
+            x.m[r][c] *= s[c];
+        }
+    }
+    if (auto* t = node.find("translation"); t && t->arr.size() == 3) {
+        x.m[0][3] = float(t->arr[0].num);
+        x.m[1][3] = float(t->arr[1].num);
+        x.m[2][3] = float(t->arr[2].num);
+    }
+    return x;
+}
+
+static mat glb_to_mat(const json& gmat)
+{
+    mat m = mat::default_mat();
+    vec3 base = { 1, 1, 1 };
+    float metallic = 1, roughness = 1;
+
+    if (auto* pbr = gmat.find("pbrMetallicRoughness"))
+    {
+        if (auto* bc = pbr->find("baseColorFactor"); bc && bc->arr.size() >= 3) {
+            base = { float(bc->arr[0].num), float(bc->arr[1].num), float(bc->arr[2].num) };
+        }
+        metallic = float(pbr->num_or("metallicFactor", 1));
+        roughness = float(pbr->num_or("roughnessFactor", 1));
+    }
+    m.kd = base;
+    // metals tint their highlights
+    m.ks = (1 - metallic) * m.ks + metallic * base;
+    // inverse of blender's roughness formula (see obj_to_mat)
+    m.ns = 1000 * (1 - roughness) * (1 - roughness);
+    m.km = { 1 - roughness, 1 - roughness, 1 - roughness };
+    return m;
+}
+
+static int glb_add_prim(const glb_ctx& ctx, const json& prim,
+    const xform& x, int nmats, mesh& out)
+{
+    if (prim.num_or("mode", 4) != 4) {
+        return mERROR("only triangle primitives are supported");
+    }
+    const json* attrs = prim.find("attributes");
+    if (!attrs) { return mERROR("primitive has no attributes"); }
+
+    glb_accessor pos, nrm, idx;
+    if (!glb_get_accessor(ctx, attrs->find("POSITION"), pos) ||
+        pos.ctype != GLTF_FLOAT || pos.ncomp != 3) {
+        return mERROR("invalid POSITION accessor");
+    }
+    bool has_nrm = attrs->find("NORMAL") != nullptr;
+    if (has_nrm && (!glb_get_accessor(ctx, attrs->find("NORMAL"), nrm) ||
+        nrm.ctype != GLTF_FLOAT || nrm.ncomp != 3 || nrm.count != pos.count)) {
+        return mERROR("invalid NORMAL accessor");
+    }
+    bool has_idx = prim.find("indices") != nullptr;
+    if (has_idx && (!glb_get_accessor(ctx, prim.find("indices"), idx) ||
+        idx.ncomp != 1 || idx.ctype == GLTF_FLOAT)) {
+        return mERROR("invalid indices accessor");
+    }
+
+    const int baseV = int(out.V.size());
+    const int baseNV = int(out.NV.size());
+    const bool identity = x.is_identity();
+
+    out.V.resize(baseV + pos.count);
+    if (identity && pos.stride == sizeof(vec3)) {
+        std::memcpy(&out.V[baseV], pos.data, pos.count * sizeof(vec3));
+    }
+    else {
+        for (size_t i = 0; i < pos.count; ++i)
+        {
+            vec3 v;
+            std::memcpy(&v, pos.data + i * pos.stride, sizeof(vec3));
+            out.V[baseV + i] = x.apply(v);
+        }
+    }
+    if (has_nrm)
+    {
+        const xform nx = x.normal_xform();
+        out.NV.resize(baseNV + nrm.count);
+        for (size_t i = 0; i < nrm.count; ++i)
+        {
+            vec3 n;
+            std::memcpy(&n, nrm.data + i * nrm.stride, sizeof(vec3));
+            out.NV[baseNV + i] = identity ? n : nx.apply_dir(n).normalized();
+        }
+    }
+
+    int matid = -1;
+    if (auto* mi = prim.find("material")) {
+        if (!mi->is_size(size_t(nmats))) {
+            return mERROR("material index out of range");
+        }
+        matid = int(mi->num);
+    }
+
+    size_t nidx = has_idx ? idx.count : pos.count;
+    if (nidx % 3 != 0) {
+        return mERROR("index count is not a multiple of 3");
+    }
+    auto get_idx = [&](size_t i) -> size_t
+    {
+        if (!has_idx) { return i; }
+        const byte* p = idx.data + i * idx.stride;
+        switch (idx.ctype)
+        {
+        case GLTF_UBYTE: return *p;
+        case GLTF_USHORT: { uint16_t v; std::memcpy(&v, p, 2); return v; }
+        default: { uint32_t v; std::memcpy(&v, p, 4); return v; }
+        }
+    };
+
+    // flip winding for mirroring transforms
+    const bool flip = x.det() < 0;
+
+    out.F.reserve(out.F.size() + nidx / 3);
+    for (size_t i = 0; i < nidx; i += 3)
+    {
+        size_t i0 = get_idx(i), i1 = get_idx(i + 1), i2 = get_idx(i + 2);
+        if (i0 >= pos.count || i1 >= pos.count || i2 >= pos.count) {
+            return mERROR("index out of range");
+        }
+        if (flip) { std::swap(i1, i2); }
+
+        tri t;
+        t.Vidx = { baseV + int(i0), baseV + int(i1), baseV + int(i2) };
+        if (has_nrm) { t.NVidx = { baseNV + int(i0), baseNV + int(i1), baseNV + int(i2) }; }
+        else { t.NVidx[0] = -1; }
+#if ENABLE_TEXTURES
+        t.UVidx[0] = -1;
+#endif
+        t.matid = matid;
+        out.F.push_back(t);
+    }
+    return 0;
+}
+
+static int glb_add_node(const glb_ctx& ctx, const json& root, size_t nodeid,
+    const xform& parent, int depth, mesh& out)
+{
+    const json* nodes = root.find("nodes");
+    const json* node = nodes ? nodes->at(nodeid) : nullptr;
+    if (!node || depth > 64) { return mERROR("invalid node hierarchy"); }
+
+    xform x = parent * glb_node_xform(*node);
+
+    if (auto* mi = node->find("mesh"))
+    {
+        const json* meshes = root.find("meshes");
+        const json* gmesh = meshes ? meshes->at(*mi) : nullptr;
+        const json* prims = gmesh ? gmesh->find("primitives") : nullptr;
+        if (!prims) { return mERROR("invalid mesh"); }
+
+        for (const auto& prim : prims->arr) {
+            int e = glb_add_prim(ctx, prim, x, int(out.M.size()), out);
+            if (e) { return e; }
+        }
+    }
+    if (auto* children = node->find("children"))
+    {
+        for (const auto& c : children->arr) {
+            if (!c.is_size(SIZE_MAX)) { return mERROR("invalid node hierarchy"); }
+            int e = glb_add_node(ctx, root, size_t(c.num), x, depth + 1, out);
+            if (e) { return e; }
+        }
+    }
+    return 0;
+}
+
+static int load_glb(const fs::path& glbpath, mesh& out)
+{
+    auto glbname = glbpath.filename();
+    DECL_UTF8PATH_CSTR(glbname)
+
+#define glbERROR(msg) mERROR("%s: %s", pglbname, msg)
+
+    mapped_file mf;
+    int e = mf.open(glbpath);
+    if (e) { return e; }
+
+    const byte* p = mf.data();
+    const size_t size = mf.size();
+
+    // header: magic, version, length
+    // chunks: length, type, data (4-byte aligned)
+    if (size < 20 || ply_load<uint32_t>(p, !is_little_endian()) != 0x46546C67) {
+        return glbERROR("not a GLB file");
+    }
+    if (ply_load<uint32_t>(p + 4, !is_little_endian()) != 2) {
+        return glbERROR("only glTF 2.0 is supported");
+    }
+    if (!is_little_endian()) {
+        return glbERROR("GLB requires a little-endian host");
+    }
+
+    std::string_view jsonstr;
+    const byte* bin = nullptr;
+    size_t binsize = 0;
+    for (size_t off = 12; off + 8 <= size;)
+    {
+        uint32_t clen, ctype;
+        std::memcpy(&clen, p + off, 4);
+        std::memcpy(&ctype, p + off + 4, 4);
+        off += 8;
+        if (clen > size - off) { return glbERROR("truncated chunk"); }
+
+        if (ctype == 0x4E4F534A && jsonstr.empty()) {
+            jsonstr = { reinterpret_cast<const char*>(p + off), clen };
+        } else if (ctype == 0x004E4942 && !bin) {
+            bin = p + off;
+            binsize = clen;
+        }
+        off += (size_t(clen) + 3) & ~size_t(3);
+    }
+
+    json root;
+    json_parser jp{ jsonstr.data(), jsonstr.data() + jsonstr.size() };
+    if (jsonstr.empty() || !jp.parse(root) || root.kind != json::Object) {
+        return glbERROR("invalid JSON chunk");
+    }
+
+    if (auto* mats = root.find("materials")) {
+        for (const auto& gm : mats->arr) {
+            out.M.push_back(glb_to_mat(gm));
+        }
+    }
+
+    glb_ctx ctx{ root.find("accessors"), root.find("bufferViews"), bin, binsize };
+
+    // default scene if there is one, else all root nodes
+    std::vector<size_t> roots;
+    const json* scenes = root.find("scenes");
+    size_t sid;
+    const json* scene = scenes && root.size_or("scene", 0, scenes->arr.size(), sid) ?
+        scenes->at(sid) : nullptr;
+    if (auto* sn = scene ? scene->find("nodes") : nullptr)
+    {
+        for (const auto& n : sn->arr)
+        {
+            if (!n.is_size(SIZE_MAX)) { return glbERROR("invalid scene nodes"); }
+            roots.push_back(size_t(n.num));
+        }
+    }
+    else if (auto* nodes = root.find("nodes"))
+    {
+        std::vector<bool> is_child(nodes->arr.size());
+        for (const auto& n : nodes->arr) {
+            if (auto* ch = n.find("children")) {
+                for (const auto& c : ch->arr) {
+                    if (c.is_size(is_child.size())) { is_child[size_t(c.num)] = true; }
+                }
+            }
+        }
+        for (size_t i = 0; i < is_child.size(); ++i) {
+            if (!is_child[i]) { roots.push_back(i); }
+        }
+    }
+
+    for (size_t r : roots)
+    {
+        e = glb_add_node(ctx, root, r, xform::identity(), 0, out);
+        if (e) { return glbERROR("failed to read meshes"); }
+    }
+    return 0;
+
+#undef glbERROR
+}
+
+// ----------------------------- RTMESH ------------------------------
+// Native format. A header followed by 64-byte aligned arrays in
+// the same layout as mesh's, so loading is a memcpy per array.
+//
+// V, NV, [UV], M: raw vec3/vec3/uv/mat arrays
+// Vidx, NVidx, [UVidx]: 3 ints per triangle
+// matid: 1 int per triangle
+
+namespace {
+
+struct rtmesh_hdr
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t nV, nNV, nUV, nM, nF;
+    // byte offsets of each array
+    uint64_t offV, offNV, offUV, offM;
+    uint64_t offVidx, offNVidx, offUVidx, offmatid;
+};
+
+}
+
+static constexpr uint32_t RTMESH_MAGIC = 0x534D5452; // 'RTMS'
+static constexpr uint32_t RTMESH_VERSION = 1;
+static constexpr size_t RTMESH_ALIGN = 64;
+
+static_assert(sizeof(mat) == 4 * sizeof(vec3) + sizeof(float), "mat is not packed");
+static_assert(sizeof(uv) == 2 * sizeof(float), "uv is not packed");
+
+static inline uint64_t rtmesh_align(uint64_t off) {
+    return (off + RTMESH_ALIGN - 1) & ~uint64_t(RTMESH_ALIGN - 1);
+}
+
+int save_rtmesh(const fs::path& outpath, const mesh& m)
+{
+    rtmesh_hdr hdr = {};
+    hdr.magic = RTMESH_MAGIC;
+    hdr.version = RTMESH_VERSION;
+    hdr.nV = m.V.size();
+    hdr.nNV = m.NV.size();
+#if ENABLE_TEXTURES
+    hdr.nUV = m.UV.size();
+#endif
+    hdr.nM = m.M.size();
+    hdr.nF = m.F.size();
+
+    uint64_t off = sizeof(rtmesh_hdr);
+    auto place = [&](uint64_t& arroff, uint64_t nbytes) {
+        arroff = off = rtmesh_align(off);
+        off += nbytes;
+    };
+    place(hdr.offV, hdr.nV * sizeof(vec3));
+    place(hdr.offNV, hdr.nNV * sizeof(vec3));
+    place(hdr.offUV, hdr.nUV * sizeof(uv));
+    place(hdr.offM, hdr.nM * sizeof(mat));
+    place(hdr.offVidx, hdr.nF * 3 * sizeof(int));
+    place(hdr.offNVidx, hdr.nF * 3 * sizeof(int));
+    place(hdr.offUVidx, hdr.nUV ? hdr.nF * 3 * sizeof(int) : 0);
+    place(hdr.offmatid, hdr.nF * sizeof(int));
+
+    auto buf = std::make_unique<byte[]>(off);
+    std::memset(buf.get(), 0, off);
+    std::memcpy(buf.get(), &hdr, sizeof(hdr));
+
+    byte* p = buf.get();
+    std::memcpy(p + hdr.offV, m.V.data(), hdr.nV * sizeof(vec3));
+    std::memcpy(p + hdr.offNV, m.NV.data(), hdr.nNV * sizeof(vec3));
+#if ENABLE_TEXTURES
+    std::memcpy(p + hdr.offUV, m.UV.data(), hdr.nUV * sizeof(uv));
+#endif
+    std::memcpy(p + hdr.offM, m.M.data(), hdr.nM * sizeof(mat));
+
+    auto* pVidx = reinterpret_cast<int*>(p + hdr.offVidx);
+    auto* pNVidx = reinterpret_cast<int*>(p + hdr.offNVidx);
+    auto* pmatid = reinterpret_cast<int*>(p + hdr.offmatid);
+    for (size_t i = 0; i < m.F.size(); ++i)
+    {
+        ranges::copy(m.F[i].Vidx, pVidx + 3 * i);
+        ranges::copy(m.F[i].NVidx, pNVidx + 3 * i);
+        pmatid[i] = m.F[i].matid;
+    }
+#if ENABLE_TEXTURES
+    if (hdr.nUV != 0) {
+        auto* pUVidx = reinterpret_cast<int*>(p + hdr.offUVidx);
+        for (size_t i = 0; i < m.F.size(); ++i) {
+            ranges::copy(m.F[i].UVidx, pUVidx + 3 * i);
+        }
+    }
+#endif
+    return write_file(outpath, buf.get(), off);
+}
+
+static int load_rtmesh(const fs::path& rtpath, mesh& out)
+{
+    auto rtname = rtpath.filename();
+    DECL_UTF8PATH_CSTR(rtname)
+
+#define rtERROR(msg) mERROR("%s: %s", prtname, msg)
+
+    mapped_file mf;
+    int e = mf.open(rtpath);
+    if (e) { return e; }
+
+    rtmesh_hdr hdr;
+    if (mf.size() < sizeof(hdr)) { return rtERROR("not an rtmesh file"); }
+    std::memcpy(&hdr, mf.data(), sizeof(hdr));
+
+    if (hdr.magic == bswap32(RTMESH_MAGIC)) {
+        return rtERROR("rtmesh was written on a host with different endianness");
+    } else if (hdr.magic != RTMESH_MAGIC) {
+        return rtERROR("not an rtmesh file");
+    } else if (hdr.version != RTMESH_VERSION) {
+        return rtERROR("unsupported rtmesh version, please reconvert");
+    }
+
+    auto in_bounds = [&](uint64_t off, uint64_t n, uint64_t esize) {
+        return off % RTMESH_ALIGN == 0 && off <= mf.size() &&
+            n <= (mf.size() - off) / esize;
+    };
+    if (!in_bounds(hdr.offV, hdr.nV, sizeof(vec3)) ||
+        !in_bounds(hdr.offNV, hdr.nNV, sizeof(vec3)) ||
+        !in_bounds(hdr.offUV, hdr.nUV, sizeof(uv)) ||
+        !in_bounds(hdr.offM, hdr.nM, sizeof(mat)) ||
+        !in_bounds(hdr.offVidx, hdr.nF, 3 * sizeof(int)) ||
+        !in_bounds(hdr.offNVidx, hdr.nF, 3 * sizeof(int)) ||
+        !in_bounds(hdr.offmatid, hdr.nF, sizeof(int)) ||
+        (hdr.nUV != 0 && !in_bounds(hdr.offUVidx, hdr.nF, 3 * sizeof(int)))) {
+        return rtERROR("corrupt rtmesh file");
+    }
+
+    const byte* p = mf.data();
+    out.V.resize(hdr.nV);
+    out.NV.resize(hdr.nNV);
+    out.M.resize(hdr.nM);
+    out.F.resize(hdr.nF);
+    std::memcpy(out.V.data(), p + hdr.offV, hdr.nV * sizeof(vec3));
+    std::memcpy(out.NV.data(), p + hdr.offNV, hdr.nNV * sizeof(vec3));
+    std::memcpy(out.M.data(), p + hdr.offM, hdr.nM * sizeof(mat));
+#if ENABLE_TEXTURES
+    out.UV.resize(hdr.nUV);
+    std::memcpy(out.UV.data(), p + hdr.offUV, hdr.nUV * sizeof(uv));
+#endif
+
+    auto bad_idx = [](const std::array<int, 3>& idx, uint64_t n) {
+        return uint(idx[0]) >= n || uint(idx[1]) >= n || uint(idx[2]) >= n;
+    };
+
+    // arrays are 64-byte aligned, so these are safe to read in place
+    auto* pVidx = reinterpret_cast<const int*>(p + hdr.offVidx);
+    auto* pNVidx = reinterpret_cast<const int*>(p + hdr.offNVidx);
+    auto* pmatid = reinterpret_cast<const int*>(p + hdr.offmatid);
+    for (size_t i = 0; i < hdr.nF; ++i)
+    {
+        tri& t = out.F[i];
+        std::copy_n(pVidx + 3 * i, 3, t.Vidx.begin());
+        std::copy_n(pNVidx + 3 * i, 3, t.NVidx.begin());
+        t.matid = pmatid[i];
+#if ENABLE_TEXTURES
+        if (hdr.nUV != 0) {
+            std::copy_n(reinterpret_cast<const int*>(p + hdr.offUVidx) + 3 * i, 3, t.UVidx.begin());
+        } else { t.UVidx[0] = -1; }
+#endif
+        // don't trust the file
+        if (bad_idx(t.Vidx, hdr.nV) ||
+            (t.NVidx[0] >= 0 && bad_idx(t.NVidx, hdr.nNV)) ||
+            t.matid >= int64_t(hdr.nM)) {
+            return rtERROR("index out of range");
+        }
+    }
+    return 0;
+
+#undef rtERROR
+}
+
+int load_mesh(const fs::path& path, mesh& out, bool verbose)
+{
+    auto tbeg = chrono::high_resolution_clock::now();
+
+    auto ext = path.extension();
+    int e;
+    if (ext == ".ply") {
+        e = load_ply(path, out);
+    } else if (ext == ".glb") {
+        e = load_glb(path, out);
+    } else if (ext == ".rtmesh") {
+        e = load_rtmesh(path, out);
+    } else {
+        e = load_obj(path, out);
+    }
+    if (e) { return e; }
+
+    if (verbose)
+    {
+        auto tend = chrono::high_resolution_clock::now();
+        std::cout << path.filename().string() << ": loaded " << out.F.size()
+            << " triangle(s) in ";
+        print_duration(std::cout, tend - tbeg);
+        std::cout << "\n";
+    }
+    return 0;
+}
+
+int mesh_cache::get(const fs::path& path, bool verbose, std::shared_ptr<const mesh>& out)
+{
+    std::error_code ec;
+    fs::path key = fs::weakly_canonical(path, ec);
+    if (ec) { key = path.lexically_normal(); }
+
+    std::promise<std::shared_ptr<const mesh>> loaded;
+    entry ent;
+    bool first;
+    {
+        std::lock_guard lock(m_mtx);
+        auto [it, inserted] = m_meshes.try_emplace(key);
+        if (inserted) { it->second = loaded.get_future().share(); }
+        ent = it->second;
+        first = inserted;
+        ++m_requests;
+    }
+    if (first)
+    {
+        auto m = std::make_shared<mesh>();
+        int e = load_mesh(path, *m, verbose);
+        loaded.set_value(e ? nullptr : std::move(m));
+        if (e) { return e; }
+    }
+
+    out = ent.get();
+    if (!out) {
+        return mERROR("failed to load %s", path.string().c_str());
+    }
+    return 0;
+}
+
+size_t mesh_cache::size() const
+{
+    std::lock_guard lock(m_mtx);
+    return m_meshes.size();
+}
+
+size_t mesh_cache::requests() const
+{
+    std::lock_guard lock(m_mtx);
+    return m_requests;
+}
@@ -0,0 +1,156 @@
+
+#include <unordered_map>
+
+#include "defs.hpp"
+
+// local tables are indexed with at most 16 bits
+static constexpr size_t max_meshlet_entries = 1 << 16;
+
+static inline uint idx_per_tri()
+{
+    return textures_enabled() ? 9 : 6;
+}
+
+uint meshlet::ndata(bool quantized) const
+{
+    const size_t ntris = Fend - Fbeg;
+    uint n = quantized ?
+        packed_words(V.size() * 3, 16) + uint(NV.size()) :
+        uint(V.size() + NV.size()) * vec3::nserial;
+#if ENABLE_TEXTURES
+    n += uint(UV.size()) * uv::nserial;
+#endif
+    n += packed_words(ntris * idx_per_tri(), idxbits);
+    n += packed_words(ntris, 16); // matids
+    return n;
+}
+
+// Splits the triangles of each BV into meshlets. BVs are handled in
+// parallel, then concatenated in BV order.
+int Scene::build_meshlets()
+{
+    const char* pscname = m_scname.c_str();
+    if (M.size() > max_meshlet_entries) {
+        return mERROR("%s: meshlet format supports at most %zu materials",
+            pscname, max_meshlet_entries);
+    }
+
+    const std::vector<uint> BVbeg = bv_tri_offsets();
+
+    std::vector<std::vector<meshlet>> perbv(BV.size());
+    parallel_for(BV.size(), [&](size_t b)
+    {
+        // global id -> local index, one map per table
+        std::unordered_map<int, uint16_t> Vmap, NVmap;
+#if ENABLE_TEXTURES
+        std::unordered_map<int, uint16_t> UVmap;
+#endif
+        auto local = [](std::unordered_map<int, uint16_t>& map,
+            std::vector<int>& table, int id)
+        {
+            auto [it, inserted] = map.emplace(id, uint16_t(table.size()));
+            if (inserted) { table.push_back(id); }
+            return it->second;
+        };
+        auto full = [](const std::vector<int>& table) {
+            return table.size() + 3 > max_meshlet_entries;
+        };
+
+        meshlet* ml = nullptr;
+        for (uint f = BVbeg[b]; f < BVbeg[b + 1]; ++f)
+        {
+            if (!ml || full(ml->V) || full(ml->NV)
+#if ENABLE_TEXTURES
+                || full(ml->UV)
+#endif
+                )
+            {
+                ml = &perbv[b].emplace_back();
+                ml->bv = uint(b);
+                ml->Fbeg = f;
+                Vmap.clear();
+                NVmap.clear();
+#if ENABLE_TEXTURES
+                UVmap.clear();
+#endif
+            }
+
+            const tri& t = F[f];
+            for (int j = 0; j < 3; ++j) {
+                ml->idx.push_back(local(Vmap, ml->V, t.Vidx[j]));
+            }
+            for (int j = 0; j < 3; ++j) {
+                ml->idx.push_back(local(NVmap, ml->NV, t.NVidx[j]));
+            }
+#if ENABLE_TEXTURES
+            for (int j = 0; j < 3; ++j) {
+                ml->idx.push_back(local(UVmap, ml->UV, t.UVidx[j]));
+            }
+#endif
+            ml->Fend = f + 1;
+        }
+
+        for (auto& m : perbv[b])
+        {
+            size_t nmax = std::max(m.V.size(), m.NV.size());
+#if ENABLE_TEXTURES
+            nmax = std::max(nmax, m.UV.size());
+#endif
+            m.idxbits = nmax <= 256 ? 8 : 16;
+        }
+    });
+
+    ML.clear();
+    size_t n8 = 0;
+    for (auto& v : perbv) {
+        for (auto& m : v) {
+            n8 += m.idxbits == 8;
+            ML.push_back(std::move(m));
+        }
+    }
+
+    if (m_opts.verbose) {
+        std::printf("%s: built %zu meshlet(s), %zu with 8-bit indices\n",
+            pscname, ML.size(), n8);
+    }
+    return 0;
+}
+
+uint* Scene::serialize_meshlet(const meshlet& ml, uint* p) const
+{
+    if (m_opts.quantize)
+    {
+        std::vector<uint16_t> qpos;
+        qpos.reserve(ml.V.size() * 3);
+        for (int v : ml.V) {
+            auto q = quantize_pos(ml.bv, V[v]);
+            qpos.insert(qpos.end(), q.begin(), q.end());
+        }
+        p = pack_bits(qpos.data(), qpos.size(), 16, p);
+        for (int n : ml.NV) {
+            *p++ = oct_encode(NV[n]);
+        }
+    }
+    else
+    {
+        for (int v : ml.V) {
+            V[v].serialize(p); p += vec3::nserial;
+        }
+        for (int n : ml.NV) {
+            NV[n].serialize(p); p += vec3::nserial;
+        }
+    }
+#if ENABLE_TEXTURES
+    for (int t : ml.UV) {
+        UV[t].serialize(p); p += uv::nserial;
+    }
+#endif
+    p = pack_bits(ml.idx.data(), ml.idx.size(), ml.idxbits, p);
+
+    std::vector<uint16_t> matids;
+    matids.reserve(ml.Fend - ml.Fbeg);
+    for (uint f = ml.Fbeg; f < ml.Fend; ++f) {
+        matids.push_back(uint16_t(F[f].matid));
+    }
+    return pack_bits(matids.data(), matids.size(), 16, p);
+}
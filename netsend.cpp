@@ -0,0 +1,203 @@
+
+#include "defs.hpp"
+
+#ifdef __linux__
+
+#include <cerrno>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+
+// older headers
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+// zero-copy sends only pay off in large pieces
+static constexpr size_t zc_chunk = size_t(1) << 20;
+
+static bool send_all(int sock, const byte* p, size_t n, int flags = 0)
+{
+    while (n > 0)
+    {
+        ssize_t r = ::send(sock, p, n, flags | MSG_NOSIGNAL);
+        if (r < 0)
+        {
+            if (errno == EINTR) { continue; }
+            return false;
+        }
+        p += r;
+        n -= size_t(r);
+    }
+    return true;
+}
+
+// Returns bytes sent; err is set if that is not all of them.
+static size_t send_file(int sock, int fd, size_t n, int& err)
+{
+    off_t off = 0;
+    while (size_t(off) < n)
+    {
+        ssize_t r = ::sendfile(sock, fd, &off, std::min(n - size_t(off), size_t(1) << 30));
+        if (r < 0)
+        {
+            if (errno == EINTR) { continue; }
+            err = errno;
+            break;
+        }
+        else if (r == 0) {
+            err = EIO;
+            break;
+        }
+    }
+    return size_t(off);
+}
+
+// MSG_ZEROCOPY sends are completed through the socket error queue, by
+// ranges of send ids. The pages may only be reused once all are done.
+struct zc_completions
+{
+    int sock;
+    uint32_t nsent = 0, ndone = 0;
+    bool copied = false;
+
+    // Reads what has completed so far, waiting for more if wait is set.
+    bool reap(bool wait)
+    {
+        while (ndone < nsent)
+        {
+            char control[128];
+            msghdr msg = {};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            if (::recvmsg(sock, &msg, MSG_ERRQUEUE) < 0)
+            {
+                if (errno == EINTR) { continue; }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) { return false; }
+                if (!wait) { return true; }
+
+                // error queue data is signaled as POLLERR
+                pollfd pfd = { sock, 0, 0 };
+                if (::poll(&pfd, 1, -1) < 0 && errno != EINTR) { return false; }
+                continue;
+            }
+
+            for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+            {
+                if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                    !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                    continue;
+                }
+                sock_extended_err ee;
+                std::memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+                if (ee.ee_errno != 0 || ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                    continue;
+                }
+                ndone += ee.ee_data - ee.ee_info + 1;
+                copied = copied || (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+            }
+        }
+        return true;
+    }
+};
+
+static bool send_zerocopy(int sock, const byte* p, size_t n, bool& copied)
+{
+    zc_completions zc = { sock };
+    bool ok = true;
+    while (ok && n > 0)
+    {
+        ssize_t r = ::send(sock, p, std::min(n, zc_chunk), MSG_ZEROCOPY | MSG_NOSIGNAL);
+        if (r < 0)
+        {
+            if (errno == EINTR) { continue; }
+            // out of option memory for pending sends, wait for some
+            else if (errno == ENOBUFS && zc.ndone < zc.nsent) {
+                ok = zc.reap(true);
+                continue;
+            }
+            ok = false;
+            break;
+        }
+        zc.nsent++;
+        p += r;
+        n -= size_t(r);
+        ok = zc.reap(false);
+    }
+    // even on error, the kernel may still hold pages of the buffer
+    ok = zc.reap(true) && ok;
+    copied = zc.copied;
+    return ok;
+}
+
+int send_frame_zerocopy(int sock, const void* data, size_t nbytes, int fd,
+    send_method& used, bool verbose)
+{
+    if (nbytes > std::numeric_limits<uint32_t>::max()) {
+        return mERROR("frame too large (%zu bytes)", nbytes);
+    }
+    const uint32_t hdr = htonl(uint32_t(nbytes));
+    if (!send_all(sock, reinterpret_cast<const byte*>(&hdr), sizeof(hdr), MSG_MORE)) {
+        return mERROR("send failed: %s", std::strerror(errno));
+    }
+
+    auto p = static_cast<const byte*>(data);
+    size_t sent = 0;
+    if (fd >= 0)
+    {
+        int err = 0;
+        sent = send_file(sock, fd, nbytes, err);
+        if (sent == nbytes) {
+            used = send_method::Sendfile;
+            return 0;
+        }
+        // not supported for this file or socket: carry on from memory
+        else if (err != EINVAL && err != ENOSYS && err != EOPNOTSUPP) {
+            return mERROR("sendfile failed: %s", std::strerror(err));
+        }
+        if (verbose) {
+            std::printf("sendfile unavailable (%s), sending from memory\n", std::strerror(err));
+        }
+    }
+
+    int one = 1;
+    if (::setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+    {
+        bool copied = false;
+        if (!send_zerocopy(sock, p + sent, nbytes - sent, copied)) {
+            return mERROR("zero-copy send failed: %s", std::strerror(errno));
+        }
+        used = copied ? send_method::ZerocopyCopied : send_method::Zerocopy;
+        return 0;
+    }
+    if (verbose) {
+        std::printf("MSG_ZEROCOPY unavailable (%s), using send()\n", std::strerror(errno));
+    }
+
+    if (!send_all(sock, p + sent, nbytes - sent)) {
+        return mERROR("send failed: %s", std::strerror(errno));
+    }
+    used = send_method::Buffered;
+    return 0;
+}
+
+#else
+
+int send_frame_zerocopy(int, const void*, size_t, int, send_method&, bool)
+{
+    return -1;
+}
+
+#endif
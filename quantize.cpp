@@ -0,0 +1,266 @@
+
+#include <atomic>
+#include <cmath>
+#include <numbers>
+
+#include "defs.hpp"
+
+// Positions are snapped to one lattice for the whole scene, with a step
+// of a power of 2 in 16.16 units. Each BV stores a lattice point as its
+// origin and its vertices as 16-bit offsets in steps. A vertex shared by
+// several BVs decodes to the same point in all of them, so no cracks.
+// The step is the smallest that fits the largest BV; triangles that it
+// collapses onto a point or a line are dropped.
+
+static constexpr int64_t qmax = 0xFFFF;
+
+static inline int64_t to_fixedpt64(float v)
+{
+    return std::llround(double(v) * (1 << 16));
+}
+
+static inline float snorm16_to_float(uint v)
+{
+    return std::max(-1.f, float(int16_t(uint16_t(v))) / 32767);
+}
+
+static inline vec3 oct_decode(float x, float y)
+{
+    vec3 n(x, y, 1 - std::abs(x) - std::abs(y));
+    if (n.z() < 0)
+    {
+        float ox = n.x();
+        n.x() = (1 - std::abs(n.y())) * (ox >= 0 ? 1 : -1);
+        n.y() = (1 - std::abs(ox)) * (n.y() >= 0 ? 1 : -1);
+    }
+    return n.normalized();
+}
+
+vec3 oct_decode(uint enc)
+{
+    return oct_decode(snorm16_to_float(enc), snorm16_to_float(enc >> 16));
+}
+
+uint oct_encode(const vec3& n)
+{
+    float s = std::abs(n.x()) + std::abs(n.y()) + std::abs(n.z());
+    if (s == 0) { return 0; }
+
+    float x = n.x() / s, y = n.y() / s;
+    if (n.z() < 0)
+    {
+        float ox = x;
+        x = (1 - std::abs(y)) * (ox >= 0 ? 1 : -1);
+        y = (1 - std::abs(ox)) * (y >= 0 ? 1 : -1);
+    }
+
+    // try the 4 neighboring codes and keep the most accurate
+    float fx = std::floor(std::clamp(x, -1.f, 1.f) * 32767);
+    float fy = std::floor(std::clamp(y, -1.f, 1.f) * 32767);
+    uint best = 0;
+    float best_dot = -2;
+    for (int i = 0; i < 4; ++i)
+    {
+        float cx = std::min(fx + (i & 1), 32767.f);
+        float cy = std::min(fy + (i >> 1), 32767.f);
+        float d = oct_decode(cx / 32767, cy / 32767).dot(n);
+        if (d > best_dot)
+        {
+            best_dot = d;
+            best = uint(uint16_t(int16_t(cx))) | (uint(uint16_t(int16_t(cy))) << 16);
+        }
+    }
+    return best;
+}
+
+std::array<uint16_t, 3> Scene::quantize_pos(uint bvid, const vec3& v) const
+{
+    const int64_t half = m_qshift ? int64_t(1) << (m_qshift - 1) : 0;
+    std::array<uint16_t, 3> q;
+    for (int k = 0; k < 3; ++k)
+    {
+        int64_t off = (to_fixedpt64(v[k]) - m_qorigin[bvid][k] + half) >> m_qshift;
+        q[k] = uint16_t(std::clamp<int64_t>(off, 0, qmax));
+    }
+    return q;
+}
+
+vec3 Scene::dequantize_pos(uint bvid, const std::array<uint16_t, 3>& q) const
+{
+    vec3 v;
+    for (int k = 0; k < 3; ++k) {
+        int64_t fx = m_qorigin[bvid][k] + (int64_t(q[k]) << m_qshift);
+        v[k] = float(double(fx) / (1 << 16));
+    }
+    return v;
+}
+
+// Picks the lattice and BV origins, then decodes everything to check
+// the error bounds. BVs are grown by a step to stay conservative.
+int Scene::quantize_geometry()
+{
+    const char* pscname = m_scname.c_str();
+    if (m_opts.ser_fmt == serial_format::NoDuplicate) {
+        return mERROR("%s: quantization needs the dup or meshlet format", pscname);
+    }
+
+    const std::vector<uint> BVbeg = bv_tri_offsets();
+    const size_t nbvs = BV.size();
+
+    // bounds of each BV's vertices in 16.16
+    std::vector<std::array<int64_t, 3>> qmin(nbvs), qmaxs(nbvs);
+    std::vector<uint> shifts(nbvs, 0);
+    parallel_for(nbvs, [&](size_t b)
+    {
+        qmin[b].fill(std::numeric_limits<int64_t>::max());
+        qmaxs[b].fill(std::numeric_limits<int64_t>::min());
+        for (uint f = BVbeg[b]; f < BVbeg[b + 1]; ++f) {
+            for (int v : F[f].Vidx) {
+                for (int k = 0; k < 3; ++k) {
+                    int64_t q = to_fixedpt64(V[v][k]);
+                    qmin[b][k] = std::min(qmin[b][k], q);
+                    qmaxs[b][k] = std::max(qmaxs[b][k], q);
+                }
+            }
+        }
+
+        // smallest step that covers the BV from a lattice point
+        for (uint s = 0; s < 32; ++s)
+        {
+            bool fits = true;
+            for (int k = 0; k < 3; ++k)
+            {
+                int64_t origin = (qmin[b][k] >> s) << s;
+                int64_t half = s ? int64_t(1) << (s - 1) : 0;
+                fits = fits && ((qmaxs[b][k] - origin + half) >> s) <= qmax;
+            }
+            if (fits) {
+                shifts[b] = s;
+                break;
+            }
+        }
+    });
+
+    m_qshift = 0;
+    for (uint s : shifts) { m_qshift = std::max(m_qshift, s); }
+    m_qorigin.resize(nbvs);
+    for (size_t b = 0; b < nbvs; ++b) {
+        for (int k = 0; k < 3; ++k) {
+            m_qorigin[b][k] = (qmin[b][k] >> m_qshift) << m_qshift;
+        }
+    }
+
+    // decode and check
+    const float step = std::ldexp(1.f, int(m_qshift) - 16);
+    std::vector<float> errs(nbvs, 0);
+    std::atomic<bool> clamped = false;
+    parallel_for(nbvs, [&](size_t b)
+    {
+        const int64_t half = m_qshift ? int64_t(1) << (m_qshift - 1) : 0;
+        for (uint f = BVbeg[b]; f < BVbeg[b + 1]; ++f) {
+            for (int v : F[f].Vidx)
+            {
+                for (int k = 0; k < 3; ++k) {
+                    int64_t off = (to_fixedpt64(V[v][k]) - m_qorigin[b][k] + half) >> m_qshift;
+                    if (off < 0 || off > qmax) { clamped = true; }
+                }
+                vec3 d = dequantize_pos(uint(b), quantize_pos(uint(b), V[v])) - V[v];
+                errs[b] = std::max({ errs[b], std::abs(d[0]), std::abs(d[1]), std::abs(d[2]) });
+            }
+        }
+    });
+    float maxerr = errs.empty() ? 0 : *ranges::max_element(errs);
+    // half a step, plus rounding to 16.16 and back to float
+    if (clamped || maxerr > step / 2 + std::ldexp(1.f, -15)) {
+        return mERROR("%s: position quantization failed (error %g, step %g)",
+            pscname, maxerr, step);
+    }
+
+    // The step fits the largest BV, so it can snap small triangles onto
+    // a point or a line. Rays can't hit those, drop them.
+    std::vector<char> keep(F.size(), 1);
+    std::atomic<size_t> ncollapsed = 0;
+    parallel_for(nbvs, [&](size_t b)
+    {
+        for (uint f = BVbeg[b]; f < BVbeg[b + 1]; ++f)
+        {
+            std::array<int64_t, 3> q[3];
+            for (int j = 0; j < 3; ++j)
+            {
+                auto qj = quantize_pos(uint(b), V[F[f].Vidx[j]]);
+                q[j] = { qj[0], qj[1], qj[2] };
+            }
+            bool collapsed = true;
+            for (int k = 0; k < 3; ++k)
+            {
+                const int k1 = (k + 1) % 3, k2 = (k + 2) % 3;
+                collapsed = collapsed &&
+                    (q[1][k1] - q[0][k1]) * (q[2][k2] - q[0][k2]) ==
+                    (q[1][k2] - q[0][k2]) * (q[2][k1] - q[0][k1]);
+            }
+            if (collapsed)
+            {
+                keep[f] = 0;
+                BV[b].ntris--;
+                ncollapsed++;
+            }
+        }
+    });
+    if (ncollapsed > 0)
+    {
+        remove_tris(keep);
+        if (F.empty()) {
+            return mERROR("%s: all triangles collapsed when quantized", pscname);
+        }
+        // meshlets refer to triangle ranges
+        if (m_opts.ser_fmt == serial_format::Meshlet)
+        {
+            int e = build_meshlets();
+            if (e) { return e; }
+        }
+    }
+
+    std::vector<float> nerrs(NV.size());
+    parallel_for(NV.size(), [&](size_t i)
+    {
+        float d = std::clamp(oct_decode(oct_encode(NV[i])).dot(NV[i].normalized()), -1.f, 1.f);
+        nerrs[i] = std::acos(d);
+    }, 4096);
+    float maxnerr = nerrs.empty() ? 0 : *ranges::max_element(nerrs);
+
+    for (auto& bvol : BV)
+    {
+        bvol.bb.cmin -= vec3(step, step, step);
+        bvol.bb.cmax += vec3(step, step, step);
+    }
+
+    std::printf("%s: quantized positions with step %g (max error %g, %zu collapsed "
+        "triangle(s) dropped), normals max error %.4f deg\n", pscname, step, maxerr,
+        size_t(ncollapsed), maxnerr * 180 / std::numbers::pi);
+    return 0;
+}
+
+// Duplicate format FV and FN sections, quantized.
+uint* Scene::serialize_quantized_dup(uint* p) const
+{
+    const std::vector<uint> BVbeg = bv_tri_offsets();
+
+    std::vector<uint16_t> qpos;
+    qpos.reserve(F.size() * 9);
+    for (uint b = 0; b < BV.size(); ++b) {
+        for (uint f = BVbeg[b]; f < BVbeg[b + 1]; ++f) {
+            for (int v : F[f].Vidx) {
+                auto q = quantize_pos(b, V[v]);
+                qpos.insert(qpos.end(), q.begin(), q.end());
+            }
+        }
+    }
+    p = pack_bits(qpos.data(), qpos.size(), 16, p);
+
+    for (const auto& t : F) {
+        for (int n : t.NVidx) {
+            *p++ = oct_encode(NV[n]);
+        }
+    }
+    return p;
+}
@@ -0,0 +1,127 @@
+
+#include "defs.hpp"
+
+// Animation support: frames only move vertices, so the triangles keep
+// their BVs and only the bounds are recomputed. Refitted BVs get looser
+// as triangles move apart, which the SAH cost tracks; past a threshold
+// the BVs are built again.
+
+float Scene::sah_cost() const
+{
+    bbox root;
+    double cost = 0;
+    for (const auto& b : BV)
+    {
+        root.cmin = root.cmin.cwiseMin(b.bb.cmin);
+        root.cmax = root.cmax.cwiseMax(b.bb.cmax);
+        cost += double(b.bb.area()) * b.ntris;
+    }
+    float rarea = root.area();
+    return rarea > 0 ? float(cost / rarea) : 0;
+}
+
+int Scene::check_refit() const
+{
+    const char* pscname = m_scname.c_str();
+
+    // anything derived from positions, other than the BV bounds, would
+    // have to be rebuilt too
+    if (!I.empty() || m_opts.ser_fmt == serial_format::Meshlet ||
+        m_opts.split_budget > 0 || m_opts.quantize || m_opts.isect_data ||
+        m_opts.light_cutoff > 0 || m_opts.shadow_samples > 0) {
+        return mERROR("%s: refitting needs the dup or nodup format without instancing, "
+            "splits, quantization, intersection data or light/shadow masks", pscname);
+    }
+    // which triangles are kept and how BVs are ordered depend on where
+    // they are from the camera, which frames change
+    if (m_opts.view_dependent()) {
+        return mERROR("%s: refitting doesn't work with --cull, --tri-budget or --bv-order front",
+            pscname);
+    }
+    if (m_Vsrc.size() != V.size()) {
+        return mERROR("%s: vertices can't be matched to frames (simplified?)", pscname);
+    }
+    return 0;
+}
+
+int Scene::refit(const std::vector<mesh>& frame, bool& rebuilt)
+{
+    const char* pscname = m_scname.c_str();
+    rebuilt = false;
+
+    if (int err = check_refit()) {
+        return err;
+    }
+    if (frame.size() + 1 != m_frameVbase.size()) {
+        return mERROR("%s: frame has %zu mesh(es), expected %zu",
+            pscname, frame.size(), m_frameVbase.size() - 1);
+    }
+    std::vector<vec3> frameV;
+    frameV.reserve(m_frameVbase.back());
+    for (size_t i = 0; i < frame.size(); ++i)
+    {
+        size_t nV = size_t(m_frameVbase[i + 1] - m_frameVbase[i]);
+        if (frame[i].V.size() != nV) {
+            return mERROR("%s: frame mesh %zu has %zu vertices, expected %zu",
+                pscname, i, frame[i].V.size(), nV);
+        }
+        frameV.insert(frameV.end(), frame[i].V.begin(), frame[i].V.end());
+    }
+
+    auto tbeg = chrono::high_resolution_clock::now();
+
+    parallel_for(V.size(), [&](size_t i) {
+        V[i] = m_refT[m_Vxf[i]].apply(frameV[m_Vsrc[i]]);
+    }, 4096);
+    parallel_for(F.size(), [&](size_t f) {
+        F[f].bb = get_tri_bbox(V, F[f].Vidx);
+    }, 4096);
+
+    const std::vector<uint> BVbeg = bv_tri_offsets();
+    parallel_for(BV.size(), [&](size_t b) {
+        BV[b].bb = get_nodes_bbox(F.data() + BVbeg[b], F.data() + BVbeg[b + 1]);
+    });
+
+    float sah = sah_cost();
+    float growth = m_sah_built > 0 ? sah / m_sah_built : 1;
+    if (growth > m_opts.refit_threshold)
+    {
+        BV.clear();
+        if (int err = init_bvs(m_opts.max_bv)) {
+            return err;
+        }
+        rebuilt = true;
+    }
+
+    auto tend = chrono::high_resolution_clock::now();
+    if (m_opts.verbose)
+    {
+        std::printf("%s: SAH cost grew x%.3f, %s in ", pscname, growth,
+            rebuilt ? "rebuilt BVs" : "refitted BVs");
+        print_duration(std::cout << std::flush, tend - tbeg);
+        std::cout << "\n";
+    }
+    return 0;
+}
+
+void Scene::serialize_refit(uint* buf) const
+{
+    // header: magic, resX, resY, numL, numBV, camera, BV, V (or FV)
+    vserialize(BV, buf + buf[6]);
+    uint* p = buf + buf[7];
+
+    if (m_opts.ser_fmt == serial_format::NoDuplicate)
+    {
+        parallel_for(V.size(), [&](size_t i) {
+            V[i].serialize(p + i * vec3::nserial);
+        }, 4096);
+    }
+    else
+    {
+        parallel_for(F.size(), [&](size_t f) {
+            for (int j = 0; j < 3; ++j) {
+                V[F[f].Vidx[j]].serialize(p + (f * 3 + j) * vec3::nserial);
+            }
+        }, 4096);
+    }
+}
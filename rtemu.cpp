@@ -0,0 +1,895 @@
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <span>
+#include <thread>
+#include <unordered_map>
+
+#include "cxxopts.hpp"
+#include "defs.hpp"
+#include "transport.hpp"
+
+#include "io.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+// FPGA emulator. Receives scenes the way the board does, checks their
+// layout and answers with a deterministic test image of the right
+// size, after the time a link and renderer with the given speeds would
+// take. Can also inject connection faults.
+
+// What the header and sections of a scene buffer say.
+struct scene_layout
+{
+    const char* fmt = "";
+    uint resX = 0, resY = 0;
+    uint numL = 0, numBV = 0;
+    size_t ntris = 0;
+    std::vector<std::pair<uint, size_t>> ext; // id, size
+};
+
+static const char* ext_name(uint id)
+{
+    static constexpr const char* names[] = { "?", "instances", "quantization",
+        "isect data", "BV order", "light mask", "shadow mask" };
+    return id < std::size(names) ? names[id] : "unknown";
+}
+
+// Checks buf against one format. Returns an empty string if it fits.
+static std::string check_layout(std::span<const uint> buf, serial_format fmt, scene_layout& out)
+{
+    char msg[128];
+    auto fail = [&]<typename... Args>(const char* f, Args... args) {
+        std::snprintf(msg, sizeof(msg), f, args...);
+        return std::string(msg);
+    };
+
+    const bool dup = fmt == serial_format::Duplicate;
+    const bool nodup = fmt == serial_format::NoDuplicate;
+    const size_t nhdr = dup ? nhdr_duplicate : nodup ? nhdr_noduplicate : nhdr_meshlet;
+    const size_t first = nodup || dup ? 5 : 6; // first section offset
+    if (buf.size() < nhdr) {
+        return fail("shorter than the header");
+    }
+
+    out.fmt = dup ? "dup" : nodup ? "nodup" : "meshlet";
+    out.resX = buf[1];
+    out.resY = buf[2];
+    out.numL = buf[3];
+    out.numBV = buf[4];
+    out.ext.clear();
+
+    // section bounds: fixed sections, then optional ones from the
+    // directory, each ending where the next begins
+    std::vector<size_t> bounds(buf.begin() + first, buf.begin() + nhdr);
+    std::vector<uint> ext_ids;
+    if (bounds[0] < nhdr || bounds[0] > buf.size()) {
+        return fail("camera section is out of bounds");
+    }
+    if (bounds[0] > nhdr)
+    {
+        size_t next = buf[nhdr];
+        if (bounds[0] - nhdr != 1 + 2 * next) {
+            return fail("bad optional section directory");
+        }
+        for (size_t i = 0; i < next; ++i) {
+            ext_ids.push_back(buf[nhdr + 1 + 2 * i]);
+            bounds.push_back(buf[nhdr + 2 + 2 * i]);
+        }
+    }
+    bounds.push_back(buf.size());
+    for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+        if (bounds[i] > bounds[i + 1]) {
+            return fail("section %zu is out of order or out of bounds", i);
+        }
+    }
+    auto size_of = [&](size_t i) { return bounds[i + 1] - bounds[i]; };
+    auto section = [&](size_t i) { return buf.subspan(bounds[i], size_of(i)); };
+
+    if (size_of(0) != camera::nserial) {
+        return fail("camera section has %zu words", size_of(0));
+    }
+    if (size_of(1) != size_t(out.numBV) * bv::nserial) {
+        return fail("BV section has %zu words for %u BVs", size_of(1), out.numBV);
+    }
+    size_t bv_ntris = 0;
+    for (uint b = 0; b < out.numBV; ++b) {
+        bv_ntris += section(1)[b * bv::nserial + bbox::nserial];
+    }
+
+    const bool quantized = ranges::find(ext_ids, uint(serial_ext::Quantization)) != ext_ids.end();
+    size_t iL; // light section
+    if (dup)
+    {
+        // camera, BVs, FV, FNV, FM, L, (FUV)
+        if (size_of(4) % mat::nserial != 0) {
+            return fail("bad material section");
+        }
+        out.ntris = size_of(4) / mat::nserial;
+        if (size_of(2) != dup_fv_nserial(out.ntris, quantized) ||
+            size_of(3) != dup_fnv_nserial(out.ntris, quantized)) {
+            return fail("vertex sections don't match %zu triangles", out.ntris);
+        }
+#if ENABLE_TEXTURES
+        if (size_of(6) != out.ntris * 3 * uv::nserial) {
+            return fail("UV section doesn't match %zu triangles", out.ntris);
+        }
+#endif
+        iL = 5;
+    }
+    else if (nodup)
+    {
+        // camera, BVs, V, NV, FV, FNV, FM, M, L, (UV, FUV)
+        out.ntris = size_of(6);
+        if (size_of(2) % vec3::nserial != 0 || size_of(3) % vec3::nserial != 0 ||
+            size_of(7) % mat::nserial != 0) {
+            return fail("bad vertex, normal or material section");
+        }
+        if (size_of(4) != out.ntris * 3 || size_of(5) != out.ntris * 3) {
+            return fail("index sections don't match %zu triangles", out.ntris);
+        }
+        const size_t nV = size_of(2) / vec3::nserial, nNV = size_of(3) / vec3::nserial;
+        const size_t nM = size_of(7) / mat::nserial;
+        auto Vidx = section(4), NVidx = section(5), matids = section(6);
+        for (size_t i = 0; i < out.ntris * 3; ++i) {
+            if (Vidx[i] >= nV || NVidx[i] >= nNV) {
+                return fail("index out of range in triangle %zu", i / 3);
+            }
+        }
+        for (size_t i = 0; i < out.ntris; ++i) {
+            if (matids[i] >= nM) {
+                return fail("material out of range in triangle %zu", i);
+            }
+        }
+#if ENABLE_TEXTURES
+        if (size_of(9) % uv::nserial != 0 || size_of(10) != out.ntris * 3) {
+            return fail("bad UV sections");
+        }
+#endif
+        iL = 8;
+    }
+    else
+    {
+        // camera, BVs, meshlet headers + data, M, L
+        const size_t numML = buf[5];
+        if (size_of(2) < numML * meshlet::nhdr || size_of(3) % mat::nserial != 0) {
+            return fail("bad meshlet or material section");
+        }
+        size_t data_beg = bounds[2] + numML * meshlet::nhdr, prev = data_beg;
+        out.ntris = 0;
+        for (size_t m = 0; m < numML; ++m)
+        {
+            const uint* h = buf.data() + bounds[2] + m * meshlet::nhdr;
+            if (h[0] < prev || h[0] > bounds[3]) {
+                return fail("meshlet %zu data is out of bounds", m);
+            }
+            prev = h[0];
+            out.ntris += h[1];
+        }
+        iL = 4;
+    }
+
+    if (size_of(iL) != size_t(out.numL) * light::nserial) {
+        return fail("light section has %zu words for %u lights", size_of(iL), out.numL);
+    }
+    if (bv_ntris != out.ntris) {
+        return fail("BVs hold %zu triangles, expected %zu", bv_ntris, out.ntris);
+    }
+
+    // optional sections whose size is known
+    const size_t nfixed = nhdr - first;
+    for (size_t i = 0; i < ext_ids.size(); ++i)
+    {
+        const uint id = ext_ids[i];
+        const size_t n = size_of(nfixed + i);
+        if (n == 0) {
+            return fail("%s section is empty", ext_name(id));
+        }
+        size_t expect = n;
+        switch (serial_ext(id))
+        {
+        case serial_ext::Instances:
+            expect = 1 + size_t(section(nfixed + i)[0]) * instance::nserial;
+            break;
+        case serial_ext::Quantization:
+            expect = 1 + size_t(out.numBV) * 3;
+            break;
+        case serial_ext::TriIsect:
+            expect = out.ntris * tri_isect::nserial;
+            break;
+        case serial_ext::BVOrder:
+            expect = size_t(out.numBV) * 9;
+            break;
+        case serial_ext::LightMask:
+            expect = size_t(out.numBV) * packed_words(out.numL, 1);
+            break;
+        case serial_ext::ShadowMask:
+            expect = size_t(out.numBV) * packed_words(out.numL, 2);
+            break;
+        }
+        if (n != expect) {
+            return fail("%s section has %zu words, expected %zu", ext_name(id), n, expect);
+        }
+        out.ext.push_back({ id, n });
+    }
+    return {};
+}
+
+// Finds the format that buf fits, or prints why it fits none.
+static int validate_scene(std::span<const uint> buf, scene_layout& out)
+{
+    if (buf.empty()) {
+        return mERROR("empty scene");
+    } else if (buf[0] == bswap32(Scene::MAGIC)) {
+        return mERROR("scene has the wrong endianness");
+    } else if (buf[0] != Scene::MAGIC) {
+        return mERROR("missing magic number");
+    }
+
+    std::string errs[3];
+    int i = 0;
+    for (auto fmt : { serial_format::Duplicate, serial_format::NoDuplicate, serial_format::Meshlet })
+    {
+        errs[i] = check_layout(buf, fmt, out);
+        if (errs[i].empty()) { break; }
+        i++;
+    }
+    if (i == 3) {
+        return mERROR("scene fits no layout (dup: %s; nodup: %s; meshlet: %s)",
+            errs[0].c_str(), errs[1].c_str(), errs[2].c_str());
+    }
+    if (out.resX == 0 || out.resY == 0 || out.resX > 16384 || out.resY > 16384) {
+        return mERROR("bad resolution %ux%u", out.resX, out.resY);
+    }
+    return 0;
+}
+
+static void print_layout(const scene_layout& sc)
+{
+    std::printf("%s layout, %ux%u, %u light(s), %u BV(s), %zu triangle(s)",
+        sc.fmt, sc.resX, sc.resY, sc.numL, sc.numBV, sc.ntris);
+    for (auto& [id, n] : sc.ext) {
+        std::printf(", %s", ext_name(id));
+    }
+    std::printf("\n");
+}
+
+// RGB gradient with a checkerboard tinted by a hash of the scene,
+// so different scenes give different (but reproducible) images. img
+// holds resX * resY RGB pixels.
+static void test_image(const scene_layout& sc, std::span<const uint> buf, char* img)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (uint w : buf) {
+        h = (h ^ w) * 0x100000001b3ull;
+    }
+    const byte tint = byte(h ^ (h >> 32));
+
+    parallel_for(sc.resY, [&](size_t y)
+    {
+        char* row = img + y * sc.resX * 3;
+        for (uint x = 0; x < sc.resX; ++x)
+        {
+            bool check = ((x >> 3) ^ (y >> 3)) & 1;
+            row[3 * x] = char(x * 255 / std::max(1u, sc.resX - 1));
+            row[3 * x + 1] = char(y * 255 / std::max(size_t(1), size_t(sc.resY) - 1));
+            row[3 * x + 2] = char(check ? tint : 255 - tint);
+        }
+    });
+}
+
+struct emu_opts
+{
+    double bandwidth = 0; // MB/s, 0 is unlimited
+    double latency_ms = 0; // one way
+    double render_ms = 0; // per frame
+    double pixel_tri_ns = 0; // per pixel and triangle
+    double fault_rate = 0; // chance of a fault per connection
+    bool verbose = false;
+};
+
+enum class fault { None, Drop, Truncate };
+
+using emu_clock = chrono::steady_clock;
+
+// Time to move nbytes in nmsgs messages over the simulated link.
+static emu_clock::duration link_time(const emu_opts& o, size_t nbytes, uint nmsgs = 1)
+{
+    double secs = nmsgs * o.latency_ms / 1e3 + (o.bandwidth > 0 ? nbytes / (o.bandwidth * 1e6) : 0);
+    return chrono::duration_cast<emu_clock::duration>(chrono::duration<double>(secs));
+}
+
+static double ms_since(emu_clock::time_point t)
+{
+    return chrono::duration<double, std::milli>(emu_clock::now() - t).count();
+}
+
+// What crossed the link to get a scene, both ways.
+struct link_traffic
+{
+    size_t nbytes = 0;
+    uint nmsgs = 0;
+    size_t npacked = 0; // bytes of packed data among nbytes
+    size_t nunpacked = 0; // bytes they unpacked to
+    double unpack_ms = 0;
+};
+
+// Unpacks a packed message, counting it in tr.
+static int unpack(std::span<const byte> msg, std::vector<uint>& out, link_traffic& tr)
+{
+    auto tbeg = emu_clock::now();
+    if (unpack_words(msg, out) != 0) {
+        return -1;
+    }
+    tr.unpack_ms += ms_since(tbeg);
+    tr.npacked += msg.size();
+    tr.nunpacked += out.size() * sizeof(uint);
+    return 0;
+}
+
+// Prints what packing did, and with a bandwidth, the time to move
+// plain_bytes against the time to pack, move and unpack them.
+static void print_packing(size_t plain_bytes, size_t packed_bytes, double pack_ms,
+    double unpack_ms, const emu_opts& o)
+{
+    std::printf("unpacked %.1f MB from %.1f MB (%.2fx) in %.1f ms", plain_bytes / 1e6,
+        packed_bytes / 1e6, double(plain_bytes) / std::max<size_t>(packed_bytes, 1), unpack_ms);
+    if (o.bandwidth > 0)
+    {
+        double plain_ms = plain_bytes / (o.bandwidth * 1e3);
+        double packed_ms = pack_ms + packed_bytes / (o.bandwidth * 1e3) + unpack_ms;
+        std::printf(", %.1f ms instead of %.1f ms at %g MB/s (%.2fx)",
+            packed_ms, plain_ms, o.bandwidth, plain_ms / packed_ms);
+    }
+    std::printf("\n");
+}
+
+#ifdef __linux__
+// Sends the file over loopback the way rthost --zerocopy uploads it
+// (sendfile(), then MSG_ZEROCOPY from memory) and reads the frames back
+// with TCP_recv2(), as the board does. send_frame_zerocopy() frames
+// uploads itself, so this keeps it in step with the IO library.
+static int check_zerocopy(const fs::path& path, std::span<const uint> words)
+{
+    socket_t ls = TCP_listen2("0", false, false);
+    if (ls == INV_SOCKET) {
+        return mERROR("zero-copy check: failed to listen");
+    }
+    sockaddr_in addr = {};
+    socklen_t alen = sizeof(addr);
+    socket_t s = INV_SOCKET, cs = INV_SOCKET;
+    if (::getsockname(ls, reinterpret_cast<sockaddr*>(&addr), &alen) == 0)
+    {
+        // connects through the backlog, so it can be accepted right after
+        s = TCP_connect2("127.0.0.1", std::to_string(ntohs(addr.sin_port)).c_str(), false);
+        if (s != INV_SOCKET) { cs = TCP_accept2(ls, false); }
+    }
+    TCP_close(ls);
+    if (cs == INV_SOCKET)
+    {
+        if (s != INV_SOCKET) { TCP_close(s); }
+        return mERROR("zero-copy check: failed to connect over loopback");
+    }
+
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    send_method used[2] = {};
+    int sent = -1;
+    std::thread sender([&]
+    {
+        sent = fd >= 0 &&
+            send_frame_zerocopy(s, words.data(), words.size_bytes(), fd, used[0]) == 0 &&
+            send_frame_zerocopy(s, words.data(), words.size_bytes(), -1, used[1]) == 0 ? 0 : -1;
+        // the receiver gets an error instead of waiting if sending failed
+        TCP_close(s);
+    });
+
+    bool same = true;
+    for (int i = 0; i < 2 && same; ++i)
+    {
+        char* pdata;
+        int nrecv = TCP_recv2(cs, &pdata, false);
+        if (nrecv < 0) {
+            same = false;
+            break;
+        }
+        auto frame = scoped_cptr<char[]>(pdata);
+        same = size_t(nrecv) == words.size_bytes() &&
+            std::memcmp(pdata, words.data(), words.size_bytes()) == 0;
+    }
+    sender.join();
+    TCP_close(cs);
+    if (fd >= 0) { ::close(fd); }
+
+    if (sent != 0) {
+        return mERROR("zero-copy check: sending failed");
+    } else if (!same) {
+        return mERROR("zero-copy check: frames didn't read back as sent");
+    }
+    static constexpr const char* names[] = {
+        "buffered", "sendfile", "zero-copy", "zero-copy, copied by kernel" };
+    std::printf("zero-copy uploads read back intact (%s, then %s)\n",
+        names[int(used[0])], names[int(used[1])]);
+    return 0;
+}
+#endif
+
+static bool is_packed(const char* p, size_t n)
+{
+    uint magic;
+    return n >= sizeof(magic) && (std::memcpy(&magic, p, sizeof(magic)), magic == PACK_MAGIC);
+}
+
+// The board's end of the link to the host. A frame is one scene
+// received and one image (or nothing) sent back, then end_frame().
+class device_link
+{
+public:
+    virtual ~device_link() = default;
+
+    // Waits for the next scene, valid until end_frame(). Returns 1 if
+    // the link itself failed and no more frames can come.
+    virtual int recv_scene(std::span<const uint>& scene, link_traffic& tr) = 0;
+    // Memory for an image of up to n bytes.
+    virtual char* image_buffer(size_t n) = 0;
+    // Sends the first n bytes of the image.
+    virtual int send_image(size_t n) = 0;
+    // Ends the frame without an image, as a lost connection would.
+    virtual void drop() {}
+    virtual void end_frame() {}
+};
+
+// One connection per frame, like the board. With delta, also takes
+// delta uploads (see DELTA_MAGIC), keeping the last scene sent that way.
+class tcp_device : public device_link
+{
+public:
+    tcp_device(socket_t listensock, bool delta, bool verbose) :
+        m_listen(listensock), m_delta(delta), m_verbose(verbose) {}
+    ~tcp_device() { end_frame(); }
+
+    int recv_scene(std::span<const uint>& scene, link_traffic& tr) override
+    {
+        m_sock = TCP_accept2(m_listen, m_verbose);
+        if (m_sock == INV_SOCKET) {
+            mERROR("failed to accept connection");
+            return 1;
+        }
+        char* pdata;
+        int nrecv = TCP_recv2(m_sock, &pdata, m_verbose);
+        if (nrecv < 0) {
+            return mERROR("failed to receive scene");
+        }
+        m_data.reset(pdata);
+        tr = { size_t(nrecv), 1 };
+        if (is_packed(pdata, nrecv))
+        {
+            if (unpack({ reinterpret_cast<const byte*>(pdata), size_t(nrecv) }, m_unpacked, tr) != 0) {
+                return -1;
+            }
+            scene = m_unpacked;
+            return 0;
+        }
+        if (nrecv % sizeof(uint) != 0) {
+            return mERROR("scene is %d bytes, not whole words", nrecv);
+        }
+        scene = { reinterpret_cast<const uint*>(pdata), nrecv / sizeof(uint) };
+        if (m_delta && !scene.empty() && scene[0] == DELTA_MAGIC) {
+            return recv_delta(scene, tr);
+        }
+        return 0;
+    }
+
+    char* image_buffer(size_t n) override
+    {
+        m_img.resize(n);
+        return m_img.data();
+    }
+
+    int send_image(size_t n) override
+    {
+        if (TCP_send2(m_sock, m_img.data(), int(n), m_verbose) != int(n)) {
+            return mERROR("failed to send image");
+        }
+        return 0;
+    }
+
+    void end_frame() override
+    {
+        if (m_sock != INV_SOCKET) {
+            TCP_close(m_sock);
+            m_sock = INV_SOCKET;
+        }
+        m_data.reset();
+    }
+
+private:
+    // Answers the offer in scene with the blocks not held, and replaces
+    // scene with the held one once it is updated.
+    int recv_delta(std::span<const uint>& scene, link_traffic& tr)
+    {
+        const std::span<const uint> offer = scene;
+        if (offer.size() < delta_offer_nhdr) {
+            return mERROR("delta upload: short offer");
+        }
+        const size_t nwords = offer[1], bw = offer[2], nblocks = offer[3];
+        const bool packed = offer[4] & delta_packed;
+        if (bw == 0 || nblocks != (nwords + bw - 1) / bw ||
+            offer.size() != delta_offer_nhdr + 2 * nblocks) {
+            return mERROR("delta upload: bad offer");
+        }
+        std::vector<uint64_t> hashes(nblocks);
+        for (size_t b = 0; b < nblocks; ++b) {
+            hashes[b] = offer[delta_offer_nhdr + 2 * b] |
+                uint64_t(offer[delta_offer_nhdr + 2 * b + 1]) << 32;
+        }
+        auto block_size = [&](size_t b) { return std::min(bw, nwords - b * bw); };
+
+        // blocks found in the held scene, wherever they were; the
+        // others are sent in order
+        std::vector<size_t> src(nblocks), recv_off(nblocks);
+        std::vector<uint> reply(delta_reply_nhdr + packed_words(nblocks, 1), 0);
+        size_t nmissing = 0, nmissing_words = 0;
+        for (size_t b = 0; b < nblocks; ++b)
+        {
+            auto it = m_held_blocks.find(hashes[b]);
+            if (it != m_held_blocks.end()) {
+                src[b] = it->second;
+                continue;
+            }
+            reply[delta_reply_nhdr + b / 32] |= 1u << (b % 32);
+            recv_off[b] = nmissing_words;
+            nmissing_words += block_size(b);
+            src[b] = SIZE_MAX;
+            nmissing++;
+        }
+        reply[0] = DELTA_MAGIC;
+        reply[1] = uint(nmissing);
+
+        const int nreply = int(reply.size() * sizeof(uint));
+        if (TCP_send2(m_sock, (char*)reply.data(), nreply, m_verbose) != nreply) {
+            return mERROR("delta upload: failed to send reply");
+        }
+        char* pdata;
+        int nrecv = TCP_recv2(m_sock, &pdata, m_verbose);
+        if (nrecv < 0) {
+            return mERROR("delta upload: failed to receive blocks");
+        }
+        auto data = scoped_cptr<char[]>(pdata);
+        tr.nbytes += nreply + size_t(nrecv);
+        tr.nmsgs += 2;
+        const uint* recvd = reinterpret_cast<const uint*>(pdata);
+        size_t nrecv_words = size_t(nrecv) / sizeof(uint);
+        if (packed)
+        {
+            if (unpack({ reinterpret_cast<const byte*>(pdata), size_t(nrecv) }, m_unpacked, tr) != 0) {
+                return -1;
+            }
+            recvd = m_unpacked.data();
+            nrecv_words = m_unpacked.size();
+        }
+        else if (nrecv % sizeof(uint) != 0) {
+            nrecv_words = SIZE_MAX;
+        }
+        if (nrecv_words != nmissing_words) {
+            return mERROR("delta upload: got %d bytes of blocks, expected %zu",
+                nrecv, nmissing_words * sizeof(uint));
+        }
+
+        std::vector<uint> next(nwords);
+        std::atomic<bool> bad = false;
+        parallel_for(nblocks, [&](size_t b)
+        {
+            const uint* p = src[b] != SIZE_MAX ? m_held.data() + src[b] : recvd + recv_off[b];
+            std::copy_n(p, block_size(b), next.data() + b * bw);
+            if (src[b] == SIZE_MAX && hash_words(p, block_size(b)) != hashes[b]) {
+                bad = true;
+            }
+        });
+        if (bad) {
+            return mERROR("delta upload: a block does not match its hash");
+        }
+
+        m_held = std::move(next);
+        m_held_blocks.clear();
+        for (size_t b = 0; b < nblocks; ++b) {
+            m_held_blocks.emplace(hashes[b], b * bw);
+        }
+        std::printf("delta upload: %zu of %zu block(s) sent, %.1f of %.1f MB\n",
+            nmissing, nblocks, nmissing_words * sizeof(uint) / 1e6, nwords * sizeof(uint) / 1e6);
+        scene = m_held;
+        return 0;
+    }
+
+    socket_t m_listen, m_sock = INV_SOCKET;
+    bool m_delta, m_verbose;
+    scopedCPtr<char[]> m_data = { nullptr, std::free };
+    std::vector<char> m_img;
+    // last scene from a delta upload, and where each of its blocks is
+    std::vector<uint> m_held;
+    std::unordered_map<uint64_t, size_t> m_held_blocks;
+    std::vector<uint> m_unpacked;
+};
+
+// Shared memory link: scenes are read and images rendered in place in
+// the rings. A dropped frame is an empty image.
+class shm_device : public device_link
+{
+public:
+    int create(const std::string& name, size_t ring_bytes) {
+        return m_link.create(name, ring_bytes);
+    }
+
+    int recv_scene(std::span<const uint>& scene, link_traffic& tr) override
+    {
+        std::span<const byte> msg;
+        if (m_link.next(shm_link::ToDevice, msg) != 0) {
+            mERROR("failed to receive scene");
+            return 1;
+        }
+        m_has_scene = true;
+        tr = { msg.size(), 1 };
+        if (msg.size() % sizeof(uint) != 0) {
+            return mERROR("scene is %zu bytes, not whole words", msg.size());
+        }
+        scene = { reinterpret_cast<const uint*>(msg.data()), msg.size() / sizeof(uint) };
+        return 0;
+    }
+
+    char* image_buffer(size_t n) override
+    {
+        byte* p;
+        if (m_link.reserve(shm_link::ToHost, n, p) != 0) {
+            return nullptr;
+        }
+        m_reserved = true;
+        return reinterpret_cast<char*>(p);
+    }
+
+    int send_image(size_t n) override
+    {
+        m_link.commit(shm_link::ToHost, n);
+        m_reserved = false;
+        return 0;
+    }
+
+    void drop() override
+    {
+        // the host waits for an image as long as we are alive
+        byte* p;
+        if (m_reserved || m_link.reserve(shm_link::ToHost, 0, p) == 0) {
+            send_image(0);
+        }
+    }
+
+    void end_frame() override
+    {
+        if (m_has_scene) {
+            m_link.release(shm_link::ToDevice);
+            m_has_scene = false;
+        }
+    }
+
+private:
+    shm_link m_link;
+    bool m_has_scene = false, m_reserved = false;
+};
+
+// Serves one frame. Returns nonzero if it was not a clean frame, 1 if
+// the link failed.
+static int serve(device_link& link, const emu_opts& o, fault f, uint frameno)
+{
+    auto tbeg = emu_clock::now();
+
+    std::span<const uint> buf;
+    link_traffic tr;
+    if (int e = link.recv_scene(buf, tr))
+    {
+        if (e > 0) { return e; }
+        link.drop();
+        return mERROR("frame %u: no scene", frameno);
+    }
+    std::this_thread::sleep_until(tbeg + link_time(o, tr.nbytes, tr.nmsgs) +
+        chrono::duration_cast<emu_clock::duration>(chrono::duration<double, std::milli>(tr.unpack_ms)));
+    double recv_ms = ms_since(tbeg);
+
+    scene_layout sc;
+    if (validate_scene(buf, sc) != 0)
+    {
+        link.drop();
+        return -1;
+    }
+
+    std::printf("frame %u: ", frameno);
+    print_layout(sc);
+
+    auto trender = emu_clock::now();
+    double render_ms = o.render_ms +
+        double(sc.resX) * sc.resY * sc.ntris * o.pixel_tri_ns / 1e6;
+    size_t nsend = size_t(sc.resX) * sc.resY * 3;
+    char* img = link.image_buffer(nsend);
+    if (!img)
+    {
+        link.drop();
+        return mERROR("frame %u: no room for a %zu byte image", frameno, nsend);
+    }
+    test_image(sc, buf, img);
+    std::this_thread::sleep_until(trender +
+        chrono::duration_cast<emu_clock::duration>(chrono::duration<double, std::milli>(render_ms)));
+
+    if (f == fault::Drop) {
+        std::printf("frame %u: dropping connection\n", frameno);
+        link.drop();
+        return -1;
+    }
+    else if (f == fault::Truncate) {
+        nsend /= 2;
+        std::printf("frame %u: truncating image to %zu bytes\n", frameno, nsend);
+    }
+
+    auto tsend = emu_clock::now();
+    std::this_thread::sleep_until(tsend + link_time(o, nsend));
+    if (link.send_image(nsend) != 0) {
+        return mERROR("frame %u: failed to send image", frameno);
+    }
+
+    std::printf("frame %u: received %.1f MB in %.1f ms, rendered in %.1f ms, "
+        "sent image in %.1f ms (%.1f ms total)\n", frameno, tr.nbytes / 1e6, recv_ms,
+        render_ms, ms_since(tsend), ms_since(tbeg));
+    if (tr.npacked != 0)
+    {
+        // the host packed it, in a time it reports itself
+        std::printf("frame %u: ", frameno);
+        print_packing(tr.nunpacked, tr.npacked, 0, tr.unpack_ms, o);
+    }
+    return f == fault::None ? 0 : -1;
+}
+
+int main(int argc, char** argv)
+{
+    cxxopts::Options opts("rtemu", "FPGA raytracer emulator.");
+    opts.add_options()
+        ("h,help", "Show usage.")
+        ("p,port", "Port to listen on.", cxxopts::value<std::string>()->default_value("50000"), "<port>")
+        ("ipv6", "Listen on IPv6.")
+        ("shm", "Serve a shared memory link instead of TCP (Linux).", cxxopts::value<std::string>(), "<name>")
+        ("shm-mb", "Size of each shared memory ring in MB.", cxxopts::value<uint>()->default_value("256"), "<uint>")
+        ("no-delta", "Refuse delta uploads, like a board without them.")
+        ("n,count", "Frames to serve before exiting, 0 for no limit.", cxxopts::value<uint>()->default_value("0"), "<uint>")
+        ("bandwidth", "Simulated link bandwidth in MB/s, 0 for no limit.", cxxopts::value<double>()->default_value("0"), "<float>")
+        ("latency", "Simulated one-way link latency in ms.", cxxopts::value<double>()->default_value("0"), "<float>")
+        ("render-ms", "Simulated render time per frame in ms.", cxxopts::value<double>()->default_value("0"), "<float>")
+        ("pixel-tri-ns", "Simulated render time per pixel and triangle in ns.", cxxopts::value<double>()->default_value("0"), "<float>")
+        ("fault-rate", "Chance of a dropped connection or truncated image per frame.", cxxopts::value<double>()->default_value("0"), "<float>")
+        ("seed", "Seed for fault injection.", cxxopts::value<uint>()->default_value("1"), "<uint>")
+        ("check", "Check the layout of a scene file and exit.", cxxopts::value<std::string>(), "<file>")
+        ("check-zerocopy", "Send a scene file to itself over loopback as --zerocopy uploads do, check it reads back and exit (Linux).", cxxopts::value<std::string>(), "<file>")
+        ("v,verbose", "Verbose mode.");
+
+    cxxopts::ParseResult args;
+    try {
+        args = opts.parse(argc, argv);
+    }
+    catch (std::exception& e) {
+        return mERROR(e.what());
+    }
+
+    if (args["help"].as<bool>()) {
+        std::cout << opts.help();
+        return 0;
+    }
+
+    if (args["check"].count() != 0)
+    {
+        BufWithSize<uint> buf;
+        int e = read_file(args["check"].as<std::string>(), buf);
+        if (e) { return e; }
+
+        scene_layout sc;
+        std::span<const uint> words(buf.get(), buf.size);
+        e = validate_scene(words, sc);
+        if (e) { return e; }
+        print_layout(sc);
+
+        // round trip through the packed encoding
+        auto tpack = emu_clock::now();
+        std::vector<byte> packed;
+        pack_words(words, packed);
+        double pack_ms = ms_since(tpack);
+
+        std::vector<uint> unpacked;
+        link_traffic tr;
+        e = unpack(packed, unpacked, tr);
+        if (e) { return e; }
+        if (!ranges::equal(unpacked, words)) {
+            return mERROR("packing changed the scene");
+        }
+        emu_opts o;
+        o.bandwidth = args["bandwidth"].as<double>();
+        std::printf("packed in %.1f ms, ", pack_ms);
+        print_packing(words.size_bytes(), packed.size(), pack_ms, tr.unpack_ms, o);
+        return 0;
+    }
+
+    if (args["check-zerocopy"].count() != 0)
+    {
+#ifdef __linux__
+        auto& path = args["check-zerocopy"].as<std::string>();
+        BufWithSize<uint> buf;
+        int e = read_file(path, buf);
+        if (e) { return e; }
+        return check_zerocopy(path, std::span<const uint>(buf.get(), buf.size));
+#else
+        return mERROR("option --check-zerocopy is only available on Linux");
+#endif
+    }
+
+    emu_opts eo;
+    eo.bandwidth = args["bandwidth"].as<double>();
+    eo.latency_ms = args["latency"].as<double>();
+    eo.render_ms = args["render-ms"].as<double>();
+    eo.pixel_tri_ns = args["pixel-tri-ns"].as<double>();
+    eo.fault_rate = args["fault-rate"].as<double>();
+    eo.verbose = args["verbose"].count() != 0;
+    if (eo.bandwidth < 0 || eo.latency_ms < 0 || eo.render_ms < 0 || eo.pixel_tri_ns < 0) {
+        return mERROR("simulated times and bandwidth must be non-negative");
+    } else if (eo.fault_rate < 0 || eo.fault_rate > 1) {
+        return mERROR("fault rate must be in [0, 1]");
+    }
+    const uint count = args["count"].as<uint>();
+
+    std::unique_ptr<device_link> link;
+    socket_t listensock = INV_SOCKET;
+    if (args["shm"].count() != 0)
+    {
+        auto& name = args["shm"].as<std::string>();
+        auto shm = std::make_unique<shm_device>();
+        int e = shm->create(name, size_t(args["shm-mb"].as<uint>()) << 20);
+        if (e) { return e; }
+        link = std::move(shm);
+        std::printf("Emulating FPGA at shm:%s\n", name.c_str());
+    }
+    else
+    {
+        if (TCP_win32_init() != 0) {
+            return mERROR("failed to initialize TCP");
+        }
+        auto& port = args["port"].as<std::string>();
+        listensock = TCP_listen2(port.c_str(), args["ipv6"].count() != 0, eo.verbose);
+        if (listensock == INV_SOCKET) {
+            return mERROR("failed to listen on port %s", port.c_str());
+        }
+        link = std::make_unique<tcp_device>(listensock, args["no-delta"].count() == 0, eo.verbose);
+        std::printf("Emulating FPGA on port %s\n", port.c_str());
+    }
+
+    std::mt19937 rng{ args["seed"].as<uint>() };
+    std::uniform_real_distribution<double> unit(0, 1);
+
+    uint nok = 0, nfailed = 0;
+    for (uint n = 0; count == 0 || n < count; ++n)
+    {
+        fault f = fault::None;
+        if (unit(rng) < eo.fault_rate) {
+            f = unit(rng) < 0.5 ? fault::Drop : fault::Truncate;
+        }
+        int e = serve(*link, eo, f, n);
+        link->end_frame();
+        if (e > 0) { break; }
+        else if (e == 0) { nok++; }
+        else { nfailed++; }
+    }
+    link.reset();
+    if (listensock != INV_SOCKET) {
+        TCP_close(listensock);
+    }
+
+    std::printf("Served %u frame(s), %u failed\n", nok + nfailed, nfailed);
+    return 0;
+}
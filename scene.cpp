@@ -5,8 +5,10 @@
 #include <iostream>
 #include <charconv>
 #include <cmath>
+#include <map>
+#include <numeric>
+#include <unordered_set>
 
-#include "rapidobj/rapidobj.hpp"
 #include "defs.hpp"
 
 // missing in Windows
@@ -14,30 +16,6 @@
 #define M_PI 3.14159265358979323846
 #endif
 
-static inline bbox get_tri_bbox(
-    const std::vector<vec3>& V, const std::array<int, 3>& tri)
-{
-    bbox bb;
-    for (int i = 0; i < 3; ++i)
-    {
-        bb.cmin = bb.cmin.cwiseMin(V[tri[i]]);
-        bb.cmax = bb.cmax.cwiseMax(V[tri[i]]);
-    }
-    return bb;
-}
-
-static inline bbox get_nodes_bbox(
-    const tri* tris_beg, const tri* tris_end)
-{
-    bbox bb;
-    for (auto* p = tris_beg; p < tris_end; ++p)
-    {
-        bb.cmin = bb.cmin.cwiseMin(p->bb.cmin);
-        bb.cmax = bb.cmax.cwiseMax(p->bb.cmax);
-    }
-    return bb;
-}
-
 // https://www.euclideanspace.com/maths/geometry/rotations/conversions/angleToMatrix/
 static void axis_angle_to_uvw(vec3 axis, float angle, vec3& u, vec3& v, vec3& w)
 {
@@ -81,6 +59,69 @@ static inline bool parsenum3(std::string_view& str, T& a, T& b, T& c)
     return parsenum(str, a) && parsenum(str, b) && parsenum(str, c);
 }
 
+int parse_camera_prop(std::string_view line, camera& C, const char*& err)
+{
+    if (line.starts_with("eye "))
+    {
+        line.remove_prefix(sizeof("eye ") - 1);
+        if (!parsenum3(line, C.eye.x(), C.eye.y(), C.eye.z())) {
+            err = "invalid eye";
+            return -1;
+        }
+        return camera_eye;
+    }
+    else if (line.starts_with("axis_angle "))
+    {
+        line.remove_prefix(sizeof("axis_angle ") - 1);
+        vec3 axis; float angle;
+        if (!parsenum3(line, axis.x(), axis.y(), axis.z()) ||
+            !parsenum(line, angle)) {
+            err = "invalid axis angle";
+            return -1;
+        }
+        axis_angle_to_uvw(axis, angle, C.u, C.v, C.w);
+        return camera_uvw;
+    }
+    else if (line.starts_with("uvw "))
+    {
+        line.remove_prefix(sizeof("uvw ") - 1);
+        vec3 u, v, w;
+        if (!parsenum3(line, u.x(), u.y(), u.z()) ||
+            !parsenum3(line, v.x(), v.y(), v.z()) ||
+            !parsenum3(line, w.x(), w.y(), w.z())) {
+            err = "invalid uvw";
+            return -1;
+        }
+        u.normalize(); v.normalize(); w.normalize();
+        C.u = u; C.v = v; C.w = w;
+        return camera_uvw;
+    }
+    else if (line.starts_with("focal_len "))
+    {
+        line.remove_prefix(sizeof("focal_len ") - 1);
+        float flen;
+        if (!parsenum(line, flen) || flen <= 0) {
+            err = "invalid focal length";
+            return -1;
+        }
+        C.focal_len = flen;
+        return camera_focal_len;
+    }
+    else if (line.starts_with("proj_size "))
+    {
+        line.remove_prefix(sizeof("proj_size ") - 1);
+        float width, height;
+        if (!parsenum(line, width) || !parsenum(line, height) ||
+            width <= 0 || height <= 0) {
+            err = "invalid projection size";
+            return -1;
+        }
+        C.width = width; C.height = height;
+        return camera_proj_size;
+    }
+    return 0;
+}
+
 // stops when section ends (i.e. line is empty)
 static bool sc_getsubline(std::string_view& str, std::string_view& line, int& lineno)
 {
@@ -92,7 +133,7 @@ static bool sc_getsubline(std::string_view& str, std::string_view& line, int& li
     return gotline;
 }
 
-int Scene::read_scenefile(const fs::path& scpath, std::vector<fs::path>& objpaths)
+int Scene::read_scenefile(const fs::path& scpath, std::vector<obj_ref>& objrefs)
 {
     const char* pscname = m_scname.c_str();
 
@@ -119,46 +160,29 @@ int Scene::read_scenefile(const fs::path& scpath, std::vector<fs::path>& objpath
         if (line == "obj")
         {
             while (sc_getsubline(scstr, line, lineno)) {
-                objpaths.push_back(scdir / line);
+                objrefs.push_back({ scdir / line, xform::identity() });
             }
         }
-        else if (line == "scene")
+        else if (line == "instance")
         {
-            bool has_res = false;
+            // applied in order scale, rotate, translate
+            obj_ref ref;
+            vec3 scale = { 1, 1, 1 }, trans = { 0, 0, 0 };
+            vec3 ru = { 1, 0, 0 }, rv = { 0, 1, 0 }, rw = { 0, 0, 1 };
+
             while (sc_getsubline(scstr, line, lineno))
             {
-                if (line.starts_with("res "))
+                if (line.starts_with("obj "))
                 {
-                    line.remove_prefix(sizeof("res ") - 1);
-                    if (!parsenum(line, R.first) ||
-                        !parsenum(line, R.second)) {
-                        return scERROR("invalid resolution");
-                    }
-                    has_res = true;
+                    line.remove_prefix(sizeof("obj ") - 1);
+                    ref.path = scdir / line;
                 }
-                else { return scERROR("unrecognized prop"); }
-            }
-            if (!has_res) {
-                return scERROR("missing render prop(s)");
-            }
-            has_scene = true;
-        }
-        else if (line == "camera")
-        {
-            bool has_eye = false, 
-                has_uvw = false, 
-                has_flen = false, 
-                has_proj = false;
-
-            while (sc_getsubline(scstr, line, lineno))
-            {
-                if (line.starts_with("eye "))
+                else if (line.starts_with("translate "))
                 {
-                    line.remove_prefix(sizeof("eye ") - 1);
-                    if (!parsenum3(line, C.eye.x(), C.eye.y(), C.eye.z())) {
-                        return scERROR("invalid eye");
+                    line.remove_prefix(sizeof("translate ") - 1);
+                    if (!parsenum3(line, trans.x(), trans.y(), trans.z())) {
+                        return scERROR("invalid translation");
                     }
-                    has_eye = true;
                 }
                 else if (line.starts_with("axis_angle "))
                 {
@@ -168,42 +192,73 @@ int Scene::read_scenefile(const fs::path& scpath, std::vector<fs::path>& objpath
                         !parsenum(line, angle)) {
                         return scERROR("invalid axis angle");
                     }
-                    axis_angle_to_uvw(axis, angle, C.u, C.v, C.w);
-                    has_uvw = true;
+                    axis_angle_to_uvw(axis, angle, ru, rv, rw);
                 }
-                else if (line.starts_with("uvw "))
+                else if (line.starts_with("scale "))
                 {
-                    line.remove_prefix(sizeof("uvw ") - 1);
-                    vec3& u = C.u; vec3& v = C.v; vec3& w = C.w;
-                    if (!parsenum3(line, u.x(), u.y(), u.z()) ||
-                        !parsenum3(line, v.x(), v.y(), v.z()) ||
-                        !parsenum3(line, w.x(), w.y(), w.z())) {
-                        return scERROR("invalid uvw");
+                    line.remove_prefix(sizeof("scale ") - 1);
+                    // uniform or per-axis
+                    if (!parsenum(line, scale.x())) {
+                        return scERROR("invalid scale");
                     }
-                    u.normalize(); v.normalize(); w.normalize();
-                    has_uvw = true;
-                }
-                else if (line.starts_with("focal_len "))
-                {
-                    line.remove_prefix(sizeof("focal_len ") - 1);
-                    if (!parsenum(line, C.focal_len) || C.focal_len <= 0) {
-                        return scERROR("invalid focal length");
+                    scale.y() = scale.z() = scale.x();
+                    if (!line.empty() && 
+                        (!parsenum(line, scale.y()) || !parsenum(line, scale.z()))) {
+                        return scERROR("invalid scale");
+                    }
+                    if (scale.x() == 0 || scale.y() == 0 || scale.z() == 0) {
+                        return scERROR("invalid scale, must be non-zero");
                     }
-                    has_flen = true;
                 }
-                else if (line.starts_with("proj_size "))
+                else { return scERROR("unrecognized prop"); }
+            }
+            if (ref.path.empty()) {
+                return scERROR("missing instance obj");
+            }
+
+            // columns of rotation are u, v, w
+            for (int r = 0; r < 3; ++r)
+            {
+                ref.T.m[r][0] = ru[r] * scale[0];
+                ref.T.m[r][1] = rv[r] * scale[1];
+                ref.T.m[r][2] = rw[r] * scale[2];
+                ref.T.m[r][3] = trans[r];
+            }
+            objrefs.push_back(ref);
+        }
+        else if (line == "scene")
+        {
+            bool has_res = false;
+            while (sc_getsubline(scstr, line, lineno))
+            {
+                if (line.starts_with("res "))
                 {
-                    line.remove_prefix(sizeof("proj_size ") - 1);
-                    if (!parsenum(line, C.width) ||
-                        !parsenum(line, C.height) ||
-                        C.width <= 0 || C.height <= 0) {
-                        return scERROR("invalid projection size");
+                    line.remove_prefix(sizeof("res ") - 1);
+                    if (!parsenum(line, R.first) ||
+                        !parsenum(line, R.second)) {
+                        return scERROR("invalid resolution");
                     }
-                    has_proj = true;
+                    has_res = true;
                 }
                 else { return scERROR("unrecognized prop"); }
             }
-            if (!has_eye || !has_uvw || !has_flen || !has_proj) {
+            if (!has_res) {
+                return scERROR("missing render prop(s)");
+            }
+            has_scene = true;
+        }
+        else if (line == "camera")
+        {
+            int has_props = 0;
+            while (sc_getsubline(scstr, line, lineno))
+            {
+                const char* err = nullptr;
+                int prop = parse_camera_prop(line, C, err);
+                if (prop < 0) { return scERROR(err); }
+                else if (prop == 0) { return scERROR("unrecognized prop"); }
+                has_props |= prop;
+            }
+            if (has_props != camera_all_props) {
                 return scERROR("missing camera prop(s)");
             }
             has_cam = true;
@@ -245,7 +300,7 @@ int Scene::read_scenefile(const fs::path& scpath, std::vector<fs::path>& objpath
         else { return scERROR("unrecognized prop"); }
     }
 
-    if (objpaths.empty()) {
+    if (objrefs.empty()) {
         return mERROR("%s: no obj files found\n", pscname);
     } else if (!has_cam) {
         return mERROR("%s: no camera found\n", pscname);
@@ -255,9 +310,9 @@ int Scene::read_scenefile(const fs::path& scpath, std::vector<fs::path>& objpath
         return mERROR("%s: no resolution found\n", pscname);
     }
 
-    if (m_verbose) {
+    if (m_opts.verbose) {
         std::printf("%s: using resolution %ux%u\n", pscname, R.first, R.second);
-        std::printf("%s: found %zu obj file(s)\n", pscname, objpaths.size());
+        std::printf("%s: found %zu obj file(s)/instance(s)\n", pscname, objrefs.size());
     }
     std::printf("%s: found %zu light(s)\n", pscname, L.size());
     return 0;
@@ -265,7 +320,19 @@ int Scene::read_scenefile(const fs::path& scpath, std::vector<fs::path>& objpath
 #undef scERROR
 }
 
-int Scene::read_objs(const std::vector<fs::path>& objpaths)
+// Append an array of m to dst. Moves it from own instead if own is m
+// (or null) and dst is empty.
+template <typename T>
+static void append(std::vector<T>& dst, const mesh& m, mesh* own, std::vector<T> mesh::* arr)
+{
+    if (own && dst.empty()) {
+        dst = std::move(own->*arr);
+    } else {
+        dst.insert(dst.end(), (m.*arr).begin(), (m.*arr).end());
+    }
+}
+
+int Scene::read_objs(const std::vector<obj_ref>& objrefs)
 {
     const char* pscname = m_scname.c_str();
 
@@ -275,128 +342,160 @@ int Scene::read_objs(const std::vector<fs::path>& objpaths)
 #endif
     std::vector<int> badFidx; // faces that need fixing later
 
-    for (const auto& objpath : objpaths)
+    // load each file once, no matter how many times it is instanced
+    // (or, from m_opts.meshes, how many scenes use it)
+    std::vector<std::shared_ptr<const mesh>> meshes;
+    std::vector<std::shared_ptr<mesh>> owned; // loaded for this scene alone, else null
+    std::vector<uint> refmesh; // mesh of each ref
+    std::vector<size_t> lastref; // last ref of each mesh
     {
-        auto objname = objpath.filename();
-        DECL_UTF8PATH_CSTR(objname)
-
-        rapidobj::Result res = rapidobj::ParseFile(objpath);
-        if (res.error || !rapidobj::Triangulate(res))
+        std::map<fs::path, uint> ids;
+        for (size_t i = 0; i < objrefs.size(); ++i)
         {
-            return mERROR("%s:%d: %s", pobjname, 
-                int(res.error.line_num), res.error.code.message().c_str());
+            auto [it, inserted] = ids.emplace(objrefs[i].path, uint(meshes.size()));
+            if (inserted)
+            {
+                lastref.emplace_back();
+                m_meshpaths.push_back(objrefs[i].path);
+                auto& own = owned.emplace_back();
+                int e;
+                if (m_opts.meshes) {
+                    e = m_opts.meshes->get(objrefs[i].path, m_opts.verbose, meshes.emplace_back());
+                } else {
+                    own = std::make_shared<mesh>();
+                    e = load_mesh(objrefs[i].path, *own, m_opts.verbose);
+                    meshes.push_back(own);
+                }
+                if (e) { return e; }
+            }
+            refmesh.push_back(it->second);
+            lastref[it->second] = i;
         }
+    }
+    std::vector<int> baseMids(meshes.size(), -1);
 
-        int baseVidx = int(V.size());
-        auto& objverts = res.attributes.positions;
-        for (size_t i = 0; i < objverts.size(); i += 3) {
-            V.push_back({ objverts[i], objverts[i + 1], objverts[i + 2] });
-        }
+    // first vertex of each mesh in a frame (refit)
+    m_frameVbase.assign(meshes.size() + 1, 0);
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        m_frameVbase[i + 1] = m_frameVbase[i] + int(meshes[i]->V.size());
+    }
 
-        int baseNVidx = int(NV.size());
-        auto& objnormals = res.attributes.normals;
-        for (size_t i = 0; i < objnormals.size(); i += 3) {
-            NV.push_back({ objnormals[i], objnormals[i + 1], objnormals[i + 2] });
-        }
+    // Adds a mesh transformed by T as a new object.
+    auto add_mesh = [&](uint meshid, const xform& T, bool last_use)
+    {
+        // Meshes loaded for this scene alone are moved from on their
+        // last use, shared ones are only copied.
+        const mesh& m = *meshes[meshid];
+        mesh* own = last_use ? owned[meshid].get() : nullptr;
+
+        const int baseVidx = int(V.size());
+        const int baseNVidx = int(NV.size());
 #if ENABLE_TEXTURES
-        int baseUVidx = int(UV.size());
-        auto& objUV = res.attributes.texcoords;
-        for (size_t i = 0; i < objUV.size(); i += 2) {
-            UV.push_back({ objUV[i], objUV[i + 1] });
-        }
+        const int baseUVidx = int(UV.size());
 #endif
-        int baseMid = int(M.size());
-        auto& objmats = res.materials;
-        for (size_t i = 0; i < objmats.size(); ++i)
-        {
-            auto& mobj = objmats[i];
-            mat m;
-            m.ka = mobj.ambient;
-            m.kd = mobj.diffuse;
-            m.ks = mobj.specular;
-            m.ns = mobj.shininess;
+        const size_t baseFidx = F.size();
 
-            // solve 1000-2000r+1000r^{2} = ns to get roughness (blender's formula).
-            // then approximate refl as 1-roughness (stupid but should work).
-            // this simplifies to sqrt(ns/1000)
-            assert(m.ns >= 0);
-            float ref_ns = m.ns > 1000 ? 1 : m.ns / 1000;
-            float refl = std::sqrt(ref_ns);
-            m.km = { refl, refl, refl };
+        // materials are shared by all instances
+        if (baseMids[meshid] < 0) {
+            baseMids[meshid] = int(M.size());
+            append(M, m, own, &mesh::M);
+        }
+        const int baseMid = baseMids[meshid];
 
-            M.push_back(m);
+        // remember where each vertex comes from
+        m_refT.push_back(T);
+        for (size_t i = 0; i < m.V.size(); ++i) {
+            m_Vsrc.push_back(m_frameVbase[meshid] + int(i));
+            m_Vxf.push_back(uint(m_refT.size() - 1));
         }
 
-        for (const auto& shape : res.shapes)
-        {
-            if (shape.lines.indices.size() != 0 ||
-                shape.points.indices.size() != 0) {
-                return mERROR("%s: polylines/points not supported", pobjname);
-            }
+        if (T.is_identity()) {
+            append(V, m, own, &mesh::V);
+            append(NV, m, own, &mesh::NV);
+        }
+        else {
+            const xform NT = T.normal_xform();
+            V.reserve(V.size() + m.V.size());
+            NV.reserve(NV.size() + m.NV.size());
+            for (const auto& v : m.V) { V.push_back(T.apply(v)); }
+            for (const auto& n : m.NV) { NV.push_back(NT.apply_dir(n).normalized()); }
+        }
+#if ENABLE_TEXTURES
+        append(UV, m, own, &mesh::UV);
+#endif
+        append(F, m, own, &mesh::F);
 
-            auto& meshidx = shape.mesh.indices;
-            auto& matids = shape.mesh.material_ids;
-            assert(meshidx.size() / 3 == matids.size());
+        // mirroring transforms flip the winding
+        const bool flip = T.det() < 0;
 
-            for (size_t i = 0; i < meshidx.size(); i += 3)
-            {
-                tri t;
-                bool bad = false;
+        for (size_t i = baseFidx; i < F.size(); ++i)
+        {
+            tri& t = F[i];
+            bool bad = false;
 
-                t.Vidx = {
-                    baseVidx + meshidx[i].position_index,
-                    baseVidx + meshidx[i + 1].position_index,
-                    baseVidx + meshidx[i + 2].position_index };
+            for (int j = 0; j < 3; ++j) {
+                t.Vidx[j] += baseVidx;
+            }
+            if (flip) { std::swap(t.Vidx[1], t.Vidx[2]); }
 
-                if (meshidx[i].normal_index != -1 &&
-                    meshidx[i + 1].normal_index != -1 &&
-                    meshidx[i + 2].normal_index != -1) [[likely]] 
-                {
-                    t.NVidx = {
-                        baseNVidx + meshidx[i].normal_index,
-                        baseNVidx + meshidx[i + 1].normal_index,
-                        baseNVidx + meshidx[i + 2].normal_index
-                    };
+            if (t.NVidx[0] >= 0) [[likely]] {
+                for (int j = 0; j < 3; ++j) {
+                    t.NVidx[j] += baseNVidx;
                 }
-                else { t.NVidx[0] = -1; bad = true; }
+                if (flip) { std::swap(t.NVidx[1], t.NVidx[2]); }
+            }
+            else { bad = true; }
 
 #if ENABLE_TEXTURES
-                if (meshidx[i].texcoord_index != -1 &&
-                    meshidx[i + 1].texcoord_index != -1 &&
-                    meshidx[i + 2].texcoord_index != -1) [[likely]]
-                {
-                    t.UVidx = {
-                        baseUVidx + meshidx[i].texcoord_index,
-                        baseUVidx + meshidx[i + 1].texcoord_index,
-                        baseUVidx + meshidx[i + 2].texcoord_index
-                    };
-                }
-                else { 
-                    t.UVidx[0] = -1; 
-                    bad = true; 
-                    missing_uv = true; 
+            if (t.UVidx[0] >= 0) [[likely]] {
+                for (int j = 0; j < 3; ++j) {
+                    t.UVidx[j] += baseUVidx;
                 }
+                if (flip) { std::swap(t.UVidx[1], t.UVidx[2]); }
+            }
+            else {
+                bad = true;
+                missing_uv = true;
+            }
 #endif
-                if (matids[i / 3] != -1) [[likely]] {
-                    t.matid = baseMid + matids[i / 3];
-                }
-                else { 
-                    t.matid = -1;
-                    bad = true; 
-                    missing_mat = true; 
-                }
-
-                t.bb = get_tri_bbox(V, t.Vidx);
+            if (t.matid >= 0) [[likely]] {
+                t.matid += baseMid;
+            }
+            else {
+                bad = true;
+                missing_mat = true;
+            }
 
-                F.push_back(t);
+            t.bb = get_tri_bbox(V, t.Vidx);
 
-                // It is likely that if normals are missing, materials are missing too.
-                // Put them all in one array to avoid iterating through all faces multiple times.
-                if (bad) [[unlikely]] {
-                    badFidx.push_back(int(F.size() - 1));
-                }
+            // It is likely that if normals are missing, materials are missing too.
+            // Put them all in one array to avoid iterating through all faces multiple times.
+            if (bad) [[unlikely]] {
+                badFidx.push_back(int(i));
             }
         }
+        O.push_back({ uint(baseFidx), uint(F.size()), 0, 0 });
+    };
+
+    if (m_opts.instancing)
+    {
+        // geometry is added once in object space, refs become instances
+        for (uint i = 0; i < meshes.size(); ++i) {
+            add_mesh(i, xform::identity(), true);
+        }
+        for (size_t i = 0; i < objrefs.size(); ++i) {
+            I.push_back({ refmesh[i], objrefs[i].T });
+        }
+        if (m_opts.verbose) {
+            std::printf("%s: %zu instance(s) of %zu mesh(es)\n",
+                pscname, I.size(), meshes.size());
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < objrefs.size(); ++i) {
+            add_mesh(refmesh[i], objrefs[i].T, lastref[refmesh[i]] == i);
+        }
     }
 
     std::printf("%s: found %zu triangle(s), %zu vertices, %zu normal(s)\n",
@@ -408,10 +507,13 @@ int Scene::read_objs(const std::vector<fs::path>& objpaths)
     std::printf("%s: found %zu material(s)\n", pscname, M.size());
 #endif
 
+    const size_t oldFsize = F.size();
+    remove_degenerate_tris(badFidx);
+
     // --------------- Fix bad faces ---------------  
     if (badFidx.size() != 0)
     {
-        if (m_verbose) {
+        if (m_opts.verbose) {
             std::printf("%s: detected %zu faces "
                 "with missing information\n", pscname, badFidx.size());
         }
@@ -470,7 +572,7 @@ int Scene::read_objs(const std::vector<fs::path>& objpaths)
             }
         }
 
-        if (m_verbose) {
+        if (m_opts.verbose) {
             if (oldNVsize != NV.size()) {
                 std::printf("%s: fixed %zu missing normal IDs\n", 
                     pscname, NV.size() - oldNVsize);
@@ -487,6 +589,9 @@ int Scene::read_objs(const std::vector<fs::path>& objpaths)
 #endif
         }
     }
+    if (F.size() != oldFsize) {
+        compact_verts();
+    }
     if (F.empty() || V.empty()) {
         return mERROR("%s: no faces or vertices found\n", pscname);
     }
@@ -494,6 +599,279 @@ int Scene::read_objs(const std::vector<fs::path>& objpaths)
 }
 
 
+// Removes triangles with keep[i] == 0, preserving order.
+void Scene::remove_tris(const std::vector<char>& keep)
+{
+    assert(keep.size() == F.size());
+
+    size_t j = 0;
+    for (auto& o : O)
+    {
+        uint beg = uint(j);
+        for (size_t i = o.Fbeg; i < o.Fend; ++i) {
+            if (keep[i]) { F[j++] = F[i]; }
+        }
+        o.Fbeg = beg;
+        o.Fend = uint(j);
+    }
+    F.resize(j);
+}
+
+// Drops vertices and normals that are no longer referenced.
+void Scene::compact_verts()
+{
+    std::vector<int> Vmap(V.size(), -1);
+    std::vector<int> NVmap(NV.size(), -1);
+    for (const auto& t : F) {
+        for (int j = 0; j < 3; ++j) {
+            Vmap[t.Vidx[j]] = 0;
+            NVmap[t.NVidx[j]] = 0;
+        }
+    }
+
+    auto compact = [](std::vector<vec3>& arr, std::vector<int>& map)
+    {
+        int n = 0;
+        for (size_t i = 0; i < arr.size(); ++i) {
+            if (map[i] == 0) {
+                arr[n] = arr[i];
+                map[i] = n++;
+            }
+        }
+        arr.resize(n);
+    };
+    compact(V, Vmap);
+    compact(NV, NVmap);
+    // keep vertex sources in step. vertices added since (LOD)
+    // have none, and then refitting is not possible
+    if (m_Vsrc.size() == Vmap.size())
+    {
+        for (size_t i = 0; i < Vmap.size(); ++i) {
+            if (Vmap[i] >= 0) {
+                m_Vsrc[Vmap[i]] = m_Vsrc[i];
+                m_Vxf[Vmap[i]] = m_Vxf[i];
+            }
+        }
+        m_Vsrc.resize(V.size());
+        m_Vxf.resize(V.size());
+    }
+    else {
+        m_Vsrc.clear();
+        m_Vxf.clear();
+    }
+
+    for (auto& t : F) {
+        for (int j = 0; j < 3; ++j) {
+            t.Vidx[j] = Vmap[t.Vidx[j]];
+            t.NVidx[j] = NVmap[t.NVidx[j]];
+        }
+    }
+}
+
+// Removes triangles that can never be hit: repeated vertex indices,
+// zero area in 16.16 fixed point (what the FPGA sees), and duplicates
+// of an earlier triangle with the same vertices (in any order).
+// Indices in fixidx are updated to the new positions of kept
+// triangles; removed ones are dropped.
+void Scene::remove_degenerate_tris(std::vector<int>& fixidx)
+{
+    const char* pscname = m_scname.c_str();
+    const size_t n = F.size();
+    std::vector<char> keep(n);
+    std::vector<uint64_t> hashes(n);
+
+    // twice the area of a triangle, in square fixed-point units
+    auto area2_fixedpt = [&](const tri& t)
+    {
+        constexpr double scale = 1 << 16;
+        vec3 a = V[t.Vidx[0]], b = V[t.Vidx[1]], c = V[t.Vidx[2]];
+        double q[3][3];
+        for (int k = 0; k < 3; ++k) {
+            q[0][k] = std::round(a[k] * scale);
+            q[1][k] = std::round(b[k] * scale);
+            q[2][k] = std::round(c[k] * scale);
+        }
+        double e0[3], e1[3];
+        for (int k = 0; k < 3; ++k) {
+            e0[k] = q[1][k] - q[0][k];
+            e1[k] = q[2][k] - q[0][k];
+        }
+        double cx = e0[1] * e1[2] - e0[2] * e1[1];
+        double cy = e0[2] * e1[0] - e0[0] * e1[2];
+        double cz = e0[0] * e1[1] - e0[1] * e1[0];
+        return std::sqrt(cx * cx + cy * cy + cz * cz);
+    };
+
+    size_t ndegen = 0;
+    {
+        std::atomic<size_t> count = 0;
+        parallel_for(n, [&](size_t i)
+        {
+            std::array<int, 3> idx = F[i].Vidx;
+            std::sort(idx.begin(), idx.end());
+            bool degen = idx[0] == idx[1] || idx[1] == idx[2] ||
+                area2_fixedpt(F[i]) < 1;
+            keep[i] = !degen;
+            if (degen) { count++; }
+
+            uint64_t h = 0xcbf29ce484222325ull;
+            for (int v : idx) {
+                h = (h ^ uint(v)) * 0x100000001b3ull;
+                h ^= h >> 29;
+            }
+            hashes[i] = h;
+        }, 4096);
+        ndegen = count;
+    }
+
+    // Duplicates. Triangles are split into shards by hash and each shard
+    // is checked by one thread. Shards are scanned in order, so the first
+    // of a set of duplicates is the one kept.
+    const size_t nshards = num_threads() * 4;
+    std::vector<std::vector<uint>> shards(nshards);
+    for (size_t i = 0; i < n; ++i) {
+        if (keep[i]) { shards[hashes[i] % nshards].push_back(uint(i)); }
+    }
+
+    struct idx_hash {
+        size_t operator()(const std::array<int, 3>& a) const noexcept {
+            return size_t(a[0]) * 73856093u ^ size_t(a[1]) * 19349663u ^ size_t(a[2]) * 83492791u;
+        }
+    };
+    std::atomic<size_t> ndup = 0;
+    parallel_for(nshards, [&](size_t s)
+    {
+        std::unordered_set<std::array<int, 3>, idx_hash> seen;
+        seen.reserve(shards[s].size());
+        for (uint i : shards[s])
+        {
+            std::array<int, 3> idx = F[i].Vidx;
+            std::sort(idx.begin(), idx.end());
+            if (!seen.insert(idx).second) {
+                keep[i] = 0;
+                ndup++;
+            }
+        }
+    });
+
+    if (ndegen == 0 && ndup == 0) {
+        return;
+    }
+
+    // new index of each kept triangle
+    std::vector<int> newidx(n, -1);
+    int j = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (keep[i]) { newidx[i] = j++; }
+    }
+    for (int& i : fixidx) { i = newidx[i]; }
+    std::erase_if(fixidx, [](int i) { return i < 0; });
+
+    remove_tris(keep);
+    std::printf("%s: removed %zu degenerate and %zu duplicate triangle(s)\n",
+        pscname, ndegen, size_t(ndup));
+}
+
+static inline bool bbox_overlaps(const bbox& a, const bbox& b)
+{
+    for (int k = 0; k < 3; ++k) {
+        if (a.cmax[k] < b.cmin[k] || b.cmax[k] < a.cmin[k]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Conservative culling. A triangle is kept if its bbox touches the
+// view frustum (pushed out by cull_margin), or if it could block a
+// shadow ray from a visible point to a light. Shadow rays lie within the
+// bbox of the visible geometry extended to include the light.
+int Scene::cull_tris()
+{
+    const char* pscname = m_scname.c_str();
+    if (!I.empty()) {
+        return mERROR("%s: culling is not supported with instancing", pscname);
+    }
+
+    // Image plane extents as in BV_report(), which stretches u by the
+    // aspect ratio. Take the larger of the two to be safe.
+    float aspratio = float(R.first) / R.second;
+    float hu = std::max(1.f, aspratio) * C.width / 2;
+    float hv = C.height / 2;
+    vec3 fwd = -C.focal_len * C.w;
+
+    vec3 corners[4] = {
+        fwd + hu * C.u + hv * C.v,
+        fwd - hu * C.u + hv * C.v,
+        fwd - hu * C.u - hv * C.v,
+        fwd + hu * C.u - hv * C.v };
+
+    // inward-facing side planes through the eye
+    vec3 planes[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        planes[i] = corners[i].cross(corners[(i + 1) % 4]).normalized();
+        if (planes[i].dot(fwd) < 0) {
+            planes[i] = -1 * planes[i];
+        }
+    }
+
+    auto in_frustum = [&](const bbox& bb)
+    {
+        for (const auto& n : planes)
+        {
+            // corner furthest along n
+            vec3 pv = {
+                n[0] >= 0 ? bb.cmax[0] : bb.cmin[0],
+                n[1] >= 0 ? bb.cmax[1] : bb.cmin[1],
+                n[2] >= 0 ? bb.cmax[2] : bb.cmin[2] };
+            if (n.dot(pv - C.eye) < -m_opts.cull_margin) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    const uint old_nserial = nserial();
+    const size_t old_ntris = F.size();
+
+    std::vector<char> keep(F.size());
+    bbox visbb;
+    for (size_t i = 0; i < F.size(); ++i)
+    {
+        keep[i] = in_frustum(F[i].bb);
+        if (keep[i]) {
+            visbb.cmin = visbb.cmin.cwiseMin(F[i].bb.cmin);
+            visbb.cmax = visbb.cmax.cwiseMax(F[i].bb.cmax);
+        }
+    }
+
+    std::vector<bbox> shadowbbs;
+    for (const auto& lt : L)
+    {
+        bbox sbb = visbb;
+        sbb.cmin = sbb.cmin.cwiseMin(lt.pos);
+        sbb.cmax = sbb.cmax.cwiseMax(lt.pos);
+        shadowbbs.push_back(sbb);
+    }
+    for (size_t i = 0; i < F.size(); ++i)
+    {
+        for (size_t j = 0; j < shadowbbs.size() && !keep[i]; ++j) {
+            keep[i] = bbox_overlaps(F[i].bb, shadowbbs[j]);
+        }
+    }
+
+    remove_tris(keep);
+    if (F.empty()) {
+        return mERROR("%s: no triangles left after culling", pscname);
+    }
+    compact_verts();
+
+    std::printf("%s: culled %zu of %zu triangle(s), %u bytes\n", pscname,
+        old_ntris - F.size(), old_ntris, (old_nserial - nserial()) * 4);
+    return 0;
+}
+
 // Gather bboxes at stop_depth, and sort triangles in order of bboxes.
 void Scene::gather_bvs(tri* tris_beg, tri* tris_end, uint depth)
 {
@@ -516,57 +894,693 @@ void Scene::gather_bvs(tri* tris_beg, tri* tris_end, uint depth)
     else { BV.emplace_back(std::move(bb), uint(ntris)); }
 }
 
+// Bounds of the part of t on one side of the plane x[axis] = c, 
+// within its current bounds.
+static bbox clip_tri_bbox(const std::vector<vec3>& V, const tri& t,
+    int axis, float c, bool left)
+{
+    bbox bb;
+    auto add = [&](const vec3& p) {
+        bb.cmin = bb.cmin.cwiseMin(p);
+        bb.cmax = bb.cmax.cwiseMax(p);
+    };
+    auto inside = [&](const vec3& p) {
+        return left ? p[axis] <= c : p[axis] >= c;
+    };
+    for (int i = 0; i < 3; ++i)
+    {
+        const vec3& a = V[t.Vidx[i]];
+        const vec3& b = V[t.Vidx[(i + 1) % 3]];
+        if (inside(a)) { add(a); }
+        if (inside(a) != inside(b))
+        {
+            vec3 p = a + (c - a[axis]) / (b[axis] - a[axis]) * (b - a);
+            p[axis] = c;
+            add(p);
+        }
+    }
+    bb.cmin = bb.cmin.cwiseMax(t.bb.cmin);
+    bb.cmax = bb.cmax.cwiseMin(t.bb.cmax);
+    return bb;
+}
+
+// Like gather_bvs, but a node may instead be split with a plane,
+// referencing the triangles that cross it from both sides with clipped
+// bounds (as in SBVH). That is done when it lowers the SAH cost and
+// the node's share of the duplication budget allows it. Leaves are
+// appended to out.
+void Scene::gather_bvs_split(std::vector<tri>&& tris, uint depth, 
+    size_t budget, std::vector<tri>& out)
+{
+    bbox bb = get_nodes_bbox(tris.data(), tris.data() + tris.size());
+    const size_t ntris = tris.size();
+    if (depth == m_bv_stop_depth)
+    {
+        BV.emplace_back(std::move(bb), uint(ntris));
+        out.insert(out.end(), tris.begin(), tris.end());
+        return;
+    }
+
+    const int max_dim = (bb.cmax - bb.cmin).maxDim();
+    std::sort(tris.begin(), tris.end(), [=](const auto& lhs, const auto& rhs) {
+        return lhs.bb.center()[max_dim] < rhs.bb.center()[max_dim]; });
+
+    const size_t lhs_size = ntris / 2;
+    assert(lhs_size != 0 && "should not be possible");
+
+    // object split
+    bbox lbb = get_nodes_bbox(tris.data(), tris.data() + lhs_size);
+    bbox rbb = get_nodes_bbox(tris.data() + lhs_size, tris.data() + ntris);
+    float obj_cost = lbb.area() * lhs_size + rbb.area() * (ntris - lhs_size);
+
+    // spatial split at the same position
+    const float c = tris[lhs_size].bb.center()[max_dim];
+    std::vector<tri> ltris, rtris;
+    ltris.reserve(lhs_size);
+    rtris.reserve(ntris - lhs_size);
+    bbox slbb, srbb;
+    for (const auto& t : tris)
+    {
+        if (t.bb.cmax[max_dim] <= c) { ltris.push_back(t); }
+        else if (t.bb.cmin[max_dim] >= c) { rtris.push_back(t); }
+        else
+        {
+            ltris.push_back(t);
+            ltris.back().bb = clip_tri_bbox(V, t, max_dim, c, true);
+            rtris.push_back(t);
+            rtris.back().bb = clip_tri_bbox(V, t, max_dim, c, false);
+        }
+    }
+    for (const auto& t : ltris) {
+        slbb.cmin = slbb.cmin.cwiseMin(t.bb.cmin);
+        slbb.cmax = slbb.cmax.cwiseMax(t.bb.cmax);
+    }
+    for (const auto& t : rtris) {
+        srbb.cmin = srbb.cmin.cwiseMin(t.bb.cmin);
+        srbb.cmax = srbb.cmax.cwiseMax(t.bb.cmax);
+    }
+    const size_t ndup = ltris.size() + rtris.size() - ntris;
+    float split_cost = slbb.area() * ltris.size() + srbb.area() * rtris.size();
+
+    // both sides still need a triangle for each of their leaves
+    const size_t min_side = size_t(1) << (m_bv_stop_depth - depth - 1);
+    if (ndup > 0 && ndup <= budget && split_cost < obj_cost &&
+        ltris.size() >= min_side && rtris.size() >= min_side)
+    {
+        budget -= ndup;
+        m_nsplit_refs += ndup;
+        size_t lbudget = budget * ltris.size() / (ltris.size() + rtris.size());
+        gather_bvs_split(std::move(ltris), depth + 1, lbudget, out);
+        gather_bvs_split(std::move(rtris), depth + 1, budget - lbudget, out);
+        return;
+    }
+
+    ltris.assign(tris.begin(), tris.begin() + lhs_size);
+    rtris.assign(tris.begin() + lhs_size, tris.end());
+    tris = {};
+    size_t lbudget = budget / 2;
+    gather_bvs_split(std::move(ltris), depth + 1, lbudget, out);
+    gather_bvs_split(std::move(rtris), depth + 1, budget - lbudget, out);
+}
+
+// Depth at which to stop splitting ntris triangles.
+static uint bv_stop_depth(const uint max_bv, size_t ntris)
+{
+    uint depth = ulog2(max_bv);
+    uint last_full_depth = ntris > 1 ? uint(ulog2(ntris)) : 0;
+
+    // limit to one before last so that bvs are never empty
+    if (depth >= last_full_depth && depth != 0) {
+        depth = last_full_depth > 0 ? last_full_depth - 1 : 0;
+    }
+    return depth;
+}
+
 int Scene::init_bvs(const uint max_bv)
 {
     if (!is_powof2(max_bv)) {
         return mERROR("max-bv is not a power of 2");
     }
 
-    m_bv_stop_depth = ulog2(max_bv);
-    uint last_full_depth = uint(ulog2(F.size()));
+    const bool split = m_opts.split_budget > 0;
+    std::vector<tri> splitF; // with spatial splits, F is rebuilt here
+    m_nsplit_refs = 0;
 
-    // limit to one before last so that bvs are never empty
-    if (m_bv_stop_depth >= last_full_depth && m_bv_stop_depth != 0) {
-        m_bv_stop_depth = last_full_depth - 1;
+    if (I.empty())
+    {
+        m_bv_stop_depth = bv_stop_depth(max_bv, F.size());
+        if (split)
+        {
+            size_t budget = size_t(m_opts.split_budget * F.size());
+            gather_bvs_split(std::move(F), 0, budget, splitF);
+            F = std::move(splitF);
+        }
+        else { gather_bvs(F.data(), F.data() + F.size()); }
+
+        // everything is in world space, so this is one object now
+        O = { { 0, uint(F.size()), 0, uint(BV.size()) } };
+
+        if (m_opts.verbose) {
+            std::printf("%s: collected %zu BV(s) at depth %u\n",
+                m_scname.c_str(), BV.size(), m_bv_stop_depth);
+        }
+    }
+    else
+    {
+        // share the BV budget between objects by triangle count
+        for (auto& o : O)
+        {
+            size_t ntris = o.Fend - o.Fbeg;
+            uint obj_max_bv = std::bit_floor(
+                std::max(uint(1), uint(uint64_t(max_bv) * ntris / F.size())));
+
+            m_bv_stop_depth = bv_stop_depth(obj_max_bv, ntris);
+            o.BVbeg = uint(BV.size());
+            if (split)
+            {
+                size_t budget = size_t(m_opts.split_budget * ntris);
+                std::vector<tri> tris(F.begin() + o.Fbeg, F.begin() + o.Fend);
+                o.Fbeg = uint(splitF.size());
+                gather_bvs_split(std::move(tris), 0, budget, splitF);
+                o.Fend = uint(splitF.size());
+            }
+            else { gather_bvs(F.data() + o.Fbeg, F.data() + o.Fend); }
+            o.BVend = uint(BV.size());
+        }
+        if (split) { F = std::move(splitF); }
+
+        if (m_opts.verbose) {
+            std::printf("%s: collected %zu BV(s) for %zu object(s)\n",
+                m_scname.c_str(), BV.size(), O.size());
+        }
+    }
+    if (split) {
+        std::printf("%s: spatial splits added %zu triangle reference(s)\n",
+            m_scname.c_str(), m_nsplit_refs);
+    }
+    order_bvs();
+    m_sah_built = sah_cost();
+
+    if (m_opts.ser_fmt == serial_format::Meshlet) {
+        return build_meshlets();
+    }
+    else if (m_opts.ser_fmt == serial_format::NoDuplicate) {
+        reorder_verts();
+    }
+    return 0;
+}
+
+// Bounds of a transformed box (of its 8 corners).
+static bbox transform_bbox(const xform& T, const bbox& b)
+{
+    bbox bb;
+    for (int i = 0; i < 8; ++i)
+    {
+        vec3 corner = {
+            (i & 1) ? b.cmax[0] : b.cmin[0],
+            (i & 2) ? b.cmax[1] : b.cmin[1],
+            (i & 4) ? b.cmax[2] : b.cmin[2] };
+        vec3 wc = T.apply(corner);
+        bb.cmin = bb.cmin.cwiseMin(wc);
+        bb.cmax = bb.cmax.cwiseMax(wc);
+    }
+    return bb;
+}
+
+static float dist_to_bbox(const vec3& p, const bbox& bb)
+{
+    float d2 = 0;
+    for (int k = 0; k < 3; ++k)
+    {
+        float d = std::max({ bb.cmin[k] - p[k], 0.f, p[k] - bb.cmax[k] });
+        d2 += d * d;
+    }
+    return std::sqrt(d2);
+}
+
+// Reorders BVs within each object for early ray termination. Front
+// moves BVs (and their triangles) so the ones nearest the camera come
+// first. Octant keeps the BVs and builds a near-to-far order for each
+// ray direction octant. With instancing, an object's camera distance
+// is measured from its first instance.
+void Scene::order_bvs()
+{
+    if (m_opts.bv_ord == bv_order::Tree) {
+        return;
+    }
+
+    std::vector<uint> perm(BV.size());
+    std::iota(perm.begin(), perm.end(), 0);
+
+    if (m_opts.bv_ord == bv_order::Front)
+    {
+        std::vector<std::pair<float, float>> dist(BV.size());
+        for (size_t oi = 0; oi < O.size(); ++oi)
+        {
+            const object& o = O[oi];
+            vec3 eye = C.eye;
+            if (!I.empty())
+            {
+                auto it = ranges::find_if(I, [&](auto& inst) { return inst.obj == oi; });
+                xform Tinv;
+                if (it == I.end() || !it->T.inverse(Tinv)) { continue; }
+                eye = Tinv.apply(eye);
+            }
+            for (uint b = o.BVbeg; b < o.BVend; ++b)
+            {
+                // nearest point, then center to break ties
+                // (e.g. several BVs around the camera)
+                dist[b] = { dist_to_bbox(eye, BV[b].bb),
+                    (BV[b].bb.center() - eye).norm() };
+            }
+            std::stable_sort(perm.begin() + o.BVbeg, perm.begin() + o.BVend,
+                [&](uint l, uint r) { return dist[l] < dist[r]; });
+        }
+
+        const std::vector<uint> BVbeg = bv_tri_offsets();
+        std::vector<bv> newBV;
+        std::vector<tri> newF;
+        newBV.reserve(BV.size());
+        newF.reserve(F.size());
+        for (auto& o : O)
+        {
+            o.Fbeg = uint(newF.size());
+            for (uint b = o.BVbeg; b < o.BVend; ++b)
+            {
+                newBV.push_back(BV[perm[b]]);
+                newF.insert(newF.end(), F.begin() + BVbeg[perm[b]],
+                    F.begin() + BVbeg[perm[b] + 1]);
+            }
+            o.Fend = uint(newF.size());
+        }
+        BV = std::move(newBV);
+        F = std::move(newF);
+
+        if (m_opts.verbose) {
+            std::printf("%s: ordered BVs front to back\n", m_scname.c_str());
+        }
+    }
+    else
+    {
+        for (uint oct = 0; oct < 8; ++oct)
+        {
+            // rays going towards +x meet low x first, and so on
+            vec3 s = { (oct & 1) ? -1.f : 1.f, (oct & 2) ? -1.f : 1.f, (oct & 4) ? -1.f : 1.f };
+            auto& order = BVoct[oct];
+            order = perm;
+            for (const auto& o : O) {
+                std::stable_sort(order.begin() + o.BVbeg, order.begin() + o.BVend,
+                    [&](uint l, uint r) {
+                        return BV[l].bb.center().dot(s) < BV[r].bb.center().dot(s); });
+            }
+        }
+
+        if (m_opts.verbose) {
+            std::printf("%s: built BV orders for 8 ray octants\n", m_scname.c_str());
+        }
+    }
+}
+
+// Finds the lights that can light each BV. Lights fall off with the
+// square of the distance, so a light is dropped when even the nearest
+// point of the BV gets less than light_cutoff from it. With instancing
+// a BV is shared, so its mask covers all instances.
+int Scene::build_light_masks()
+{
+    const uint nwords = (uint(L.size()) + 31) / 32;
+    m_lightmask.assign(BV.size() * nwords, 0);
+    if (L.empty()) {
+        return 0;
+    }
+
+    std::vector<std::vector<xform>> objT(O.size());
+    if (I.empty()) {
+        objT[0].push_back(xform::identity());
+    }
+    for (const auto& inst : I) {
+        objT[inst.obj].push_back(inst.T);
+    }
+
+    // a leaf's triangles can be hit outside its box when splits clipped
+    // it, so masks go by whole triangles
+    std::vector<bbox> bounds;
+    if (m_opts.split_budget > 0) {
+        bounds = bv_tri_bounds(bv_tri_offsets());
+    }
+
+    std::atomic<size_t> nset = 0;
+    for (size_t oi = 0; oi < O.size(); ++oi)
+    {
+        const object& o = O[oi];
+        parallel_for(o.BVend - o.BVbeg, [&](size_t i)
+        {
+            const uint b = o.BVbeg + uint(i);
+            uint* mask = m_lightmask.data() + size_t(b) * nwords;
+            const bbox& bb = bounds.empty() || BV[b].ntris == 0 ? BV[b].bb : bounds[b];
+            for (const xform& T : objT[oi])
+            {
+                bbox wb = T.is_identity() ? bb : transform_bbox(T, bb);
+                for (size_t l = 0; l < L.size(); ++l)
+                {
+                    float d = dist_to_bbox(L[l].pos, wb);
+                    float intensity = std::max({ L[l].rgb[0], L[l].rgb[1], L[l].rgb[2] });
+                    if (intensity >= m_opts.light_cutoff * d * d) {
+                        mask[l / 32] |= 1u << (l % 32);
+                    }
+                }
+            }
+            size_t n = 0;
+            for (uint w = 0; w < nwords; ++w) { n += std::popcount(mask[w]); }
+            nset += n;
+        });
+    }
+
+    std::printf("%s: light masks, avg %.1f of %zu light(s) per BV\n",
+        m_scname.c_str(), double(nset) / BV.size(), L.size());
+    return 0;
+}
+
+// Average distance of vertex indices from their BV's median index,
+// averaged over BVs. Small when each BV reads a compact range.
+static double avg_index_distance(const std::vector<tri>& F,
+    const std::vector<uint>& BVbeg)
+{
+    double total = 0;
+    size_t nbvs = 0;
+    std::vector<int> idx;
+    for (size_t b = 0; b + 1 < BVbeg.size(); ++b)
+    {
+        idx.clear();
+        for (uint f = BVbeg[b]; f < BVbeg[b + 1]; ++f) {
+            idx.insert(idx.end(), F[f].Vidx.begin(), F[f].Vidx.end());
+        }
+        if (idx.empty()) { continue; }
+
+        auto mid = idx.begin() + idx.size() / 2;
+        std::nth_element(idx.begin(), mid, idx.end());
+        const int median = *mid;
+        double sum = 0;
+        for (int v : idx) { sum += std::abs(v - median); }
+        total += sum / idx.size();
+        nbvs++;
+    }
+    return nbvs ? total / nbvs : 0;
+}
+
+// Renumbers vertices, normals and UVs in order of first use by the
+// (BV-sorted) triangles, so each BV's index fetches are mostly sequential.
+void Scene::reorder_verts()
+{
+    const std::vector<uint> BVbeg = bv_tri_offsets();
+    double dist_before = avg_index_distance(F, BVbeg);
+
+    // returns the new index of each old entry
+    auto reorder = [&]<typename T, size_t N>(std::vector<T>& arr,
+        std::array<int, N> tri::* idx)
+    {
+        std::vector<int> map(arr.size(), -1);
+        std::vector<T> out;
+        out.reserve(arr.size());
+        for (auto& t : F) {
+            for (int& i : t.*idx)
+            {
+                if (map[i] < 0) {
+                    map[i] = int(out.size());
+                    out.push_back(arr[i]);
+                }
+                i = map[i];
+            }
+        }
+        arr = std::move(out);
+        return map;
+    };
+    std::vector<int> Vmap = reorder(V, &tri::Vidx);
+    if (m_Vsrc.size() == Vmap.size())
+    {
+        std::vector<int> src(V.size());
+        std::vector<uint> xf(V.size());
+        for (size_t i = 0; i < Vmap.size(); ++i) {
+            if (Vmap[i] >= 0) {
+                src[Vmap[i]] = m_Vsrc[i];
+                xf[Vmap[i]] = m_Vxf[i];
+            }
+        }
+        m_Vsrc = std::move(src);
+        m_Vxf = std::move(xf);
     }
+    reorder(NV, &tri::NVidx);
+#if ENABLE_TEXTURES
+    reorder(UV, &tri::UVidx);
+#endif
 
-    gather_bvs(F.data(), F.data() + F.size());
+    if (m_opts.verbose) {
+        std::printf("%s: reordered vertices, avg index distance "
+            "per BV %.1f -> %.1f\n", m_scname.c_str(), 
+            dist_before, avg_index_distance(F, BVbeg));
+    }
+}
 
-    if (m_verbose) {
-        std::printf("%s: collected %zu BV(s) at depth %u\n",
-            m_scname.c_str(), BV.size(), m_bv_stop_depth);
+// First triangle of each BV, plus the total at the end.
+std::vector<uint> Scene::bv_tri_offsets() const
+{
+    std::vector<uint> offs(BV.size() + 1, 0);
+    for (size_t i = 0; i < BV.size(); ++i) {
+        offs[i + 1] = offs[i] + BV[i].ntris;
+    }
+    assert(offs.back() == F.size());
+    return offs;
+}
+
+// Bounds of each BV's whole triangles. Split leaves clip BV::bb to the
+// parts of the triangles they hold.
+std::vector<bbox> Scene::bv_tri_bounds(const std::vector<uint>& BVbeg) const
+{
+    std::vector<bbox> out(BV.size());
+    for (size_t b = 0; b < BV.size(); ++b)
+    {
+        for (uint f = BVbeg[b]; f < BVbeg[b + 1]; ++f)
+        {
+            const bbox tb = get_tri_bbox(V, F[f].Vidx);
+            out[b].cmin = out[b].cmin.cwiseMin(tb.cmin);
+            out[b].cmax = out[b].cmax.cwiseMax(tb.cmax);
+        }
     }
+    return out;
+}
+
+// Edge setup for the FPGA's ray-triangle tests, done once per triangle 
+// here instead of once per test. Uses the same positions the FPGA
+// gets, so quantized geometry and the edges agree. Everything is
+// converted to 16.16 here, so serializing the section is a copy and
+// the time reported covers it.
+int Scene::build_isect_data()
+{
+    auto tbeg = chrono::high_resolution_clock::now();
+
+    const std::vector<uint> BVbeg = bv_tri_offsets();
+    m_isect.resize(F.size());
+    std::atomic<size_t> ndegen = 0;
+    parallel_for(BV.size(), [&](size_t b)
+    {
+        for (uint f = BVbeg[b]; f < BVbeg[b + 1]; ++f)
+        {
+            tri_isect::fixed3 q[3];
+            for (int j = 0; j < 3; ++j)
+            {
+                const vec3& v = V[F[f].Vidx[j]];
+                const vec3 p = m_opts.quantize ?
+                    dequantize_pos(uint(b), quantize_pos(uint(b), v)) : v;
+                p.serialize(q[j].data());
+            }
+            tri_isect& ti = m_isect[f];
+            ti.v0 = q[0];
+            for (int k = 0; k < 3; ++k)
+            {
+                ti.e1[k] = q[1][k] - q[0][k];
+                ti.e2[k] = q[2][k] - q[0][k];
+            }
+            // from the fixed-point edges, with exact products; edges that
+            // rounded onto one line get a zero normal
+            double c[3];
+            bool zero = true;
+            for (int k = 0; k < 3; ++k)
+            {
+                const int k1 = (k + 1) % 3, k2 = (k + 2) % 3;
+                const int64_t a = int64_t(int(ti.e1[k1])) * int(ti.e2[k2]);
+                const int64_t b = int64_t(int(ti.e1[k2])) * int(ti.e2[k1]);
+                c[k] = double(a) - double(b);
+                zero = zero && a == b;
+            }
+            const double len = std::sqrt(c[0] * c[0] + c[1] * c[1] + c[2] * c[2]);
+            if (zero || !(len > 0))
+            {
+                ti.n = {};
+                ndegen++;
+                continue;
+            }
+            for (int k = 0; k < 3; ++k) {
+                ti.n[k] = to_fixedpt(float(c[k] / len));
+            }
+        }
+    });
+
+    auto tend = chrono::high_resolution_clock::now();
+    uint nsec = vnserial(m_isect);
+    uint ntotal = nserial();
+    std::printf("%s: precomputed intersection data in ", m_scname.c_str());
+    print_duration(std::cout << std::flush, tend - tbeg);
+    std::printf(", +%u KB (%.1f%% of scene)", nsec * 4 / 1024,
+        100.0 * nsec / ntotal);
+    if (ndegen > 0) {
+        std::printf(", %zu degenerate triangle(s) with a zero normal", size_t(ndegen));
+    }
+    std::printf("\n");
     return 0;
 }
 
-Scene::Scene(const fs::path& scpath, const uint max_bv, serial_format ser_fmt, bool verbose) :
+Scene::Scene(const fs::path& scpath, const scene_opts& opts) :
     C{}, R(0, 0), m_scname(scpath.filename().string()), 
-    m_serfmt(ser_fmt), m_verbose(verbose), m_ok(false)
+    m_opts(opts), m_nsplit_refs(0), m_qshift(0),
+    m_sah_built(0), m_ok(false)
 {
-    std::vector<fs::path> objpaths;
+    std::vector<obj_ref> objrefs;
     m_ok = 
-        read_scenefile(scpath, objpaths) == 0 &&
-        read_objs(objpaths) == 0 &&
-        init_bvs(max_bv) == 0;
+        read_scenefile(scpath, objrefs) == 0 &&
+        apply_view_opts() == 0 &&
+        read_objs(objrefs) == 0 &&
+        (!m_opts.cull || cull_tris() == 0) &&
+        (m_opts.tri_budget == 0 || simplify_tris(m_opts.tri_budget) == 0) &&
+        init_bvs(m_opts.max_bv) == 0 &&
+        (!m_opts.quantize || quantize_geometry() == 0) &&
+        (!m_opts.isect_data || build_isect_data() == 0) &&
+        (m_opts.light_cutoff == 0 || build_light_masks() == 0) &&
+        (m_opts.shadow_samples == 0 || build_shadow_masks() == 0);
+}
+
+int Scene::apply_view_opts()
+{
+    for (const auto& prop : m_opts.camera_props)
+    {
+        const char* err = "unrecognized camera prop";
+        if (parse_camera_prop(prop, C, err) <= 0) {
+            return mERROR("%s: %s '%s'", m_scname.c_str(), err, prop.c_str());
+        }
+    }
+    if (m_opts.res.first != 0) {
+        R = m_opts.res;
+    }
+    return 0;
+}
+
+bbox Scene::inst_bbox(const instance& inst) const
+{
+    const object& o = O[inst.obj];
+    bbox obb;
+    for (uint i = o.BVbeg; i < o.BVend; ++i)
+    {
+        obb.cmin = obb.cmin.cwiseMin(BV[i].bb.cmin);
+        obb.cmax = obb.cmax.cwiseMax(BV[i].bb.cmax);
+    }
+    return transform_bbox(inst.T, obb);
 }
 
-// magic, resX, resY, numL, numBV, camOff, BVoff, 
-// Voff, NVoff, Foff, NFoff, MFoff, Moff, Loff, optional: UVoff, UFoff
-static constexpr int nhdr_noduplicate = 14 + 2 * textures_enabled();
+std::vector<std::pair<serial_ext, uint>> Scene::ext_sections() const
+{
+    std::vector<std::pair<serial_ext, uint>> ext;
+    if (!I.empty()) {
+        ext.emplace_back(serial_ext::Instances, 1 + uint(I.size()) * instance::nserial);
+    }
+    if (m_opts.quantize) {
+        ext.emplace_back(serial_ext::Quantization, 1 + uint(BV.size()) * 3);
+    }
+    if (!m_isect.empty()) {
+        ext.emplace_back(serial_ext::TriIsect, vnserial(m_isect));
+    }
+    if (!BVoct[0].empty()) {
+        ext.emplace_back(serial_ext::BVOrder, 9 * uint(BV.size()));
+    }
+    if (!m_lightmask.empty()) {
+        ext.emplace_back(serial_ext::LightMask, uint(m_lightmask.size()));
+    }
+    if (!m_shadowmask.empty()) {
+        ext.emplace_back(serial_ext::ShadowMask, uint(m_shadowmask.size()));
+    }
+    return ext;
+}
+
+uint* Scene::serialize_ext(serial_ext ext, uint* p) const
+{
+    switch (ext)
+    {
+    case serial_ext::Instances:
+        *p++ = uint(I.size());
+        for (const auto& inst : I)
+        {
+            const object& o = O[inst.obj];
+            xform Tinv;
+            [[maybe_unused]] bool ok = inst.T.inverse(Tinv);
+            assert(ok && "singular instance transform");
+
+            *p++ = o.BVbeg;
+            *p++ = o.BVend - o.BVbeg;
+            inst.T.serialize(p); p += xform::nserial;
+            Tinv.serialize(p); p += xform::nserial;
+            inst_bbox(inst).serialize(p); p += bbox::nserial;
+        }
+        break;
+
+    case serial_ext::Quantization:
+        *p++ = m_qshift;
+        for (const auto& origin : m_qorigin) {
+            for (int64_t c : origin) { *p++ = uint(c); }
+        }
+        break;
+
+    case serial_ext::TriIsect:
+        p = vserialize(m_isect, p);
+        break;
+
+    case serial_ext::BVOrder:
+    {
+        auto offs = bv_tri_offsets();
+        p = std::copy(offs.begin(), offs.end() - 1, p);
+        for (const auto& order : BVoct) {
+            p = ranges::copy(order, p).out;
+        }
+        break;
+    }
+
+    case serial_ext::LightMask:
+        p = ranges::copy(m_lightmask, p).out;
+        break;
+
+    case serial_ext::ShadowMask:
+        p = ranges::copy(m_shadowmask, p).out;
+        break;
+    }
+    return p;
+}
 
-// magic, resX, resY, numL, numBV, camOff, BVoff, 
-// FVoff, FNVoff, FMoff, Loff, optional: FUVoff
-static constexpr int nhdr_duplicate = 11 + textures_enabled();
+// size of optional section directory
+static uint ext_dir_nserial(const std::vector<std::pair<serial_ext, uint>>& ext)
+{
+    return ext.empty() ? 0 : 1 + 2 * uint(ext.size());
+}
 
 uint Scene::nserial() const
 {
-    uint ret = 0;
-    switch (m_serfmt)
+    auto ext = ext_sections();
+    uint ret = ext_dir_nserial(ext);
+    for (auto& [id, n] : ext) { ret += n; }
+
+    switch (m_opts.ser_fmt)
     {
     case serial_format::Duplicate:
-        ret = nhdr_duplicate + camera::nserial +
+        ret += nhdr_duplicate + camera::nserial +
             vnserial(BV) +
-            (uint(F.size()) * (6 * vec3::nserial + mat::nserial)) +
+            dup_fv_nserial(F.size(), m_opts.quantize) +
+            dup_fnv_nserial(F.size(), m_opts.quantize) +
+            (uint(F.size()) * mat::nserial) +
             vnserial(L);
 #if ENABLE_TEXTURES
         ret += (uint(F.size()) * 3 * uv::nserial);
@@ -575,59 +1589,85 @@ uint Scene::nserial() const
 
     case serial_format::NoDuplicate:
     
-        ret = nhdr_noduplicate + camera::nserial +
+        ret += nhdr_noduplicate + camera::nserial +
             vnserial(BV) + vnserial(V) + vnserial(NV) +
             vnserial(F) + vnserial(M) + vnserial(L);
 #if ENABLE_TEXTURES
         ret += vnserial(UV);
 #endif
         break;
+
+    case serial_format::Meshlet:
+        ret += nhdr_meshlet + camera::nserial + vnserial(BV) +
+            uint(ML.size()) * meshlet::nhdr + vnserial(M) + vnserial(L);
+        for (const auto& ml : ML) { ret += ml.ndata(m_opts.quantize); }
+        break;
     }
     return ret;
 }
 
 void Scene::serialize(uint* p) const
 {
-    if (m_verbose) {
+    if (m_opts.verbose) {
+        static constexpr const char* fmtnames[] = { "duplicate", "no duplicate", "meshlet" };
         std::printf("%s: serialization format is %s\n", m_scname.c_str(), 
-            m_serfmt == serial_format::Duplicate ? "duplicate" : "no duplicate");
+            fmtnames[int(m_opts.ser_fmt)]);
     }
 
+    auto ext = ext_sections();
+    auto write_ext_dir = [&](uint& off)
+    {
+        if (ext.empty()) { return; }
+        *p++ = uint(ext.size());
+        for (auto& [id, n] : ext) {
+            *p++ = uint(id);
+            *p++ = off; off += n;
+        }
+    };
+
     *p++ = MAGIC;
     *p++ = R.first;
     *p++ = R.second;
     *p++ = uint(L.size());
     *p++ = uint(BV.size());
      
-    switch (m_serfmt)
+    switch (m_opts.ser_fmt)
     {
     case serial_format::Duplicate:
     {
-        uint off = nhdr_duplicate;
+        uint off = nhdr_duplicate + ext_dir_nserial(ext);
         *p++ = off; off += camera::nserial;
         *p++ = off; off += vnserial(BV);
-        *p++ = off; off += (uint(F.size()) * 3 * vec3::nserial);
-        *p++ = off; off += (uint(F.size()) * 3 * vec3::nserial);
+        *p++ = off; off += dup_fv_nserial(F.size(), m_opts.quantize);
+        *p++ = off; off += dup_fnv_nserial(F.size(), m_opts.quantize);
         *p++ = off; off += (uint(F.size()) * mat::nserial);
         *p++ = off; off += vnserial(L);
 #if ENABLE_TEXTURES
         * p++ = off; off += (uint(F.size()) * 3 * uv::nserial);
 #endif
+        write_ext_dir(off);
+
         C.serialize(p);
         p += camera::nserial;
 
         p = vserialize(BV, p);
 
-        for (size_t i = 0; i < F.size(); ++i) {
-            for (int j = 0; j < 3; ++j) {
-                V[F[i].Vidx[j]].serialize(p);
-                p += vec3::nserial;
-            }
+        if (m_opts.quantize) {
+            p = serialize_quantized_dup(p);
         }
-        for (size_t i = 0; i < F.size(); ++i) {
-            for (int j = 0; j < 3; ++j) {
-                NV[F[i].NVidx[j]].serialize(p);
-                p += vec3::nserial;
+        else
+        {
+            for (size_t i = 0; i < F.size(); ++i) {
+                for (int j = 0; j < 3; ++j) {
+                    V[F[i].Vidx[j]].serialize(p);
+                    p += vec3::nserial;
+                }
+            }
+            for (size_t i = 0; i < F.size(); ++i) {
+                for (int j = 0; j < 3; ++j) {
+                    NV[F[i].NVidx[j]].serialize(p);
+                    p += vec3::nserial;
+                }
             }
         }
         for (size_t i = 0; i < F.size(); ++i) {
@@ -650,7 +1690,7 @@ void Scene::serialize(uint* p) const
 
     case serial_format::NoDuplicate:
     {
-        uint off = nhdr_noduplicate;
+        uint off = nhdr_noduplicate + ext_dir_nserial(ext);
         *p++ = off; off += camera::nserial;
         *p++ = off; off += vnserial(BV);
         *p++ = off; off += vnserial(V);
@@ -664,6 +1704,8 @@ void Scene::serialize(uint* p) const
         * p++ = off; off += vnserial(UV);
         *p++ = off; off += (uint(F.size()) * 3);
 #endif
+        write_ext_dir(off);
+
         C.serialize(p);
         p += camera::nserial;
 
@@ -691,6 +1733,48 @@ void Scene::serialize(uint* p) const
 #endif
         break;
     }
+
+    case serial_format::Meshlet:
+    {
+        *p++ = uint(ML.size());
+        uint off = nhdr_meshlet + ext_dir_nserial(ext);
+        *p++ = off; off += camera::nserial;
+        *p++ = off; off += vnserial(BV);
+        *p++ = off; off += uint(ML.size()) * meshlet::nhdr;
+        uint MLdata_off = off;
+        for (const auto& ml : ML) { off += ml.ndata(m_opts.quantize); }
+        *p++ = off; off += vnserial(M);
+        *p++ = off; off += vnserial(L);
+        write_ext_dir(off);
+
+        C.serialize(p);
+        p += camera::nserial;
+
+        p = vserialize(BV, p);
+
+        for (const auto& ml : ML)
+        {
+            *p++ = MLdata_off; MLdata_off += ml.ndata(m_opts.quantize);
+            *p++ = ml.Fend - ml.Fbeg;
+            *p++ = uint(ml.V.size());
+            *p++ = uint(ml.NV.size());
+#if ENABLE_TEXTURES
+            *p++ = uint(ml.UV.size());
+#endif
+            *p++ = ml.idxbits;
+        }
+        for (const auto& ml : ML) {
+            p = serialize_meshlet(ml, p);
+        }
+
+        p = vserialize(M, p);
+        p = vserialize(L, p);
+        break;
+    }
+    }
+
+    for (auto& [id, n] : ext) {
+        p = serialize_ext(id, p);
     }
 }
 
@@ -0,0 +1,269 @@
+#include <atomic>
+#include <random>
+
+#include "defs.hpp"
+
+// Shadow rays run from p (t = 0) to the light (t = 1); hits outside
+// (tmin, tmax) don't count, on the FPGA either.
+static constexpr float tmin = 1e-4f, tmax = 1 - 1e-4f;
+
+// Proofs give up (leaving the pair to trace) after this many
+// triangle-triangle tests.
+static constexpr size_t max_proof_work = size_t(1) << 16;
+
+// Shadow ray from p towards a light at lpos.
+// Returns true if any triangle other than skip blocks it.
+static bool occluded(const Scene& sc, const std::vector<uint>& BVbeg,
+    const vec3& p, const vec3& lpos, uint skip)
+{
+    const vec3 dir = lpos - p;
+    for (uint b = 0; b < sc.BV.size(); ++b)
+    {
+        float t_near;
+        if (!ray_hits_bbox(p, dir, sc.BV[b].bb, t_near) || t_near > tmax) {
+            continue;
+        }
+        for (uint f = BVbeg[b]; f < BVbeg[b + 1]; ++f)
+        {
+            if (f == skip) { continue; }
+            const tri& t = sc.F[f];
+            float th = ray_tri(p, dir, sc.V[t.Vidx[0]], sc.V[t.Vidx[1]], sc.V[t.Vidx[2]]);
+            if (th > tmin && th < tmax) { return true; }
+        }
+    }
+    return false;
+}
+
+static std::array<vec3, 8> corners(const bbox& bb)
+{
+    std::array<vec3, 8> c;
+    for (int i = 0; i < 8; ++i) {
+        for (int k = 0; k < 3; ++k) {
+            c[i][k] = (i >> k & 1) ? bb.cmax[k] : bb.cmin[k];
+        }
+    }
+    return c;
+}
+
+// Whether box b may overlap the shaft, the convex hull of box r and the
+// light at l. Separating planes tried: the shaft's bounding box and the
+// planes through l and each edge of r that have all of r on one side.
+// It may answer yes for boxes that miss the shaft, never the reverse.
+static bool shaft_overlaps(const bbox& r, const vec3& l, const bbox& b)
+{
+    const vec3 hmin = r.cmin.cwiseMin(l), hmax = r.cmax.cwiseMax(l);
+    for (int k = 0; k < 3; ++k) {
+        if (b.cmin[k] > hmax[k] || b.cmax[k] < hmin[k]) { return false; }
+    }
+
+    const auto rc = corners(r), bc = corners(b);
+    const float size = (hmax - hmin).norm();
+    for (int c = 0; c < 8; ++c)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            if (c >> k & 1) { continue; }
+            const vec3 n = (rc[c] - l).cross(rc[c | 1 << k] - l);
+            const float eps = 1e-4f * n.norm() * size;
+            float rmin = INFINITY, rmax = -INFINITY, bmin = INFINITY, bmax = -INFINITY;
+            for (int i = 0; i < 8; ++i)
+            {
+                const float dr = n.dot(rc[i] - l), db = n.dot(bc[i] - l);
+                rmin = std::min(rmin, dr);
+                rmax = std::max(rmax, dr);
+                bmin = std::min(bmin, db);
+                bmax = std::max(bmax, db);
+            }
+            if ((rmin >= 0 && bmax < -eps) || (rmax <= 0 && bmin > eps)) { return false; }
+        }
+    }
+    return true;
+}
+
+// Whether triangle o can't block any shadow ray from a point of triangle
+// r to l: either o lies behind r's plane as seen from the light (so any
+// hit is at t < tmin), or r and the light are strictly on the same side
+// of o's plane.
+static bool cannot_shadow(const std::array<vec3, 3>& r, const std::array<vec3, 3>& o,
+    const vec3& l)
+{
+    const vec3 nr = (r[1] - r[0]).cross(r[2] - r[0]);
+    const float dl = nr.dot(l - r[0]);
+    if (dl != 0)
+    {
+        bool behind = true;
+        for (const vec3& v : o) {
+            behind = behind && (dl > 0 ? 1 : -1) * nr.dot(v - r[0]) <= 0.5f * tmin * std::abs(dl);
+        }
+        if (behind) { return true; }
+    }
+
+    const vec3 no = (o[1] - o[0]).cross(o[2] - o[0]);
+    const float dlo = no.dot(l - o[0]);
+    for (const vec3& v : r) {
+        if (!(no.dot(v - o[0]) * dlo > 0)) { return false; }
+    }
+    return true;
+}
+
+// Whether triangle o blocks every shadow ray from box r to l: r and the
+// light are strictly on opposite sides of o's plane, and every corner of
+// r seen from the light falls inside o. Projecting from the light keeps
+// convex sets convex, so then the whole box does.
+static bool covers(const std::array<vec3, 3>& o, const std::array<vec3, 8>& rc,
+    const vec3& l)
+{
+    const vec3 n = (o[1] - o[0]).cross(o[2] - o[0]);
+    const float dl = n.dot(l - o[0]);
+    for (const vec3& c : rc)
+    {
+        const float dc = n.dot(c - o[0]);
+        if (!(dc * dl < 0)) { return false; }
+        // t is monotonic in dc, so the box's rays hit between the corners'
+        const float t = dc / (dc - dl);
+        if (t <= 2 * tmin || t >= 1 - 2 * tmin) { return false; }
+
+        const vec3 x = c + t * (l - c);
+        for (int e = 0; e < 3; ++e) {
+            if (n.dot((o[(e + 1) % 3] - o[e]).cross(x - o[e])) <= 1e-4f * n.dot(n)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Classifies each (BV, light) pair by what can be proven about the
+// shaft between the BV's triangles and the light:
+//  - lit if no triangle that may overlap the shaft can block a ray from
+//    any of the BV's triangles,
+//  - occluded if a single triangle blocks every ray from the BV's box,
+//  - otherwise left for the FPGA to trace.
+// Shadow rays from the BV's vertices and random points on it (up to
+// shadow_samples) only serve to give up early on pairs that are mixed.
+int Scene::build_shadow_masks()
+{
+    const char* pscname = m_scname.c_str();
+    if (!I.empty()) {
+        return mERROR("%s: shadow masks are not supported with instancing", pscname);
+    }
+
+    auto tbeg = chrono::high_resolution_clock::now();
+
+    const std::vector<uint> BVbeg = bv_tri_offsets();
+    const size_t nL = L.size();
+    const uint nsamples = m_opts.shadow_samples;
+    std::vector<byte> cls(BV.size() * nL, byte(shadow_class::Trace));
+    std::atomic<size_t> nlit = 0, nocc = 0;
+
+    auto tri_verts = [&](uint f) {
+        const auto& idx = F[f].Vidx;
+        return std::array<vec3, 3>{ V[idx[0]], V[idx[1]], V[idx[2]] };
+    };
+
+    const std::vector<bbox> tribb = bv_tri_bounds(BVbeg);
+
+    // calls fn on each triangle whose box may overlap the shaft from
+    // box r to l, until it returns false
+    auto for_shaft_tris = [&](const bbox& r, const vec3& l, auto&& fn)
+    {
+        for (uint b = 0; b < BV.size(); ++b)
+        {
+            if (BV[b].ntris == 0 || !shaft_overlaps(r, l, tribb[b])) { continue; }
+            for (uint f = BVbeg[b]; f < BVbeg[b + 1]; ++f)
+            {
+                if (shaft_overlaps(r, l, get_tri_bbox(V, F[f].Vidx)) && !fn(f)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+
+    auto proven_lit = [&](uint b, const vec3& l)
+    {
+        size_t work = 0;
+        return for_shaft_tris(tribb[b], l, [&](uint f)
+        {
+            const auto o = tri_verts(f);
+            for (uint g = BVbeg[b]; g < BVbeg[b + 1]; ++g)
+            {
+                if (++work > max_proof_work || !cannot_shadow(tri_verts(g), o, l)) {
+                    return false;
+                }
+            }
+            return true;
+        });
+    };
+
+    auto proven_occluded = [&](uint b, const vec3& l)
+    {
+        const auto rc = corners(tribb[b]);
+        return !for_shaft_tris(tribb[b], l, [&](uint f) {
+            return !covers(tri_verts(f), rc, l);
+        });
+    };
+
+    parallel_for(BV.size() * nL, [&](size_t i)
+    {
+        const uint b = uint(i / nL);
+        const size_t l = i % nL;
+        if (BV[b].ntris == 0) { return; }
+
+        // seeded per pair, so the result doesn't depend on threading
+        std::mt19937 rng{ uint(i) };
+        std::uniform_int_distribution<uint> pick_tri(BVbeg[b], BVbeg[b + 1] - 1);
+        std::uniform_real_distribution<float> unit(0, 1);
+
+        size_t nblocked = 0, ncast = 0;
+        for (uint s = 0; s < nsamples; ++s)
+        {
+            uint f;
+            vec3 p;
+            if (s < 3 * BV[b].ntris)
+            {
+                f = BVbeg[b] + s / 3;
+                p = V[F[f].Vidx[s % 3]];
+            }
+            else
+            {
+                f = pick_tri(rng);
+                float u = unit(rng), v = unit(rng);
+                if (u + v > 1) { u = 1 - u; v = 1 - v; }
+                const auto& idx = F[f].Vidx;
+                p = V[idx[0]] + u * (V[idx[1]] - V[idx[0]]) + v * (V[idx[2]] - V[idx[0]]);
+            }
+
+            nblocked += occluded(*this, BVbeg, p, L[l].pos, f);
+            ncast++;
+
+            // mixed already, no proof can succeed
+            if (nblocked != 0 && nblocked != ncast) { return; }
+        }
+
+        if (nblocked == 0 && proven_lit(b, L[l].pos)) {
+            cls[i] = byte(shadow_class::Lit);
+            nlit++;
+        } else if (nblocked != 0 && proven_occluded(b, L[l].pos)) {
+            cls[i] = byte(shadow_class::Occluded);
+            nocc++;
+        }
+    });
+
+    m_shadowmask.clear();
+    m_shadowmask.reserve(BV.size() * packed_words(nL, 2));
+    std::vector<uint> words(packed_words(nL, 2));
+    for (size_t b = 0; b < BV.size(); ++b)
+    {
+        pack_bits(cls.data() + b * nL, nL, 2, words.data());
+        m_shadowmask.insert(m_shadowmask.end(), words.begin(), words.end());
+    }
+
+    auto tend = chrono::high_resolution_clock::now();
+    size_t npairs = BV.size() * nL;
+    std::printf("%s: shadow masks, %zu lit, %zu occluded, %zu to trace of %zu pair(s) in ",
+        pscname, size_t(nlit), size_t(nocc), npairs - nlit - nocc, npairs);
+    print_duration(std::cout << std::flush, tend - tbeg);
+    std::cout << "\n";
+    return 0;
+}
@@ -0,0 +1,639 @@
+
+#include "defs.hpp"
+#include "transport.hpp"
+
+#include "io.h"
+
+#ifdef __linux__
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// ------------------------------- TCP ---------------------------------
+
+#ifdef _WIN32
+static bool tcp_init = false;
+
+// no multithreading, so this is okay.
+static bool tcp_win32_initonce() {
+    if (!tcp_init) {
+        tcp_init = (TCP_win32_init() == 0);
+    }
+    return tcp_init;
+}
+#endif
+
+class tcp_link : public transport
+{
+public:
+    tcp_link(const std::string& host, const std::string& port, bool zerocopy,
+        bool delta, bool pack, bool verbose) :
+        m_name("FPGA at '" + host + "'"), m_host(host), m_port(port),
+        m_zerocopy(zerocopy), m_delta(delta), m_pack(pack), m_verbose(verbose)
+    {}
+    ~tcp_link() { end_frame(); }
+
+    const std::string& name() const override { return m_name; }
+
+    int send_scene(std::span<const uint> scene, int fd, const char*& method) override
+    {
+#ifdef _WIN32
+        if (!tcp_win32_initonce()) {
+            return mERROR("failed to initialize TCP");
+        }
+#endif
+        if (connect() != 0) {
+            return -1;
+        }
+        if (m_delta)
+        {
+            const size_t nblocks = (scene.size() + delta_block_words - 1) / delta_block_words;
+            std::vector<uint> missing;
+            int e = send_offer(scene, missing);
+            if (e < 0) { return e; }
+            else if (e == 0 && missing.size() < nblocks) {
+                return send_blocks(scene, missing, method);
+            }
+            else if (e > 0)
+            {
+                std::printf("%s does not take delta uploads, sending whole scenes\n", m_name.c_str());
+                m_delta = false;
+                end_frame();
+                if (connect() != 0) {
+                    return -1;
+                }
+            }
+            // else the device is missing everything
+        }
+        if (m_pack) {
+            return send_message(scene, m_delta ? "delta, all blocks, " : "", method);
+        }
+
+        const uint nbytes = uint(scene.size_bytes());
+        method = m_delta ? "delta, all blocks" : "buffered";
+#ifdef __linux__
+        if (m_zerocopy)
+        {
+            static constexpr const char* names[] = {
+                "buffered", "sendfile", "zero-copy", "zero-copy, copied by kernel" };
+            send_method used;
+            if (send_frame_zerocopy(m_sock, scene.data(), nbytes, fd, used, m_verbose) != 0) {
+                return -1;
+            }
+            method = m_delta ? method : names[int(used)];
+            return 0;
+        }
+#else
+        if (m_zerocopy) {
+            std::printf("Zero-copy upload needs Linux, sending buffered\n");
+        }
+#endif
+        if (TCP_send2(m_sock, (char*)scene.data(), nbytes, m_verbose) != int(nbytes)) {
+            return -1;
+        }
+        return 0;
+    }
+
+    int recv_image(std::span<const char>& img) override
+    {
+        char* pdata;
+        int nrecv = TCP_recv2(m_sock, &pdata, m_verbose);
+        if (nrecv < 0) {
+            return mERROR("failed to receive image");
+        }
+        m_img = scoped_cptr<char[]>(pdata);
+        img = { pdata, size_t(nrecv) };
+        return 0;
+    }
+
+    void end_frame() override
+    {
+        if (m_sock != INV_SOCKET) {
+            TCP_close(m_sock);
+            m_sock = INV_SOCKET;
+        }
+        m_img.reset();
+    }
+
+private:
+    int connect()
+    {
+        m_sock = TCP_connect2(m_host.c_str(), m_port.c_str(), m_verbose);
+        return m_sock == INV_SOCKET ? -1 : 0;
+    }
+
+    // Offers the scene's block hashes, and gets the blocks the device
+    // asks for. Returns 1 if the device doesn't take delta uploads: it
+    // dropped the connection or answered anything but a delta reply
+    // (an image, an error, ...).
+    int send_offer(std::span<const uint> scene, std::vector<uint>& missing)
+    {
+        const size_t bw = delta_block_words;
+        const auto hashes = block_hashes(scene, bw);
+        const size_t nblocks = hashes.size();
+
+        std::vector<uint> offer(delta_offer_nhdr + 2 * nblocks);
+        offer[0] = DELTA_MAGIC;
+        offer[1] = uint(scene.size());
+        offer[2] = uint(bw);
+        offer[3] = uint(nblocks);
+        offer[4] = m_pack ? delta_packed : 0;
+        for (size_t b = 0; b < nblocks; ++b) {
+            offer[delta_offer_nhdr + 2 * b] = uint(hashes[b]);
+            offer[delta_offer_nhdr + 2 * b + 1] = uint(hashes[b] >> 32);
+        }
+        const int nbytes = int(offer.size() * sizeof(uint));
+        if (TCP_send2(m_sock, (char*)offer.data(), nbytes, m_verbose) != nbytes) {
+            return mERROR("failed to send block hashes");
+        }
+
+        char* pdata;
+        int nrecv = TCP_recv2(m_sock, &pdata, m_verbose);
+        if (nrecv < 0) {
+            return 1;
+        }
+        auto reply = scoped_cptr<char[]>(pdata);
+        if (size_t(nrecv) != (delta_reply_nhdr + packed_words(nblocks, 1)) * sizeof(uint)) {
+            return 1;
+        }
+        const uint* r = reinterpret_cast<const uint*>(pdata);
+        if (r[0] != DELTA_MAGIC || r[1] > nblocks) {
+            return 1;
+        }
+
+        missing.clear();
+        missing.reserve(r[1]);
+        for (size_t b = 0; b < nblocks; ++b) {
+            if ((r[delta_reply_nhdr + b / 32] >> (b % 32)) & 1) {
+                missing.push_back(uint(b));
+            }
+        }
+        if (missing.size() != r[1]) {
+            return 1;
+        }
+        return 0;
+    }
+
+    // Sends the missing blocks back to back.
+    int send_blocks(std::span<const uint> scene, const std::vector<uint>& missing, const char*& method)
+    {
+        const size_t bw = delta_block_words;
+        auto block = [&](size_t b) { return scene.subspan(b * bw, std::min(bw, scene.size() - b * bw)); };
+
+        std::vector<size_t> offs(missing.size() + 1, 0);
+        for (size_t i = 0; i < missing.size(); ++i) {
+            offs[i + 1] = offs[i] + block(missing[i]).size();
+        }
+        std::vector<uint> data(offs.back());
+        parallel_for(missing.size(), [&](size_t i) {
+            ranges::copy(block(missing[i]), data.begin() + offs[i]);
+        });
+
+        char prefix[64];
+        std::snprintf(prefix, sizeof(prefix), "delta, %zu of %zu block(s), ",
+            missing.size(), (scene.size() + bw - 1) / bw);
+        return send_message(data, prefix, method);
+    }
+
+    // Sends words as one message, packed if asked. method tells how,
+    // after prefix.
+    int send_message(std::span<const uint> words, const std::string& prefix, const char*& method)
+    {
+        char desc[96];
+        if (m_pack)
+        {
+            auto tbeg = chrono::high_resolution_clock::now();
+            std::vector<byte> msg;
+            pack_words(words, msg);
+            double ms = chrono::duration<double, std::milli>(
+                chrono::high_resolution_clock::now() - tbeg).count();
+
+            const int nbytes = int(msg.size());
+            if (TCP_send2(m_sock, (char*)msg.data(), nbytes, m_verbose) != nbytes) {
+                return -1;
+            }
+            std::snprintf(desc, sizeof(desc), "packed to %.1f MB (%.2fx) in %.0f ms",
+                nbytes / 1e6, words.size_bytes() / double(nbytes), ms);
+        }
+        else
+        {
+            const int nbytes = int(words.size_bytes());
+            if (TCP_send2(m_sock, (char*)words.data(), nbytes, m_verbose) != nbytes) {
+                return -1;
+            }
+            std::snprintf(desc, sizeof(desc), "%.1f MB sent", nbytes / 1e6);
+        }
+        m_method = prefix + desc;
+        method = m_method.c_str();
+        return 0;
+    }
+
+    std::string m_name, m_host, m_port, m_method;
+    bool m_zerocopy, m_delta, m_pack, m_verbose;
+    socket_t m_sock = INV_SOCKET;
+    scopedCPtr<char[]> m_img = { nullptr, std::free };
+};
+
+std::unique_ptr<transport> tcp_transport(const std::string& host,
+    const std::string& port, bool zerocopy, bool delta, bool pack, bool verbose)
+{
+    return std::make_unique<tcp_link>(host, port, zerocopy, delta, pack, verbose);
+}
+
+std::vector<uint64_t> block_hashes(std::span<const uint> buf, size_t block_words)
+{
+    std::vector<uint64_t> out((buf.size() + block_words - 1) / block_words);
+    parallel_for(out.size(), [&](size_t b)
+    {
+        size_t beg = b * block_words;
+        out[b] = hash_words(buf.data() + beg, std::min(block_words, buf.size() - beg));
+    });
+    return out;
+}
+
+int make_transport(const std::string& dest, const std::string& default_port,
+    bool zerocopy, bool delta, bool pack, bool verbose, std::unique_ptr<transport>& out)
+{
+    if (dest.starts_with("shm:"))
+    {
+        if (zerocopy || delta || pack) {
+            return mERROR("options --zerocopy, --delta and --compress need a network destination");
+        }
+        return shm_transport(dest.substr(4), verbose, out);
+    }
+
+    size_t sepoff = dest.find(',');
+    if (sepoff == 0) {
+        return mERROR("missing FPGA hostname/ipaddr");
+    }
+    else if (sepoff == dest.npos) {
+        out = tcp_transport(dest, default_port, zerocopy, delta, pack, verbose);
+    }
+    else {
+        out = tcp_transport(dest.substr(0, sepoff), dest.substr(sepoff + 1), zerocopy, delta, pack, verbose);
+    }
+    return 0;
+}
+
+// -------------------------- shared memory ----------------------------
+
+#ifdef __linux__
+
+static constexpr uint SHM_MAGIC = 0x52544C4B;
+static constexpr uint SHM_VERSION = 1;
+
+// Messages start on a 64-byte boundary with a 64-byte header (size,
+// then slot size). A message never wraps around: if it doesn't fit
+// before the end of the ring, a wrap mark sends readers to the start.
+static constexpr uint64_t msg_align = 64;
+static constexpr uint64_t wrap_mark = ~uint64_t(0);
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free &&
+    std::atomic<int32_t>::is_always_lock_free, "atomics must work across processes");
+
+struct shm_ring
+{
+    alignas(64) std::atomic<uint64_t> head; // end of committed messages
+    alignas(64) std::atomic<uint64_t> tail; // end of released messages
+    sem_t nmsgs; // committed messages not yet taken
+    sem_t freed; // posted when messages are released
+};
+
+struct shm_link::ctl
+{
+    uint magic, version;
+    uint64_t ring_bytes;
+    int32_t device_pid;
+    std::atomic<int32_t> host_pid; // 0 if no host is attached
+    shm_ring ring[2];
+};
+
+static constexpr size_t shm_page = 4096;
+
+static std::string shm_path(const std::string& name) {
+    return name.starts_with('/') ? name : "/" + name;
+}
+
+static bool pid_alive(int32_t pid) {
+    return pid > 0 && (::kill(pid, 0) == 0 || errno == EPERM);
+}
+
+byte* shm_link::ring_data(ring_id r) const
+{
+    return reinterpret_cast<byte*>(m_ctl) + round_up(sizeof(ctl), shm_page) +
+        r * m_ctl->ring_bytes;
+}
+
+size_t shm_link::ring_bytes() const { return m_ctl ? m_ctl->ring_bytes : 0; }
+
+bool shm_link::peer_alive() const
+{
+    // the device waits for hosts to come and go
+    return m_owner || pid_alive(m_ctl->device_pid);
+}
+
+// Waits on s in 1s slices, for up to timeout_ms (< 0: while pred()).
+// Returns 0 when acquired, 1 on timeout, -1 otherwise.
+template <typename Pred>
+static int sem_wait_for(sem_t* s, int timeout_ms, Pred&& pred)
+{
+    auto tbeg = chrono::steady_clock::now();
+    for (;;)
+    {
+        timespec ts;
+        ::clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        if (::sem_timedwait(s, &ts) == 0) { return 0; }
+        if (errno == EINTR) { continue; }
+        if (errno != ETIMEDOUT) { return -1; }
+
+        auto waited = chrono::steady_clock::now() - tbeg;
+        if (timeout_ms >= 0 && waited >= chrono::milliseconds(timeout_ms)) { return 1; }
+        if (!pred()) { return -1; }
+    }
+}
+
+int shm_link::create(const std::string& name, size_t ring_bytes)
+{
+    close();
+    const std::string path = shm_path(name);
+    ring_bytes = round_up(std::max(ring_bytes, shm_page), shm_page);
+    const size_t size = round_up(sizeof(ctl), shm_page) + 2 * ring_bytes;
+
+    ::shm_unlink(path.c_str()); // left over from a crash
+    int fd = ::shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        return mERROR("could not create shm:%s (%s)", name.c_str(), std::strerror(errno));
+    }
+    void* p = MAP_FAILED;
+    if (::ftruncate(fd, off_t(size)) == 0) {
+        p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        ::shm_unlink(path.c_str());
+        return mERROR("could not map shm:%s (%s)", name.c_str(), std::strerror(errno));
+    }
+
+    m_ctl = new (p) ctl{};
+    m_ctl->version = SHM_VERSION;
+    m_ctl->ring_bytes = ring_bytes;
+    m_ctl->device_pid = int32_t(::getpid());
+    for (auto& r : m_ctl->ring) {
+        ::sem_init(&r.nmsgs, 1, 0);
+        ::sem_init(&r.freed, 1, 0);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    m_ctl->magic = SHM_MAGIC;
+
+    m_name = name;
+    m_size = size;
+    m_owner = true;
+    m_rd[ToDevice] = m_rdend[ToDevice] = 0;
+    return 0;
+}
+
+int shm_link::attach(const std::string& name)
+{
+    close();
+    const std::string path = shm_path(name);
+    int fd = ::shm_open(path.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        return mERROR("no device at shm:%s", name.c_str());
+    }
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (::fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(ctl)) {
+        p = ::mmap(nullptr, size_t(st.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        return mERROR("could not map shm:%s", name.c_str());
+    }
+    m_ctl = static_cast<ctl*>(p);
+    m_size = size_t(st.st_size);
+    m_name = name;
+
+    if (m_ctl->magic != SHM_MAGIC || m_ctl->version != SHM_VERSION ||
+        m_size < round_up(sizeof(ctl), shm_page) + 2 * m_ctl->ring_bytes) {
+        close();
+        return mERROR("shm:%s is not an rthost link", name.c_str());
+    }
+    if (!pid_alive(m_ctl->device_pid)) {
+        close();
+        return mERROR("device at shm:%s is gone", name.c_str());
+    }
+
+    // one host at a time, but take over from one that died
+    int32_t pid = int32_t(::getpid()), other = 0;
+    while (!m_ctl->host_pid.compare_exchange_strong(other, pid))
+    {
+        if (pid_alive(other)) {
+            m_ctl = nullptr; // not ours to release
+            ::munmap(p, m_size);
+            return mERROR("shm:%s is in use by process %d", name.c_str(), int(other));
+        }
+    }
+
+    // drop images left for an earlier host
+    shm_ring& r = m_ctl->ring[ToHost];
+    while (::sem_trywait(&r.nmsgs) == 0) {}
+    r.tail.store(r.head.load(std::memory_order_acquire), std::memory_order_release);
+    ::sem_post(&r.freed);
+    m_rd[ToHost] = m_rdend[ToHost] = r.tail.load();
+    return 0;
+}
+
+void shm_link::close()
+{
+    if (!m_ctl) { return; }
+    if (m_owner)
+    {
+        for (auto& r : m_ctl->ring) {
+            ::sem_destroy(&r.nmsgs);
+            ::sem_destroy(&r.freed);
+        }
+        ::shm_unlink(shm_path(m_name).c_str());
+    }
+    else { m_ctl->host_pid.store(0); }
+
+    ::munmap(m_ctl, m_size);
+    m_ctl = nullptr;
+    m_owner = false;
+}
+
+int shm_link::reserve(ring_id r, size_t n, byte*& p)
+{
+    shm_ring& ring = m_ctl->ring[r];
+    const uint64_t cap = m_ctl->ring_bytes;
+    const uint64_t slot = msg_align + round_up(n, msg_align);
+    if (slot > cap) {
+        return mERROR("%zu bytes don't fit in shm:%s (ring of %zu bytes)",
+            n, m_name.c_str(), size_t(cap));
+    }
+
+    const uint64_t head = ring.head.load(std::memory_order_relaxed);
+    const uint64_t off = head % cap;
+    const uint64_t skip = off + slot > cap ? cap - off : 0;
+    while (head + skip + slot - ring.tail.load(std::memory_order_acquire) > cap)
+    {
+        if (sem_wait_for(&ring.freed, -1, [&] { return peer_alive(); }) < 0) {
+            return mERROR("shm:%s: peer is gone", m_name.c_str());
+        }
+    }
+
+    byte* data = ring_data(r);
+    if (skip) {
+        std::memcpy(data + off, &wrap_mark, sizeof(wrap_mark));
+    }
+    m_wr[r] = { head, skip, slot };
+    p = data + (head + skip) % cap + msg_align;
+    return 0;
+}
+
+void shm_link::commit(ring_id r, size_t n)
+{
+    shm_ring& ring = m_ctl->ring[r];
+    const pending& w = m_wr[r];
+    const uint64_t hdr[2] = { n, w.slot };
+    std::memcpy(ring_data(r) + (w.pos + w.skip) % m_ctl->ring_bytes, hdr, sizeof(hdr));
+
+    ring.head.store(w.pos + w.skip + w.slot, std::memory_order_release);
+    ::sem_post(&ring.nmsgs);
+}
+
+int shm_link::next(ring_id r, std::span<const byte>& msg, int timeout_ms)
+{
+    shm_ring& ring = m_ctl->ring[r];
+    int e = sem_wait_for(&ring.nmsgs, timeout_ms, [&] { return peer_alive(); });
+    if (e > 0) { return 1; }
+    else if (e < 0) {
+        return mERROR("shm:%s: peer is gone", m_name.c_str());
+    }
+    ring.head.load(std::memory_order_acquire);
+
+    const uint64_t cap = m_ctl->ring_bytes;
+    const byte* data = ring_data(r);
+    uint64_t rd = m_rd[r];
+    uint64_t hdr[2];
+    std::memcpy(hdr, data + rd % cap, sizeof(hdr));
+    if (hdr[0] == wrap_mark)
+    {
+        rd += cap - rd % cap;
+        std::memcpy(hdr, data, sizeof(hdr));
+    }
+    msg = { data + rd % cap + msg_align, size_t(hdr[0]) };
+    m_rd[r] = rd;
+    m_rdend[r] = rd + hdr[1];
+    return 0;
+}
+
+void shm_link::release(ring_id r)
+{
+    shm_ring& ring = m_ctl->ring[r];
+    ring.tail.store(m_rdend[r], std::memory_order_release);
+    m_rd[r] = m_rdend[r];
+    ::sem_post(&ring.freed);
+}
+
+// Host end: scenes are serialized straight into the ring, and images
+// are written from where the device put them.
+class shm_host_link : public transport
+{
+public:
+    shm_host_link(const std::string& name) : m_name("shm:" + name) {}
+
+    int attach(const std::string& name) { return m_link.attach(name); }
+
+    const std::string& name() const override { return m_name; }
+
+    uint* scene_buffer(size_t nwords) override
+    {
+        byte* p;
+        if (m_link.reserve(shm_link::ToDevice, nwords * sizeof(uint), p) != 0) {
+            return nullptr;
+        }
+        m_resv = reinterpret_cast<uint*>(p);
+        m_resv_words = nwords;
+        return m_resv;
+    }
+
+    int send_scene(std::span<const uint> scene, int, const char*& method) override
+    {
+        method = "shared memory";
+        if (scene.data() != m_resv || scene.size() > m_resv_words)
+        {
+            if (!scene_buffer(scene.size())) { return -1; }
+            std::memcpy(m_resv, scene.data(), scene.size_bytes());
+            method = "shared memory, copied";
+        }
+        m_link.commit(shm_link::ToDevice, scene.size_bytes());
+        m_resv = nullptr;
+        return 0;
+    }
+
+    int recv_image(std::span<const char>& img) override
+    {
+        std::span<const byte> msg;
+        if (m_link.next(shm_link::ToHost, msg) != 0) {
+            return mERROR("failed to receive image");
+        }
+        m_has_img = true;
+        if (msg.empty()) {
+            return mERROR("device did not return an image");
+        }
+        img = { reinterpret_cast<const char*>(msg.data()), msg.size() };
+        return 0;
+    }
+
+    void end_frame() override
+    {
+        if (m_has_img) {
+            m_link.release(shm_link::ToHost);
+            m_has_img = false;
+        }
+    }
+
+private:
+    std::string m_name;
+    shm_link m_link;
+    uint* m_resv = nullptr;
+    size_t m_resv_words = 0;
+    bool m_has_img = false;
+};
+
+int shm_transport(const std::string& name, bool, std::unique_ptr<transport>& out)
+{
+    auto link = std::make_unique<shm_host_link>(name);
+    if (int e = link->attach(name)) {
+        return e;
+    }
+    out = std::move(link);
+    return 0;
+}
+
+#else
+
+struct shm_link::ctl {};
+
+int shm_link::create(const std::string&, size_t) { return mERROR("shared memory links need Linux"); }
+int shm_link::attach(const std::string&) { return mERROR("shared memory links need Linux"); }
+void shm_link::close() {}
+int shm_link::reserve(ring_id, size_t, byte*&) { return -1; }
+void shm_link::commit(ring_id, size_t) {}
+int shm_link::next(ring_id, std::span<const byte>&, int) { return -1; }
+void shm_link::release(ring_id) {}
+size_t shm_link::ring_bytes() const { return 0; }
+
+int shm_transport(const std::string&, bool, std::unique_ptr<transport>&)
+{
+    return mERROR("shared memory links need Linux");
+}
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef TRANSPORT_HPP
+#define TRANSPORT_HPP
+
+#include <span>
+
+#include "utils.hpp"
+
+// Connection to the FPGA, or to something standing in for it. A frame
+// is one scene sent and one image received, then end_frame().
+class transport
+{
+public:
+    virtual ~transport() = default;
+
+    // Where frames go, for messages.
+    virtual const std::string& name() const = 0;
+
+    // Memory to serialize a scene of nwords into, if the transport can
+    // send it from there without a copy (else nullptr). Valid until
+    // the end of the frame.
+    virtual uint* scene_buffer(size_t /*nwords*/) { return nullptr; }
+
+    // fd is a file holding the scene at offset 0, or -1. method is set
+    // to how it was sent.
+    virtual int send_scene(std::span<const uint> scene, int fd, const char*& method) = 0;
+
+    // The image stays valid until end_frame().
+    virtual int recv_image(std::span<const char>& img) = 0;
+
+    virtual void end_frame() {}
+};
+
+// TCP to <host>:<port>, one connection per frame. With zerocopy, scenes
+// are sent with send_frame_zerocopy() (Linux). With delta, scenes are
+// sent as delta uploads until the device turns out not to take them.
+// With pack, scene data is packed (see pack_words()).
+std::unique_ptr<transport> tcp_transport(const std::string& host,
+    const std::string& port, bool zerocopy, bool delta, bool pack, bool verbose);
+
+// Delta uploads (TCP): instead of the scene, the host first sends an
+// offer, { DELTA_MAGIC, nwords, block_words, nblocks, flags, then the
+// hash_words() of each block of the scene, low word first }. The
+// device keeps the last scene it got this way, and answers with the
+// blocks it doesn't hold, { DELTA_MAGIC, nmissing, bitmap of nblocks }.
+// The host then sends those blocks back to back (maybe none), packed
+// if flags has delta_packed, and the frame goes on as usual. A device
+// that doesn't know offers drops the connection, as for any bad scene.
+constexpr uint DELTA_MAGIC = 0x44454C54;
+constexpr uint delta_offer_nhdr = 5;
+constexpr uint delta_reply_nhdr = 2;
+constexpr uint delta_packed = 1;
+constexpr size_t delta_block_words = size_t(1) << 16; // 256 KB
+
+// Hashes of each block_words block of buf, on all hardware threads.
+std::vector<uint64_t> block_hashes(std::span<const uint> buf, size_t block_words);
+
+// Packed scenes (TCP, see wire.cpp): words are sent in a message of
+// { PACK_MAGIC, nwords, block_words, nblocks, packed size of each
+// block }, then the blocks back to back. A device tells a packed scene
+// from a plain one by the magic number.
+constexpr uint PACK_MAGIC = 0x5041434B;
+constexpr uint pack_nhdr = 4;
+constexpr size_t pack_block_words = size_t(1) << 16; // 256 KB
+
+// Packs words into a message, on all hardware threads.
+void pack_words(std::span<const uint> words, std::vector<byte>& out);
+// Unpacks a message from pack_words(). Nonzero if it is malformed.
+int unpack_words(std::span<const byte> msg, std::vector<uint>& out);
+
+// Shared memory link to a device proxy on this machine, created by
+// the proxy (see shm_link).
+int shm_transport(const std::string& name, bool verbose, std::unique_ptr<transport>& out);
+
+// Transport for a destination as given to --dest: "shm:<name>", or
+// "<host>[,<port>]" (default_port if omitted).
+int make_transport(const std::string& dest, const std::string& default_port,
+    bool zerocopy, bool delta, bool pack, bool verbose, std::unique_ptr<transport>& out);
+
+struct scene_opts;
+
+// Render service on a Unix socket (see daemon.cpp): builds scenes with
+// opts, keeps up to cache_bytes of them serialized, and renders jobs
+// on the devices, one at a time each.
+int run_daemon(const fs::path& socket_path, std::vector<std::unique_ptr<transport>>& devices,
+    size_t cache_bytes, const scene_opts& opts);
+
+// Two single-producer, single-consumer rings in a POSIX shared memory
+// object: scenes from the host to the device, images back. Messages
+// are contiguous and are written and read in place, so neither side
+// copies them. The device creates the link and the host attaches to it;
+// one host at a time. Linux only.
+class shm_link
+{
+public:
+    enum ring_id { ToDevice = 0, ToHost = 1 };
+
+    shm_link() = default;
+    shm_link(const shm_link&) = delete;
+    shm_link& operator=(const shm_link&) = delete;
+    ~shm_link() { close(); }
+
+    // Device side: creates the link with rings of ring_bytes each.
+    int create(const std::string& name, size_t ring_bytes);
+    // Host side: attaches to an existing link.
+    int attach(const std::string& name);
+    void close();
+
+    // Producer: reserves room for a message of up to n bytes, waiting
+    // for the consumer to free space.
+    int reserve(ring_id r, size_t n, byte*& p);
+    // Publishes the reserved message, with its final size (<= n).
+    void commit(ring_id r, size_t n);
+
+    // Consumer: waits for the next message (timeout_ms < 0 waits until
+    // the peer is gone). Returns 1 on timeout.
+    int next(ring_id r, std::span<const byte>& msg, int timeout_ms = -1);
+    // Frees the current message.
+    void release(ring_id r);
+
+    size_t ring_bytes() const;
+
+private:
+    struct ctl;
+    struct pending { uint64_t pos = 0, skip = 0, slot = 0; };
+
+    bool peer_alive() const;
+    byte* ring_data(ring_id r) const;
+
+    std::string m_name;
+    ctl* m_ctl = nullptr;
+    size_t m_size = 0;
+    bool m_owner = false;
+    pending m_wr[2]; // reserved message, per ring
+    uint64_t m_rd[2] = {}, m_rdend[2] = {}; // current message, per ring
+};
+
+#endif
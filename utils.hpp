@@ -2,6 +2,7 @@
 #define UTILS_HPP
 
 #include <cstdio>
+#include <cstring>
 #include <cmath>
 #include <limits>
 #include <memory>
@@ -13,6 +14,32 @@
 #include <filesystem>
 #include <chrono>
 #include <bit>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSSE3__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #define CONCAT(x, y) x##y
 
@@ -118,6 +145,90 @@ inline int write_file(const fs::path& outpath, const BufWithSize<T>& buf)
     return write_file(outpath, buf.ptr.get(), buf.size);
 }
 
+// Read-only memory-mapped file.
+// Large binary inputs are read through this instead of
+// read_file() to avoid copying them into a heap buffer.
+class mapped_file
+{
+public:
+    mapped_file() = default;
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+    ~mapped_file() { close(); }
+
+    // populate: read the whole file in now rather than on first access
+    int open(const fs::path& inpath, bool populate = false)
+    {
+        close();
+        std::error_code ec;
+        auto fsize = fs::file_size(inpath, ec);
+        if (ec) { return mERROR("could not open input file"); }
+        if (fsize == 0) { return 0; }
+#ifdef _WIN32
+        m_file = ::CreateFileW(inpath.c_str(), GENERIC_READ, FILE_SHARE_READ,
+            nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE) {
+            return mERROR("could not open input file");
+        }
+        m_map = ::CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!m_map) { close(); return mERROR("could not map input file"); }
+
+        void* p = ::MapViewOfFile(m_map, FILE_MAP_READ, 0, 0, 0);
+        if (!p) { close(); return mERROR("could not map input file"); }
+#else
+        m_fd = ::open(inpath.c_str(), O_RDONLY);
+        if (m_fd < 0) { return mERROR("could not open input file"); }
+
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        if (populate) { flags |= MAP_POPULATE; }
+#endif
+        void* p = ::mmap(nullptr, fsize, PROT_READ, flags, m_fd, 0);
+        if (p == MAP_FAILED) { close(); return mERROR("could not map input file"); }
+        ::madvise(p, fsize, MADV_SEQUENTIAL);
+        if (populate) { ::madvise(p, fsize, MADV_WILLNEED); }
+#endif
+        m_data = static_cast<const byte*>(p);
+        m_size = fsize;
+        return 0;
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        if (m_data) { ::UnmapViewOfFile(m_data); }
+        if (m_map) { ::CloseHandle(m_map); }
+        if (m_file != INVALID_HANDLE_VALUE) { ::CloseHandle(m_file); }
+        m_map = nullptr;
+        m_file = INVALID_HANDLE_VALUE;
+#else
+        if (m_data) { ::munmap(const_cast<byte*>(m_data), m_size); }
+        if (m_fd >= 0) { ::close(m_fd); }
+        m_fd = -1;
+#endif
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    const byte* data() const { return m_data; }
+    size_t size() const { return m_size; }
+#ifdef _WIN32
+    int fd() const { return -1; }
+#else
+    int fd() const { return m_fd; }
+#endif
+
+private:
+    const byte* m_data = nullptr;
+    size_t m_size = 0;
+#ifdef _WIN32
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_map = nullptr;
+#else
+    int m_fd = -1;
+#endif
+};
+
 template <typename T>
 using scopedCPtr = std::unique_ptr<T, void(*)(void*)>;
 
@@ -180,6 +291,28 @@ constexpr T ulog2(T val) { return std::bit_width(val) - 1; }
 template <typename T>
 constexpr bool is_powof2(T val) { return std::has_single_bit(val); }
 
+// Words needed to pack n values of bits each.
+inline uint packed_words(size_t n, uint bits)
+{
+    return uint((n * bits + 31) / 32);
+}
+
+// Packs values LSB first, bits wide (a divisor of 32), into whole words.
+template <typename T>
+inline uint* pack_bits(const T* vals, size_t n, uint bits, uint* p)
+{
+    const uint per_word = 32 / bits;
+    for (size_t i = 0; i < n; i += per_word)
+    {
+        uint w = 0;
+        for (uint j = 0; j < per_word && i + j < n; ++j) {
+            w |= uint(vals[i + j]) << (j * bits);
+        }
+        *p++ = w;
+    }
+    return p;
+}
+
 template <typename = void>
 struct luts {
     static constexpr bool is_ws[] = {
@@ -209,6 +342,130 @@ constexpr char to_upper(char c) {
     return ('a' <= c && c <= 'z') ? c ^ 0x20 : c;
 }
 
+// n rounded up to a multiple of align.
+constexpr uint64_t round_up(uint64_t n, uint64_t align) {
+    return (n + align - 1) / align * align;
+}
+
+// Max threads parallel_for() uses when called from this thread, 0 for
+// all of them. Set by code already running several jobs at once.
+inline thread_local size_t thread_budget = 0;
+
+inline size_t num_threads()
+{
+    size_t n = std::max(1u, std::thread::hardware_concurrency());
+    return thread_budget ? std::min(n, thread_budget) : n;
+}
+
+// Runs fn(i) for i in [0, n) on all hardware threads (or the
+// thread_budget). Iterations are handed out in chunks of grain,
+// so uneven work is balanced.
+template <typename Fn>
+inline void parallel_for(size_t n, Fn&& fn, size_t grain = 1)
+{
+    size_t nchunks = (n + grain - 1) / grain;
+    size_t nthreads = std::min(num_threads(), nchunks);
+    if (nthreads <= 1) {
+        for (size_t i = 0; i < n; ++i) { fn(i); }
+        return;
+    }
+
+    std::atomic<size_t> next = 0;
+    auto worker = [&]
+    {
+        for (;;)
+        {
+            size_t beg = next.fetch_add(grain);
+            if (beg >= n) { break; }
+            size_t end = std::min(n, beg + grain);
+            for (size_t i = beg; i < end; ++i) { fn(i); }
+        }
+    };
+
+    std::vector<std::jthread> threads;
+    for (size_t i = 1; i < nthreads; ++i) {
+        threads.emplace_back([&, budget = thread_budget] {
+            thread_budget = budget;
+            worker();
+        });
+    }
+    worker();
+}
+
+// Byte-swaps n words from src into dst (which may be src).
+inline void bswap32_words(const uint* src, uint* dst, size_t n)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i mask = _mm256_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_shuffle_epi8(v, mask));
+    }
+#elif defined(__SSSE3__)
+    const __m128i mask = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_shuffle_epi8(v, mask));
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        // swap the 16-bit halves, then the bytes of each half
+        v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), v);
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4) {
+        vst1q_u8(reinterpret_cast<uint8_t*>(dst + i),
+            vrev32q_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(src + i))));
+    }
+#endif
+    for (; i < n; ++i) { dst[i] = bswap32(src[i]); }
+}
+
+// bswap32_words() on all hardware threads.
+inline void parallel_bswap32(const uint* src, uint* dst, size_t n)
+{
+    constexpr size_t block = 1 << 16; // words
+    parallel_for((n + block - 1) / block, [&](size_t b)
+    {
+        size_t beg = b * block;
+        bswap32_words(src + beg, dst + beg, std::min(block, n - beg));
+    });
+}
+
+// 64-bit hash of n words, to tell whether data changed (not
+// cryptographic). Four independent lanes of 64-bit multiply-rotate.
+inline uint64_t hash_words(const uint* p, size_t n)
+{
+    constexpr uint64_t k1 = 0x9E3779B185EBCA87ull, k2 = 0xC2B2AE3D27D4EB4Full;
+    uint64_t h[4] = { k1 + k2, k2, 0, 0 - k1 };
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        for (int l = 0; l < 4; ++l)
+        {
+            uint64_t v;
+            std::memcpy(&v, p + i + 2 * l, sizeof(v));
+            h[l] = std::rotl(h[l] + v * k2, 31) * k1;
+        }
+    }
+    uint64_t r = std::rotl(h[0], 1) + std::rotl(h[1], 7) +
+        std::rotl(h[2], 12) + std::rotl(h[3], 18) + n;
+    for (; i < n; ++i) {
+        r = std::rotl(r ^ (p[i] * k1), 23) * k2;
+    }
+    // final mix (from MurmurHash3)
+    r ^= r >> 33; r *= 0xFF51AFD7ED558CCDull;
+    r ^= r >> 33; r *= 0xC4CEB9FE1A85EC53ull;
+    return r ^ (r >> 33);
+}
+
 template <typename OStream, typename T>
 inline void print_duration(OStream& os, T time)
 {
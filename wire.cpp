@@ -0,0 +1,276 @@
+
+#include <cstdio>
+#include <cstring>
+
+#include "defs.hpp"
+#include "transport.hpp"
+
+// Packed scenes: each block of words goes through a delta filter,
+// zigzag varints and a byte-level LZ, independently of the others, so
+// both ends work on all threads.
+
+// --------------------------------- LZ ---------------------------------
+
+// LZ4-like sequences: a token (literal count << 4 | match length - 4,
+// 15 meaning more follows in bytes of up to 255), the literals, then a
+// 16-bit little-endian offset and the rest of the match length. The
+// last sequence has literals only.
+static constexpr size_t lz_min_match = 4;
+static constexpr int lz_hash_bits = 14;
+
+static void lz_put_len(std::vector<byte>& out, size_t v)
+{
+    for (; v >= 255; v -= 255) { out.push_back(255); }
+    out.push_back(byte(v));
+}
+
+static void lz_put_seq(std::vector<byte>& out, const byte* lit, size_t nlit,
+    size_t off, size_t mlen)
+{
+    const size_t mcode = mlen ? mlen - lz_min_match : 0;
+    out.push_back(byte((std::min<size_t>(nlit, 15) << 4) | std::min<size_t>(mcode, 15)));
+    if (nlit >= 15) { lz_put_len(out, nlit - 15); }
+    out.insert(out.end(), lit, lit + nlit);
+    if (mlen == 0) { return; }
+
+    out.push_back(byte(off));
+    out.push_back(byte(off >> 8));
+    if (mcode >= 15) { lz_put_len(out, mcode - 15); }
+}
+
+static void lz_compress(const byte* in, size_t n, std::vector<byte>& out)
+{
+    std::vector<uint32_t> table(size_t(1) << lz_hash_bits, UINT32_MAX);
+    auto hash4 = [&](size_t p)
+    {
+        uint32_t v;
+        std::memcpy(&v, in + p, sizeof(v));
+        return (v * 2654435761u) >> (32 - lz_hash_bits);
+    };
+
+    size_t anchor = 0, i = 0;
+    while (i + lz_min_match <= n)
+    {
+        uint32_t& slot = table[hash4(i)];
+        const size_t cand = slot;
+        slot = uint32_t(i);
+        if (cand == UINT32_MAX || i - cand > 0xFFFF ||
+            std::memcmp(in + cand, in + i, lz_min_match) != 0)
+        {
+            // skip faster through data that doesn't match
+            i += 1 + ((i - anchor) >> 6);
+            continue;
+        }
+        size_t len = lz_min_match;
+        while (i + len < n && in[cand + len] == in[i + len]) { ++len; }
+
+        lz_put_seq(out, in + anchor, i - anchor, i - cand, len);
+        i += len;
+        anchor = i;
+    }
+    lz_put_seq(out, in + anchor, n - anchor, 0, 0);
+}
+
+static bool lz_decompress(const byte* in, size_t n, byte* out, size_t nout)
+{
+    const byte* ip = in;
+    const byte* const iend = in + n;
+    byte* op = out;
+    byte* const oend = out + nout;
+
+    auto get_len = [&](size_t& v)
+    {
+        byte b;
+        do {
+            if (ip == iend) { return false; }
+            b = *ip++;
+            v += b;
+        } while (b == 255);
+        return true;
+    };
+
+    while (ip < iend)
+    {
+        const byte tok = *ip++;
+        size_t nlit = tok >> 4;
+        if (nlit == 15 && !get_len(nlit)) { return false; }
+        if (nlit > size_t(iend - ip) || nlit > size_t(oend - op)) { return false; }
+        std::memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (op == oend) { return ip == iend; }
+
+        if (iend - ip < 2) { return false; }
+        const size_t off = ip[0] | size_t(ip[1]) << 8;
+        ip += 2;
+        size_t mlen = tok & 15;
+        if (mlen == 15 && !get_len(mlen)) { return false; }
+        mlen += lz_min_match;
+        if (off == 0 || off > size_t(op - out) || mlen > size_t(oend - op)) { return false; }
+
+        // matches may overlap what they produce
+        const byte* m = op - off;
+        if (off >= mlen) {
+            std::memcpy(op, m, mlen);
+        } else {
+            for (size_t k = 0; k < mlen; ++k) { op[k] = m[k]; }
+        }
+        op += mlen;
+    }
+    return op == oend;
+}
+
+// ------------------------------- blocks -------------------------------
+
+// Delta strides tried on each block: none, words, vec3s (vertices and
+// normals, in BV order in the dup format) and BV records.
+static constexpr uint pack_strides[] = { 0, 1, vec3::nserial, bv::nserial };
+
+static uint zigzag(uint d) { return (d << 1) ^ uint(int(d) >> 31); }
+static uint unzigzag(uint z) { return (z >> 1) ^ (0u - (z & 1)); }
+
+static uint delta(const uint* w, size_t i, uint stride) {
+    return stride && i >= stride ? w[i] - w[i - stride] : w[i];
+}
+
+static size_t varint_size(uint v) { return (std::bit_width(v | 1) + 6) / 7; }
+
+// Block: stride (1 byte), varint bytes (4 bytes), LZ of the varints.
+static void pack_block(const uint* w, size_t n, std::vector<byte>& out)
+{
+    // pick the stride by the varint size of a sample of the block (a
+    // step coprime with the strides, so every field gets sampled)
+    constexpr size_t sample_step = 5;
+    uint best = 0;
+    size_t best_size = SIZE_MAX;
+    for (uint s : pack_strides)
+    {
+        size_t size = 0;
+        for (size_t i = 0; i < n; i += sample_step) {
+            size += varint_size(zigzag(delta(w, i, s)));
+        }
+        if (size < best_size) {
+            best = s;
+            best_size = size;
+        }
+    }
+
+    std::vector<byte> var(n * 5);
+    byte* p = var.data();
+    for (size_t i = 0; i < n; ++i)
+    {
+        uint z = zigzag(delta(w, i, best));
+        for (; z >= 0x80; z >>= 7) { *p++ = byte(z | 0x80); }
+        *p++ = byte(z);
+    }
+    var.resize(p - var.data());
+
+    out.push_back(byte(best));
+    const uint32_t nvar = uint32_t(var.size());
+    out.insert(out.end(), reinterpret_cast<const byte*>(&nvar),
+        reinterpret_cast<const byte*>(&nvar) + sizeof(nvar));
+    lz_compress(var.data(), var.size(), out);
+}
+
+static bool unpack_block(const byte* p, size_t nbytes, uint* w, size_t n)
+{
+    if (nbytes < 5) { return false; }
+    const uint stride = p[0];
+    if (ranges::find(pack_strides, stride) == std::end(pack_strides)) { return false; }
+    uint32_t nvar;
+    std::memcpy(&nvar, p + 1, sizeof(nvar));
+    if (nvar > n * 5) { return false; }
+
+    std::vector<byte> var(nvar);
+    if (!lz_decompress(p + 5, nbytes - 5, var.data(), nvar)) { return false; }
+
+    size_t k = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        uint z = 0;
+        for (int shift = 0;; shift += 7)
+        {
+            if (k == nvar || shift > 28) { return false; }
+            byte b = var[k++];
+            z |= uint(b & 0x7F) << shift;
+            if (!(b & 0x80)) { break; }
+        }
+        const uint d = unzigzag(z);
+        w[i] = stride && i >= stride ? w[i - stride] + d : d;
+    }
+    return k == nvar;
+}
+
+// ------------------------------- messages -----------------------------
+
+void pack_words(std::span<const uint> words, std::vector<byte>& out)
+{
+    const size_t bw = pack_block_words;
+    const size_t nblocks = (words.size() + bw - 1) / bw;
+
+    std::vector<std::vector<byte>> blocks(nblocks);
+    parallel_for(nblocks, [&](size_t b)
+    {
+        const size_t beg = b * bw;
+        pack_block(words.data() + beg, std::min(bw, words.size() - beg), blocks[b]);
+    });
+
+    std::vector<uint> hdr(pack_nhdr + nblocks);
+    hdr[0] = PACK_MAGIC;
+    hdr[1] = uint(words.size());
+    hdr[2] = uint(bw);
+    hdr[3] = uint(nblocks);
+    std::vector<size_t> offs(nblocks + 1, hdr.size() * sizeof(uint));
+    for (size_t b = 0; b < nblocks; ++b)
+    {
+        hdr[pack_nhdr + b] = uint(blocks[b].size());
+        offs[b + 1] = offs[b] + blocks[b].size();
+    }
+
+    out.resize(offs.back());
+    std::memcpy(out.data(), hdr.data(), hdr.size() * sizeof(uint));
+    parallel_for(nblocks, [&](size_t b) {
+        ranges::copy(blocks[b], out.begin() + offs[b]);
+    });
+}
+
+int unpack_words(std::span<const byte> msg, std::vector<uint>& out)
+{
+    uint hdr[pack_nhdr];
+    if (msg.size() < sizeof(hdr)) {
+        return mERROR("packed scene: short header");
+    }
+    std::memcpy(hdr, msg.data(), sizeof(hdr));
+    const size_t nwords = hdr[1], bw = hdr[2], nblocks = hdr[3];
+    // a byte of LZ output makes at most 255 bytes of varints
+    if (hdr[0] != PACK_MAGIC || bw == 0 || nblocks != (nwords + bw - 1) / bw ||
+        msg.size() < (pack_nhdr + nblocks) * sizeof(uint) || nwords > msg.size() * 255) {
+        return mERROR("packed scene: bad header");
+    }
+
+    std::vector<size_t> offs(nblocks + 1, (pack_nhdr + nblocks) * sizeof(uint));
+    for (size_t b = 0; b < nblocks; ++b)
+    {
+        uint size;
+        std::memcpy(&size, msg.data() + (pack_nhdr + b) * sizeof(uint), sizeof(size));
+        offs[b + 1] = offs[b] + size;
+    }
+    if (offs.back() != msg.size()) {
+        return mERROR("packed scene: blocks don't add up to the message");
+    }
+
+    out.resize(nwords);
+    std::atomic<bool> bad = false;
+    parallel_for(nblocks, [&](size_t b)
+    {
+        const size_t beg = b * bw;
+        if (!unpack_block(msg.data() + offs[b], offs[b + 1] - offs[b],
+            out.data() + beg, std::min(bw, nwords - beg))) {
+            bad = true;
+        }
+    });
+    if (bad) {
+        return mERROR("packed scene: corrupt block");
+    }
+    return 0;
+}